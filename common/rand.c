@@ -3,7 +3,8 @@
 
 Simple random number generation
 
-Based on a linear congruential generator.
+rand_uint32/rand_float: based on a linear congruential generator.
+xrand_*: per-stream xorshift32 generators.
 
 */
 //-----------------------------------------------------------------------------
@@ -22,3 +23,45 @@ void rand_init(uint32_t seed) {
 }
 
 //-----------------------------------------------------------------------------
+
+void xrand_init(struct xrand *r, uint32_t seed) {
+	// derive the lane seeds with a hash so they are well separated
+	for (int i = 0; i < XRAND_LANES; i++) {
+		uint32_t x = seed + ((uint32_t)(i + 1) * 0x9e3779b9U);
+		x = (x ^ (x >> 16)) * 0x85ebca6bU;
+		x = (x ^ (x >> 13)) * 0xc2b2ae35U;
+		x ^= x >> 16;
+		// xorshift has a 0 fixed point
+		r->s[i] = (x == 0) ? 1 : x;
+	}
+}
+
+void xrand_fill(struct xrand *r, float *out, size_t n) {
+	uint32_t s0 = r->s[0];
+	uint32_t s1 = r->s[1];
+	uint32_t s2 = r->s[2];
+	uint32_t s3 = r->s[3];
+	while (n >= 4) {
+		s0 = xorshift32(s0);
+		s1 = xorshift32(s1);
+		s2 = xorshift32(s2);
+		s3 = xorshift32(s3);
+		out[0] = xrand_to_float(s0);
+		out[1] = xrand_to_float(s1);
+		out[2] = xrand_to_float(s2);
+		out[3] = xrand_to_float(s3);
+		out += 4;
+		n -= 4;
+	}
+	// remainder from lane 0
+	for (size_t i = 0; i < n; i++) {
+		s0 = xorshift32(s0);
+		out[i] = xrand_to_float(s0);
+	}
+	r->s[0] = s0;
+	r->s[1] = s1;
+	r->s[2] = s2;
+	r->s[3] = s3;
+}
+
+//-----------------------------------------------------------------------------
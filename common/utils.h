@@ -12,11 +12,15 @@ Common Utility Functions/Macros
 //-----------------------------------------------------------------------------
 
 #include <inttypes.h>
+#include <stddef.h>
 
 //-----------------------------------------------------------------------------
 
 #define ALIGN(x) __attribute__ ((aligned (x)))
 
+// uninitialised data in the CCM RAM (not zeroed at startup)
+#define CCM_BSS __attribute__ ((section (".ccmbss")))
+
 //-----------------------------------------------------------------------------
 // Q format to float conversions
 
@@ -76,6 +80,53 @@ static inline float rand_float(void) {
 	return *(float *)&i;
 }
 
+//-----------------------------------------------------------------------------
+// Fast PRNG streams
+// Each stream has its own state, so users (E.g. voices) don't share the global
+// rand_state. A stream is 4 independent xorshift32 generators, so block fills
+// make 4 values per iteration without a serial dependency between them.
+
+#define XRAND_LANES 4
+
+struct xrand {
+	uint32_t s[XRAND_LANES];
+};
+
+// seed a PRNG stream
+void xrand_init(struct xrand *r, uint32_t seed);
+
+// fill a buffer with floats from -1..1 (fastest when n is a multiple of XRAND_LANES)
+void xrand_fill(struct xrand *r, float *out, size_t n);
+
+static inline uint32_t xorshift32(uint32_t x) {
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+// uint32_t to a float from -1..1
+static inline float xrand_to_float(uint32_t x) {
+	union {
+		uint32_t i;
+		float f;
+	} u;
+	// 2..4 then offset to -1..1
+	u.i = 0x40000000 | (x >> 9);
+	return u.f - 3.f;
+}
+
+// return a random uint32_t (single values use lane 0)
+static inline uint32_t xrand_uint32(struct xrand *r) {
+	r->s[0] = xorshift32(r->s[0]);
+	return r->s[0];
+}
+
+// return a float from -1..1
+static inline float xrand_float(struct xrand *r) {
+	return xrand_to_float(xrand_uint32(r));
+}
+
 //-----------------------------------------------------------------------------
 
 static inline void reg_rmw(volatile uint32_t * reg, uint32_t mask, uint32_t val) {
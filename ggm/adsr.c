@@ -6,6 +6,8 @@ Attack Decay Sustain Release Envelopes
 */
 //-----------------------------------------------------------------------------
 
+#include <math.h>
+
 #include "ggm.h"
 
 #define DEBUG
@@ -36,11 +38,53 @@ static float get_k(float t) {
 	return 1.f - powe(LN_LEVEL_EPSILON / (t * AUDIO_FS));
 }
 
+// Return ln(1-k) to predict the number of samples in a segment.
+// Note: k comes from the (approximate) powe(), so work it out from k.
+static float get_lk(float k) {
+	if (k >= 1.f) {
+		return 0.f;
+	}
+	return logf(1.f - k);
+}
+
+// Return the number of samples for the exponential to close the distance
+// to the target level from d0 to d1.
+static uint32_t get_count(float d0, float d1, float lk) {
+	if (d0 <= d1) {
+		return 0;
+	}
+	if (lk == 0.f) {
+		// k == 1, we get there in a single sample
+		return 1;
+	}
+	return (uint32_t) ceilf(logf(d1 / d0) / lk);
+}
+
 //-----------------------------------------------------------------------------
+// state transitions
+
+// Enter decay state.
+static void adsr_decay(struct adsr *e) {
+	e->val = 1.f;
+	e->state = ADSR_STATE_DECAY;
+	e->count = get_count(1.f - e->s, e->s_trigger - e->s, e->ld);
+}
+
+// Enter sustain state.
+static void adsr_sustain(struct adsr *e) {
+	if (e->s != 0.f) {
+		e->val = e->s;
+		e->state = ADSR_STATE_SUSTAIN;
+	} else {
+		// no sustain, goto idle state
+		adsr_idle(e);
+	}
+}
 
 // Enter attack state.
 void adsr_attack(struct adsr *e) {
 	e->state = ADSR_STATE_ATTACK;
+	e->count = get_count(1.f - e->val, 1.f - e->d_trigger, e->la);
 }
 
 // Enter release state.
@@ -48,10 +92,10 @@ void adsr_release(struct adsr *e) {
 	if (e->state != ADSR_STATE_IDLE) {
 		if (e->kr == 1.f) {
 			// no release - goto idle
-			e->val = 0.f;
-			e->state = ADSR_STATE_IDLE;
+			adsr_idle(e);
 		} else {
 			e->state = ADSR_STATE_RELEASE;
+			e->count = get_count(e->val, e->i_trigger, e->lr);
 		}
 	}
 }
@@ -60,6 +104,7 @@ void adsr_release(struct adsr *e) {
 void adsr_idle(struct adsr *e) {
 	e->val = 0.f;
 	e->state = ADSR_STATE_IDLE;
+	e->count = 0;
 }
 
 // Return non-zero if the adsr is active (!=0).
@@ -69,60 +114,88 @@ int adsr_is_active(struct adsr *e) {
 
 //-----------------------------------------------------------------------------
 
-// Return a sample value for the ADSR envelope.
-static float adsr_sample(struct adsr *e) {
-	switch (e->state) {
-	case ADSR_STATE_IDLE:
-		// idle - do nothing
-		break;
-	case ADSR_STATE_ATTACK:
-		// attack until 1.0 level
-		if (e->val < e->d_trigger) {
-			e->val += e->ka * (1.f - e->val);
-		} else {
-			// goto decay state
-			e->val = 1.f;
-			e->state = ADSR_STATE_DECAY;
-		}
-		break;
-	case ADSR_STATE_DECAY:
-		// decay until sustain level
-		if (e->val > e->s_trigger) {
-			e->val += e->kd * (e->s - e->val);
-		} else {
-			if (e->s != 0.f) {
-				// goto sustain state
-				e->val = e->s;
-				e->state = ADSR_STATE_SUSTAIN;
-			} else {
-				// no sustain, goto idle state
-				e->val = 0.f;
-				e->state = ADSR_STATE_IDLE;
-			}
-		}
-		break;
-	case ADSR_STATE_SUSTAIN:
-		// sustain - do nothing
-		break;
-	case ADSR_STATE_RELEASE:
-		// release until idle level
-		if (e->val > e->i_trigger) {
-			e->val += e->kr * (0.f - e->val);
-		} else {
-			// goto idle state
-			e->val = 0.f;
-			e->state = ADSR_STATE_IDLE;
-		}
-		break;
+// Run the one-pole rise/fall towards the target level.
+// x[i] = x[i-1] + k * (target - x[i-1]) = a * x[i-1] + b
+static float adsr_run(float *out, float val, float a, float b, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		val = (a * val) + b;
+		out[i] = val;
 	}
-	return e->val;
+	return val;
 }
 
-void adsr_gen(struct adsr *e, float *out, size_t n) {
-	unsigned int i;
-	for (i = 0; i < n; i++) {
-		out[i] = adsr_sample(e);
+// Fill the output with a constant level.
+static void adsr_fill(float *out, float val, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = val;
+	}
+}
+
+// Generate a block of ADSR envelope samples.
+// Rather than testing the state and trigger levels per sample, we know how
+// many samples remain in the current segment. We run the segment until it
+// ends or we fill the block, then transition to the next state.
+// Return BLOCK_CONSTANT (and BLOCK_ZERO) tags if all the block samples have
+// the same value (out[0]).
+int adsr_gen(struct adsr *e, float *out, size_t n) {
+	int constant = 1;
+	size_t i = 0;
+
+	while (i < n) {
+		float k, target;
+
+		switch (e->state) {
+		case ADSR_STATE_IDLE:
+		case ADSR_STATE_SUSTAIN:
+			// constant level for the rest of the block
+			adsr_fill(&out[i], e->val, n - i);
+			if (constant) {
+				return (e->val == 0.f) ? (BLOCK_CONSTANT | BLOCK_ZERO) : BLOCK_CONSTANT;
+			}
+			return 0;
+		case ADSR_STATE_ATTACK:
+			k = e->ka;
+			target = 1.f;
+			break;
+		case ADSR_STATE_DECAY:
+			k = e->kd;
+			target = e->s;
+			break;
+		case ADSR_STATE_RELEASE:
+		default:
+			k = e->kr;
+			target = 0.f;
+			break;
+		}
+
+		// run the segment
+		size_t run = n - i;
+		if (e->count < run) {
+			run = e->count;
+		}
+		if (run != 0) {
+			e->val = adsr_run(&out[i], e->val, 1.f - k, k * target, run);
+			e->count -= run;
+			constant = 0;
+			i += run;
+		}
+		// end of segment?
+		if (e->count == 0) {
+			switch (e->state) {
+			case ADSR_STATE_ATTACK:
+				adsr_decay(e);
+				break;
+			case ADSR_STATE_DECAY:
+				adsr_sustain(e);
+				break;
+			case ADSR_STATE_RELEASE:
+			default:
+				adsr_idle(e);
+				break;
+			}
+		}
 	}
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -137,11 +210,14 @@ void adsr_init(struct adsr *e, float a, float d, float s, float r) {
 	e->ka = get_k(a);
 	e->kd = get_k(d);
 	e->kr = get_k(r);
+	e->la = get_lk(e->ka);
+	e->ld = get_lk(e->kd);
+	e->lr = get_lk(e->kr);
 	e->d_trigger = 1.f - LEVEL_EPSILON;
 	e->s_trigger = s + (1.f - s) * LEVEL_EPSILON;
-	e->i_trigger = s * LEVEL_EPSILON;
-	e->state = ADSR_STATE_IDLE;
-	e->val = 0.f;
+	// With no sustain we still need a non-zero release trigger level.
+	e->i_trigger = (s != 0.f) ? (s * LEVEL_EPSILON) : LEVEL_EPSILON;
+	adsr_idle(e);
 }
 
 // AD envelope initialisation
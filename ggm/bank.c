@@ -0,0 +1,77 @@
+//-----------------------------------------------------------------------------
+/*
+
+Patch Banks
+
+Programs are selected with MIDI program change and the bank with bank
+select (CC0). Each program is a patch preset: the patch operations and an
+optional serialized patch state. The bank tables are const so they are kept
+in flash.
+
+Bank 0: the patches with their init() defaults.
+Bank 1: patch presets.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include "ggm.h"
+
+//-----------------------------------------------------------------------------
+
+// the patches with their init() defaults
+static const struct patch_preset init_presets[] = {
+	{"patch0", &patch0, NULL, 0},
+	{"patch1", &patch1, NULL, 0},
+	{"patch2", &patch2, NULL, 0},
+	{"patch3", &patch3, NULL, 0},
+	{"patch4", &patch4, NULL, 0},
+	{"patch5", &patch5, NULL, 0},
+	{"patch6", &patch6, NULL, 0},
+	{"patch7", &patch7, NULL, 0},
+};
+
+static const struct patch_preset *const bank0[] = {
+	&init_presets[0],
+	&init_presets[1],
+	&init_presets[2],
+	&init_presets[3],
+	&init_presets[4],
+	&init_presets[5],
+	&init_presets[6],
+	&init_presets[7],
+};
+
+static const struct patch_preset *const bank1[] = {
+	&patch1_presets[0],
+	&patch1_presets[1],
+	&patch3_presets[0],
+	&patch7_presets[0],
+	&patch7_presets[1],
+};
+
+static const struct patch_bank banks[] = {
+	{"init", bank0, sizeof(bank0) / sizeof(bank0[0])},
+	{"presets", bank1, sizeof(bank1) / sizeof(bank1[0])},
+};
+
+#define NUM_BANKS (sizeof(banks) / sizeof(banks[0]))
+
+_Static_assert(sizeof(bank0) / sizeof(bank0[0]) <= NUM_PROGRAMS, "too many programs in bank 0");
+_Static_assert(sizeof(bank1) / sizeof(bank1[0]) <= NUM_PROGRAMS, "too many programs in bank 1");
+
+//-----------------------------------------------------------------------------
+
+// return the preset for a bank/program, NULL if there is none (or it's empty)
+const struct patch_preset *bank_preset(unsigned int bank, unsigned int prog) {
+	if (bank >= NUM_BANKS || prog >= banks[bank].n) {
+		return NULL;
+	}
+	const struct patch_preset *pp = banks[bank].program[prog];
+	if (pp == NULL || pp->ops == NULL) {
+		// empty program
+		return NULL;
+	}
+	return pp;
+}
+
+//-----------------------------------------------------------------------------
@@ -39,7 +39,7 @@ void block_mul_k(float *out, float k, size_t n) {
 // multiply a block by a scalar (0.6uS for n=128)
 void block_mul_k(float *out, float k, size_t n) {
 	// unroll x4
-	while (n > 0) {
+	while (n >= 4) {
 		out[0] *= k;
 		out[1] *= k;
 		out[2] *= k;
@@ -47,6 +47,10 @@ void block_mul_k(float *out, float k, size_t n) {
 		out += 4;
 		n -= 4;
 	}
+	// remainder
+	for (size_t i = 0; i < n; i++) {
+		out[i] *= k;
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -72,7 +76,7 @@ void block_add_k(float *out, float k, size_t n) {
 // add a scalar to a buffer (0.6uS for n=128)
 void block_add_k(float *out, float k, size_t n) {
 	// unroll x4
-	while (n > 0) {
+	while (n >= 4) {
 		out[0] += k;
 		out[1] += k;
 		out[2] += k;
@@ -80,6 +84,10 @@ void block_add_k(float *out, float k, size_t n) {
 		out += 4;
 		n -= 4;
 	}
+	// remainder
+	for (size_t i = 0; i < n; i++) {
+		out[i] += k;
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -96,7 +104,7 @@ void block_copy(float *dst, float *src, size_t n) {
 // copy a block (0.6uS for n=128)
 void block_copy(float *dst, const float *src, size_t n) {
 	// unroll x4
-	while (n > 0) {
+	while (n >= 4) {
 		dst[0] = src[0];
 		dst[1] = src[1];
 		dst[2] = src[2];
@@ -105,12 +113,16 @@ void block_copy(float *dst, const float *src, size_t n) {
 		dst += 4;
 		n -= 4;
 	}
+	// remainder
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = src[i];
+	}
 }
 
 // copy a block and multiply by k
 void block_copy_mul_k(float *dst, const float *src, float k, size_t n) {
 	// unroll x4
-	while (n > 0) {
+	while (n >= 4) {
 		dst[0] = src[0] * k;
 		dst[1] = src[1] * k;
 		dst[2] = src[2] * k;
@@ -119,6 +131,68 @@ void block_copy_mul_k(float *dst, const float *src, float k, size_t n) {
 		dst += 4;
 		n -= 4;
 	}
+	// remainder
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = src[i] * k;
+	}
+}
+
+// out += buf * k
+void block_add_mul_k(float *out, const float *buf, float k, size_t n) {
+	// unroll x4
+	while (n >= 4) {
+		out[0] += buf[0] * k;
+		out[1] += buf[1] * k;
+		out[2] += buf[2] * k;
+		out[3] += buf[3] * k;
+		out += 4;
+		buf += 4;
+		n -= 4;
+	}
+	// remainder
+	for (size_t i = 0; i < n; i++) {
+		out[i] += buf[i] * k;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// return the peak absolute value of a block
+float block_peak(const float *buf, size_t n) {
+	float peak = 0.f;
+	for (size_t i = 0; i < n; i++) {
+		float x = (buf[i] < 0.f) ? -buf[i] : buf[i];
+		peak = (x > peak) ? x : peak;
+	}
+	return peak;
+}
+
+//-----------------------------------------------------------------------------
+// Silence Detection
+// Some voices (e.g. plucked strings, long release tails) decay well below
+// audibility long before their envelopes say they are done. We track the
+// block peak level and report when it has been quiet for a while so the
+// voice can be retired.
+
+// below the LSB of a 16-bit output sample
+#define SILENCE_LEVEL (1.f / 32768.f)
+// number of consecutive quiet samples (~23ms)
+#define SILENCE_SAMPLES (8 * AUDIO_BLOCK_SIZE)
+
+// return non-zero when the input has been quiet for SILENCE_SAMPLES samples
+int silence_detect(struct silence *s, const float *in, size_t n) {
+	if (block_peak(in, n) < SILENCE_LEVEL) {
+		if (s->count < SILENCE_SAMPLES) {
+			s->count += n;
+		}
+	} else {
+		s->count = 0;
+	}
+	return s->count >= SILENCE_SAMPLES;
+}
+
+void silence_init(struct silence *s) {
+	s->count = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -7,6 +7,7 @@ Benchmarking Functions
 //-----------------------------------------------------------------------------
 
 #include "ggm.h"
+#include "utils.h"
 
 //-----------------------------------------------------------------------------
 
@@ -39,3 +40,96 @@ void block_benchmark(void) {
 }
 
 //-----------------------------------------------------------------------------
+
+// Each filter gets a pulse on the LED gpio. Measure the pulse widths with a
+// scope: cycles/sample = width * cpu_clock / BENCHMARK_N
+void lpf_benchmark(void) {
+	float buf0[BENCHMARK_N];
+	float buf1[BENCHMARK_N];
+	struct svf svf;
+	struct svf2 svf2;
+	struct ladder ladder;
+
+	svf_init(&svf);
+	svf_ctrl_cutoff(&svf, 1000.f);
+	svf_ctrl_resonance(&svf, 0.5f);
+	svf2_init(&svf2);
+	svf2_ctrl(&svf2, 1000.f, 0.5f);
+	ladder_init(&ladder);
+	ladder_ctrl_cutoff(&ladder, 1000.f);
+	ladder_ctrl_resonance(&ladder, 0.5f);
+
+	for (int i = 0; i < BENCHMARK_N; i++) {
+		buf0[i] = rand_float();
+	}
+
+	disable_irq();
+	while (1) {
+		// svf
+		gpio_set(IO_LED_AMBER);
+		svf_gen(&svf, buf1, buf0, BENCHMARK_N);
+		gpio_clr(IO_LED_AMBER);
+		// svf2
+		gpio_set(IO_LED_AMBER);
+		svf2_gen(&svf2, buf1, buf0, BENCHMARK_N);
+		gpio_clr(IO_LED_AMBER);
+		// ladder
+		ladder_ctrl_oversample(&ladder, 0);
+		gpio_set(IO_LED_AMBER);
+		ladder_gen(&ladder, buf1, buf0, BENCHMARK_N);
+		gpio_clr(IO_LED_AMBER);
+		// 2x oversampled ladder
+		ladder_ctrl_oversample(&ladder, 1);
+		gpio_set(IO_LED_AMBER);
+		ladder_gen(&ladder, buf1, buf0, BENCHMARK_N);
+		gpio_clr(IO_LED_AMBER);
+	}
+}
+
+// Compare FILTER_LANES serial svf2 filters with one multi-lane svf4 and the
+// multi-lane biquad. cycles/sample/filter = width * cpu_clock / (BENCHMARK_N * FILTER_LANES)
+void filter4_benchmark(void) {
+	float buf0[BENCHMARK_N];
+	float out[FILTER_LANES][BENCHMARK_N];
+	float *out_k[FILTER_LANES];
+	const float *in_k[FILTER_LANES];
+	struct svf2 svf2[FILTER_LANES];
+	struct svf4 svf4;
+	struct biquad4 biquad4;
+
+	svf4_init(&svf4);
+	biquad4_init(&biquad4);
+	for (int k = 0; k < FILTER_LANES; k++) {
+		float cutoff = 500.f * (float)(k + 1);
+		svf2_init(&svf2[k]);
+		svf2_ctrl(&svf2[k], cutoff, 0.5f);
+		svf4_ctrl(&svf4, k, cutoff, 0.5f);
+		biquad4_ctrl_lpf(&biquad4, k, cutoff, 0.707f);
+		out_k[k] = out[k];
+		in_k[k] = buf0;
+	}
+
+	for (int i = 0; i < BENCHMARK_N; i++) {
+		buf0[i] = rand_float();
+	}
+
+	disable_irq();
+	while (1) {
+		// serial svf2
+		gpio_set(IO_LED_AMBER);
+		for (int k = 0; k < FILTER_LANES; k++) {
+			svf2_gen(&svf2[k], out[k], buf0, BENCHMARK_N);
+		}
+		gpio_clr(IO_LED_AMBER);
+		// multi-lane svf4
+		gpio_set(IO_LED_AMBER);
+		svf4_gen(&svf4, out_k, in_k, BENCHMARK_N);
+		gpio_clr(IO_LED_AMBER);
+		// multi-lane biquad4
+		gpio_set(IO_LED_AMBER);
+		biquad4_gen(&biquad4, out_k, in_k, BENCHMARK_N);
+		gpio_clr(IO_LED_AMBER);
+	}
+}
+
+//-----------------------------------------------------------------------------
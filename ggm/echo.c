@@ -0,0 +1,252 @@
+//-----------------------------------------------------------------------------
+/*
+
+Tempo Synced Stereo Delay/Chorus
+
+A delay line per channel with a modulated tap. With a long delay time and some
+feedback it's an echo, with a short delay time and some modulation depth it's
+a chorus. The delay time can be synced to the sequencer tempo.
+
+Multi-second delay lines don't fit in the internal SRAM, so they live in
+external memory (E.g. the SDRAM on the Axoloti). That memory is slow for
+per-sample access, so the DSP loop never touches it. Instead:
+
+1) Before a block is processed the tap delays for the whole block are known,
+so the span of the delay line the tap will read is copied into an SRAM window.
+2) The block is processed using the window, and the delay line input is
+written to an SRAM staging buffer.
+3) The staging buffer is copied to the delay line, and the window for the next
+block is requested.
+
+The copies are queued (E.g. to a DMA controller) so they run while the CPU is
+generating the voices for the next block. We only wait on them at the start of
+the next delay/chorus block.
+
+The window for the next block is read right after the current block is
+written, so the tap must stay more than a block behind the write position.
+The tap delay changes by at most ECHO_SLACK - 2 samples per block so the
+window has room for the modulation and the interpolation.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <math.h>
+#include <string.h>
+
+#include "ggm.h"
+#include "utils.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+#define ECHO_LINE_MAX (1U << 19)	// maximum delay line length (~11.9 secs)
+#define ECHO_GLIDE ((float)(ECHO_SLACK - 2))	// maximum tap delay change per block
+#define ECHO_DELAY_MIN ((float)(AUDIO_BLOCK_SIZE + 2))	// minimum tap delay
+#define ECHO_DEPTH_MAX (0.01f)	// maximum chorus depth (secs)
+#define ECHO_RATE_MAX (5.f)	// maximum chorus rate (Hz)
+#define ECHO_FB_MAX (0.95f)	// maximum feedback
+#define ECHO_SILENCE (1.f / 32768.f)	// delay line input below this is silent
+
+#define SECS_PER_MIN (60.f)
+
+// chorus lfo frequency to phase step per block
+#define ECHO_PHASE_SCALE ((float)(1ULL << 32) * (float)AUDIO_BLOCK_SIZE / AUDIO_FS)
+
+//-----------------------------------------------------------------------------
+// delay line access
+
+// queue a read of n samples from a delay line
+static void line_rd(struct echo *e, int c, float *dst, uint32_t pos, size_t n) {
+	const float *line = e->line[c];
+	pos &= e->mask;
+	size_t n0 = e->mask + 1 - pos;
+	if (n0 >= n) {
+		e->mem->copy(dst, &line[pos], n);
+	} else {
+		// wrap around
+		e->mem->copy(dst, &line[pos], n0);
+		e->mem->copy(&dst[n0], line, n - n0);
+	}
+}
+
+// queue a write of n samples to a delay line
+static void line_wr(struct echo *e, int c, const float *src, uint32_t pos, size_t n) {
+	float *line = e->line[c];
+	pos &= e->mask;
+	size_t n0 = e->mask + 1 - pos;
+	if (n0 >= n) {
+		e->mem->copy(&line[pos], src, n);
+	} else {
+		// wrap around
+		e->mem->copy(&line[pos], src, n0);
+		e->mem->copy(line, &src[n0], n - n0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// maximum tap delay for the delay line length
+static inline float echo_delay_max(struct echo *e) {
+	return (float)(e->mask + 1 - ECHO_WIN_SIZE - 1);
+}
+
+// work out the tap delays for the next block and queue the window reads
+static void echo_fetch(struct echo *e) {
+	float d_max = echo_delay_max(e);
+	for (int c = 0; c < ECHO_CHANNELS; c++) {
+		// quadrature lfos for the left/right taps
+		float target = e->time + (e->depth * cos_lookup(e->lfo_x + ((uint32_t) c << 30)));
+		target = clampf(target, ECHO_DELAY_MIN, d_max);
+		float d0 = e->d1[c];
+		float d1 = d0 + clampf(target - d0, -ECHO_GLIDE, ECHO_GLIDE);
+		e->d0[c] = d0;
+		e->d1[c] = d1;
+		// the window starts before the longest delay in the block
+		uint32_t ofs = (uint32_t) fmaxf(d0, d1) + 1;
+		e->ofs[c] = ofs;
+		line_rd(e, c, e->win[c], e->wr - ofs, ECHO_WIN_SIZE);
+	}
+	e->lfo_x += e->lfo_step;
+}
+
+//-----------------------------------------------------------------------------
+
+// n must be AUDIO_BLOCK_SIZE
+void echo_gen(struct echo *e, float *out_l, float *out_r, const float *in_l, const float *in_r, size_t n) {
+	float *out[ECHO_CHANNELS] = { out_l, out_r };
+	const float *in[ECHO_CHANNELS] = { in_l, in_r };
+	float fb = e->fb;
+	float peak = 0.f;
+
+	if (!e->primed) {
+		echo_fetch(e);
+		e->primed = 1;
+	}
+	// wait for the windows (and the previous block write)
+	e->mem->wait();
+
+	for (int c = 0; c < ECHO_CHANNELS; c++) {
+		const float *w = e->win[c];
+		float *wb = e->wbuf[c];
+		float *y = out[c];
+		const float *x = in[c];
+		// window position for sample 0 and the step per sample
+		float d = e->d0[c];
+		float pos = (float)e->ofs[c] - d;
+		float step = 1.f - ((e->d1[c] - d) / (float)n);
+		for (size_t i = 0; i < n; i++) {
+			int j = (int)pos;
+			float f = pos - (float)j;
+			float tap = w[j] + (f * (w[j + 1] - w[j]));
+			y[i] = tap;
+			wb[i] = x[i] + (fb * tap);
+			pos += step;
+		}
+		line_wr(e, c, wb, e->wr, n);
+		peak = fmaxf(peak, block_peak(wb, n));
+	}
+
+	// how long has the delay line input been silent?
+	if (peak < ECHO_SILENCE) {
+		e->quiet = (e->quiet < e->mask) ? e->quiet + n : e->quiet;
+	} else {
+		e->quiet = 0;
+	}
+
+	e->wr += n;
+	echo_fetch(e);
+}
+
+//-----------------------------------------------------------------------------
+
+// work out the delay time in samples
+static void echo_update_time(struct echo *e) {
+	float secs = e->secs;
+	if (e->beats > 0.f && e->bpm > 0.f) {
+		secs = e->beats * SECS_PER_MIN / e->bpm;
+	}
+	// keep the modulated tap in range
+	e->time = clampf(secs * AUDIO_FS, ECHO_DELAY_MIN + e->depth, echo_delay_max(e) - e->depth);
+}
+
+// set a free running delay time (seconds)
+void echo_ctrl_time(struct echo *e, float secs) {
+	e->secs = clampf_lo(secs, 0.f);
+	e->beats = 0.f;
+	echo_update_time(e);
+}
+
+// set a tempo synced delay time (beats, E.g. 0.75 for a dotted 1/8 note)
+void echo_ctrl_sync(struct echo *e, float beats) {
+	e->beats = clampf_lo(beats, 0.f);
+	echo_update_time(e);
+}
+
+// set the tempo (beats per minute)
+void echo_ctrl_tempo(struct echo *e, float bpm) {
+	if (bpm == e->bpm) {
+		return;
+	}
+	e->bpm = bpm;
+	echo_update_time(e);
+}
+
+// set the feedback (0..1)
+void echo_ctrl_feedback(struct echo *e, float fb) {
+	e->fb = clampf(fb, 0.f, ECHO_FB_MAX);
+}
+
+// set the chorus lfo rate (Hz) and depth (seconds)
+void echo_ctrl_chorus(struct echo *e, float rate, float depth) {
+	e->lfo_step = (uint32_t) (clampf(rate, 0.f, ECHO_RATE_MAX) * ECHO_PHASE_SCALE);
+	e->depth = clampf(depth, 0.f, ECHO_DEPTH_MAX) * AUDIO_FS;
+	echo_update_time(e);
+}
+
+// return non-zero when the delay lines hold nothing but silence
+int echo_is_idle(struct echo *e) {
+	return (float)e->quiet > (e->time + e->depth + (float)ECHO_WIN_SIZE);
+}
+
+// the delay/chorus has stopped, re-read the windows when it restarts
+void echo_reset(struct echo *e) {
+	e->primed = 0;
+	e->quiet = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// initialise the delay/chorus, return -1 if there is no external memory
+int echo_init(struct echo *e, const struct xmem *mem) {
+	memset(e, 0, sizeof(struct echo));
+	if (mem == NULL) {
+		return -1;
+	}
+	// power of 2 delay lines
+	size_t len = ECHO_LINE_MAX;
+	while (len * ECHO_CHANNELS > mem->size) {
+		len >>= 1;
+	}
+	if (len < 2 * ECHO_WIN_SIZE) {
+		DBG("external memory too small\r\n");
+		return -1;
+	}
+	e->mem = mem;
+	e->mask = len - 1;
+	for (int c = 0; c < ECHO_CHANNELS; c++) {
+		e->line[c] = &mem->base[c * len];
+		memset(e->line[c], 0, len * sizeof(float));
+	}
+	echo_ctrl_feedback(e, 0.4f);
+	echo_ctrl_chorus(e, 0.5f, 0.001f);
+	echo_ctrl_tempo(e, 120.f);
+	echo_ctrl_sync(e, 0.75f);
+	for (int c = 0; c < ECHO_CHANNELS; c++) {
+		e->d1[c] = e->time;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
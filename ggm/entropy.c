@@ -0,0 +1,164 @@
+//-----------------------------------------------------------------------------
+/*
+
+Entropy Pool
+
+A circular buffer of random words. A producer (E.g. the hardware RNG) writes
+words into it, and consumers (noise generators, KS plucks) take blocks from
+it without blocking. If the pool can't supply a block the consumer falls back
+on its own PRNG stream.
+
+The producer is polled from the event loop when it has no events to handle
+(entropy_idle()), so it only uses otherwise idle cpu time. The STM32 RNG has
+no FIFO or DMA request, it makes one word at a time (~0.88us/word). Taking
+each word in an interrupt costs an exception entry/exit, the callback and an
+interrupt masked pool write, which is more cycles than the xorshift step it
+replaces. Polling has none of that cost on the audio path.
+
+If there is no producer (E.g. no hardware RNG) the idle loop refills the pool
+from a fast software generator.
+
+Demand is far higher than supply. A noise voice takes AUDIO_BLOCK_SIZE (128)
+words per block, while the RNG only delivers words in the idle time left over
+after rendering (at most ENTROPY_IDLE per pass). With noise voices playing the
+pool soon runs dry, and entropy_fill() mostly falls back on xrand_fill(). The
+pool mainly seeds the first blocks of a note with true random data.
+
+The producer and the consumers all run in the event loop, so the pool needs
+no interrupt masking.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "ggm.h"
+#include "utils.h"
+
+//-----------------------------------------------------------------------------
+
+#define ENTROPY_SIZE 1024U	// must be a power of 2
+#define ENTROPY_CHUNK 64U	// maximum words per pool read in entropy_fill()
+#define ENTROPY_IDLE 16U	// maximum words written per entropy_idle() call
+
+_Static_assert((ENTROPY_SIZE & (ENTROPY_SIZE - 1)) == 0, "ENTROPY_SIZE must be a power of 2");
+_Static_assert(ENTROPY_CHUNK < ENTROPY_SIZE, "ENTROPY_CHUNK must fit in the pool");
+
+struct entropy_pool {
+	uint32_t buf[ENTROPY_SIZE];
+	size_t rd;
+	size_t wr;
+	int (*poll)(uint32_t * x);	// producer, returns 0 with a random word
+	uint32_t soft;		// software generator state
+	struct entropy_stats stats;
+};
+
+static struct entropy_pool pool;
+
+//-----------------------------------------------------------------------------
+
+static inline size_t pool_level(void) {
+	return (pool.wr - pool.rd) & (ENTROPY_SIZE - 1);
+}
+
+// software producer: return a word
+static int soft_poll(uint32_t * x) {
+	// the pool may be used before entropy_init()
+	pool.soft = xorshift32((pool.soft == 0) ? 1 : pool.soft);
+	*x = pool.soft;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// write a word to the pool (producer), return -1 when full
+int entropy_wr(uint32_t x) {
+	size_t wr = (pool.wr + 1) & (ENTROPY_SIZE - 1);
+	if (wr == pool.rd) {
+		return -1;
+	}
+	pool.buf[pool.wr] = x;
+	pool.wr = wr;
+	pool.stats.words_in += 1;
+	return 0;
+}
+
+// read a block of n words from the pool, return 0 on success, -1 if the pool can't supply them
+int entropy_rd(uint32_t * buf, size_t n) {
+	size_t level = pool_level();
+	if (level < n) {
+		pool.stats.underruns += 1;
+		return -1;
+	}
+	// the words may wrap around the end of the ring
+	size_t n0 = ENTROPY_SIZE - pool.rd;
+	n0 = (n0 < n) ? n0 : n;
+	memcpy(buf, &pool.buf[pool.rd], n0 * sizeof(uint32_t));
+	memcpy(&buf[n0], pool.buf, (n - n0) * sizeof(uint32_t));
+	pool.rd = (pool.rd + n) & (ENTROPY_SIZE - 1);
+	pool.stats.words_out += n;
+	level -= n;
+	if (level < pool.stats.level_min) {
+		pool.stats.level_min = level;
+	}
+	return 0;
+}
+
+// top up the pool from the producer (called from the event loop when idle)
+void entropy_idle(void) {
+	int (*poll)(uint32_t * x) = (pool.poll == NULL) ? soft_poll : pool.poll;
+	for (size_t i = 0; i < ENTROPY_IDLE; i++) {
+		uint32_t x;
+		if (pool_level() == ENTROPY_SIZE - 1 || poll(&x) != 0) {
+			break;
+		}
+		entropy_wr(x);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// fill a buffer with floats from -1..1
+// Use the entropy pool for each chunk it can supply, else the PRNG stream.
+void entropy_fill(struct xrand *r, float *out, size_t n) {
+	uint32_t buf[ENTROPY_CHUNK];
+	while (n > 0) {
+		size_t k = (n < ENTROPY_CHUNK) ? n : ENTROPY_CHUNK;
+		if (entropy_rd(buf, k) == 0) {
+			for (size_t i = 0; i < k; i++) {
+				out[i] = xrand_to_float(buf[i]);
+			}
+		} else {
+			xrand_fill(r, out, k);
+		}
+		out += k;
+		n -= k;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// return the pool statistics
+void entropy_get_stats(struct entropy_stats *stats) {
+	*stats = pool.stats;
+	stats->level = pool_level();
+}
+
+// initialise the entropy pool
+// poll: reads a word from the producer, NULL for a software producer
+// seed: seed for the software producer
+int entropy_init(int (*poll)(uint32_t * x), uint32_t seed) {
+	memset(&pool, 0, sizeof(struct entropy_pool));
+	pool.poll = poll;
+	pool.soft = (seed == 0) ? 1 : seed;
+	pool.stats.level_min = ENTROPY_SIZE;
+	if (poll == NULL) {
+		// start with a full pool
+		while (pool_level() < ENTROPY_SIZE - 1) {
+			entropy_idle();
+		}
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
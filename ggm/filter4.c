@@ -0,0 +1,171 @@
+//-----------------------------------------------------------------------------
+/*
+
+Multi-Lane Filters
+
+These filters process FILTER_LANES independent filters (E.g. the filters for
+several voices, or several filters within a voice) at the same time.
+
+A single filter has a serial dependency from one sample to the next, so the
+FPU sits waiting on the result of the previous multiply-add. Running the lanes
+side by side gives the FPU independent work to do while it waits. The state
+is stored as structure of arrays so each lane is at a fixed offset and the
+inner loop over the lanes can be vectorised by the compiler on hosts with
+SIMD, or unrolled into scalar code on the Cortex-M4.
+
+The voices are generated one at a time (patch_ops.generate), so the lanes are
+not used across voices. Patch 6 uses biquad4 for the harmonic band pass
+filters within a voice.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include "ggm.h"
+#include "utils.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+// Transposed Direct Form II Biquads
+
+void biquad4_gen(struct biquad4 *f, float *out[FILTER_LANES], const float *in[FILTER_LANES], size_t n) {
+	float b0[FILTER_LANES], b1[FILTER_LANES], b2[FILTER_LANES];
+	float a1[FILTER_LANES], a2[FILTER_LANES];
+	float s1[FILTER_LANES], s2[FILTER_LANES];
+
+	// local copies, so the output stores don't force reloads
+	for (int k = 0; k < FILTER_LANES; k++) {
+		b0[k] = f->b0[k];
+		b1[k] = f->b1[k];
+		b2[k] = f->b2[k];
+		a1[k] = f->a1[k];
+		a2[k] = f->a2[k];
+		s1[k] = f->s1[k];
+		s2[k] = f->s2[k];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		for (int k = 0; k < FILTER_LANES; k++) {
+			float x = in[k][i];
+			float y = (b0[k] * x) + s1[k];
+			s1[k] = (b1[k] * x) - (a1[k] * y) + s2[k];
+			s2[k] = (b2[k] * x) - (a2[k] * y);
+			out[k][i] = y;
+		}
+	}
+
+	// update the state variables
+	for (int k = 0; k < FILTER_LANES; k++) {
+		f->s1[k] = s1[k];
+		f->s2[k] = s2[k];
+	}
+}
+
+// set a lane to a low pass response
+// See: Robert Bristow-Johnson's "Cookbook formulae for audio EQ biquad filter coefficients"
+void biquad4_ctrl_lpf(struct biquad4 *f, int lane, float cutoff, float q) {
+	cutoff = clampf(cutoff, 0.f, 0.5f * AUDIO_FS);
+	q = clampf_lo(q, 0.1f);
+	float w0 = TAU * cutoff / AUDIO_FS;
+	float cos_w0 = cos_eval(w0);
+	float alpha = sin_eval(w0) / (2.f * q);
+	float ia0 = 1.f / (1.f + alpha);
+	f->b0[lane] = 0.5f * (1.f - cos_w0) * ia0;
+	f->b1[lane] = (1.f - cos_w0) * ia0;
+	f->b2[lane] = f->b0[lane];
+	f->a1[lane] = -2.f * cos_w0 * ia0;
+	f->a2[lane] = (1.f - alpha) * ia0;
+}
+
+// set a lane to a band pass response (0 dB peak gain)
+void biquad4_ctrl_bpf(struct biquad4 *f, int lane, float freq, float q) {
+	freq = clampf(freq, 0.f, 0.45f * AUDIO_FS);
+	q = clampf_lo(q, 0.1f);
+	float w0 = TAU * freq / AUDIO_FS;
+	float alpha = sin_eval(w0) / (2.f * q);
+	float ia0 = 1.f / (1.f + alpha);
+	f->b0[lane] = alpha * ia0;
+	f->b1[lane] = 0.f;
+	f->b2[lane] = -alpha * ia0;
+	f->a1[lane] = -2.f * cos_eval(w0) * ia0;
+	f->a2[lane] = (1.f - alpha) * ia0;
+}
+
+// reset the state of a lane
+void biquad4_reset(struct biquad4 *f, int lane) {
+	f->s1[lane] = 0.f;
+	f->s2[lane] = 0.f;
+}
+
+void biquad4_init(struct biquad4 *f) {
+	for (int k = 0; k < FILTER_LANES; k++) {
+		// pass through
+		f->b0[k] = 1.f;
+		f->b1[k] = 0.f;
+		f->b2[k] = 0.f;
+		f->a1[k] = 0.f;
+		f->a2[k] = 0.f;
+		biquad4_reset(f, k);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// State Variable Filter
+// https://cytomic.com/files/dsp/SvfLinearTrapOptimised2.pdf
+// This is the svf2 filter with the lanes side by side.
+
+void svf4_gen(struct svf4 *f, float *out[FILTER_LANES], const float *in[FILTER_LANES], size_t n) {
+	float a1[FILTER_LANES], a2[FILTER_LANES], a3[FILTER_LANES];
+	float ic1eq[FILTER_LANES], ic2eq[FILTER_LANES];
+
+	// local copies, so the output stores don't force reloads
+	for (int k = 0; k < FILTER_LANES; k++) {
+		a1[k] = f->a1[k];
+		a2[k] = f->a2[k];
+		a3[k] = f->a3[k];
+		ic1eq[k] = f->ic1eq[k];
+		ic2eq[k] = f->ic2eq[k];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		for (int k = 0; k < FILTER_LANES; k++) {
+			float v1, v2, v3;
+			v3 = in[k][i] - ic2eq[k];
+			v1 = (a1[k] * ic1eq[k]) + (a2[k] * v3);
+			v2 = ic2eq[k] + (a2[k] * ic1eq[k]) + (a3[k] * v3);
+			ic1eq[k] = (2.f * v1) - ic1eq[k];
+			ic2eq[k] = (2.f * v2) - ic2eq[k];
+			out[k][i] = v2;	// low
+		}
+	}
+
+	// update the state variables
+	for (int k = 0; k < FILTER_LANES; k++) {
+		f->ic1eq[k] = ic1eq[k];
+		f->ic2eq[k] = ic2eq[k];
+	}
+}
+
+// set the cutoff frequency and resonance (0..1) for a lane
+void svf4_ctrl(struct svf4 *f, int lane, float cutoff, float resonance) {
+	const struct svf_coeff *c = svf_coeff_lookup(cutoff, resonance);
+	f->a1[lane] = c->a1;
+	f->a2[lane] = c->a2;
+	f->a3[lane] = c->a3;
+}
+
+// reset the state of a lane
+void svf4_reset(struct svf4 *f, int lane) {
+	f->ic1eq[lane] = 0.f;
+	f->ic2eq[lane] = 0.f;
+}
+
+void svf4_init(struct svf4 *f) {
+	for (int k = 0; k < FILTER_LANES; k++) {
+		svf4_ctrl(f, k, 0.25f * AUDIO_FS, 0.f);
+		svf4_reset(f, k);
+	}
+}
+
+//-----------------------------------------------------------------------------
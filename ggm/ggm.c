@@ -16,51 +16,248 @@ GooGooMuck Synthesizer
 //-----------------------------------------------------------------------------
 // voice operations
 
-// lookup the voice being used for this channel and note.
-struct voice *voice_lookup(struct ggm *s, uint8_t channel, uint8_t note) {
-	for (unsigned int i = 0; i < NUM_VOICES; i++) {
+// The voice_map gives the voice playing each channel/note, and each patch
+// keeps a list of the voices using it. A voice is attached to both when it is
+// allocated and detached when it is reused or retired (it has gone idle).
+// Detached voices are kept on a free list.
+
+// attach a free voice to a channel/note and the channel patch
+static void voice_attach(struct ggm *s, struct voice *v, uint8_t channel, uint8_t note) {
+	struct patch *p = &s->patches[s->patch_map[channel]];
+	v->note = note;
+	v->channel = channel;
+	v->patch = p;
+	s->voice_map[channel][note] = v->idx;
+	v->prev = NULL;
+	v->next = p->voices;
+	if (p->voices) {
+		p->voices->prev = v;
+	}
+	p->voices = v;
+	p->nvoices += 1;
+}
+
+// detach a voice from its channel/note and patch, put it on the free list
+static void voice_detach(struct ggm *s, struct voice *v) {
+	struct patch *p = v->patch;
+	if (v->prev) {
+		v->prev->next = v->next;
+	} else {
+		p->voices = v->next;
+	}
+	if (v->next) {
+		v->next->prev = v->prev;
+	}
+	p->nvoices -= 1;
+	s->voice_map[v->channel][v->note] = VOICE_NONE;
+	v->prev = NULL;
+	v->next = s->voice_free;
+	s->voice_free = v;
+	v->patch = NULL;
+	v->channel = 255;
+	v->note = 255;
+}
+
+// stop a voice and release it for reuse
+static void voice_retire(struct ggm *s, struct voice *v) {
+	v->patch->ops->stop(v);
+	voice_detach(s, v);
+}
+
+// stop a sounding voice, fading out its output to avoid a click
+static void voice_steal(struct ggm *s, struct voice *v) {
+	struct voice_fade *f = &s->fade;
+	float l[VOICE_FADE], r[VOICE_FADE];
+	if (v->patch->ops->generate(v, l, r, VOICE_FADE) == 0) {
+		// linear ramp down to zero
+		for (int i = 0; i < VOICE_FADE; i++) {
+			float k = (float)(VOICE_FADE - i) * (1.f / (float)VOICE_FADE);
+			l[i] *= k;
+			r[i] *= k;
+		}
+		block_add(f->out_l, l, VOICE_FADE);
+		block_add(f->out_r, r, VOICE_FADE);
+		float k = s->send[s->patch_map[v->channel]];
+		if (k > 0.f) {
+			block_add_mul_k(f->send_l, l, k, VOICE_FADE);
+			block_add_mul_k(f->send_r, r, k, VOICE_FADE);
+			f->send = 1;
+		}
+		k = s->echo_send[s->patch_map[v->channel]];
+		if (s->echo.mem && k > 0.f) {
+			block_add_mul_k(f->echo_l, l, k, VOICE_FADE);
+			block_add_mul_k(f->echo_r, r, k, VOICE_FADE);
+			f->echo = 1;
+		}
+		f->n = VOICE_FADE;
+	}
+	voice_retire(s, v);
+}
+
+// Pick a voice for a new note on the patch. In order of preference:
+// 1) An idle voice.
+// 2) The quietest released voice.
+// 3) The voice with the oldest note on.
+// If the patch is at its voice limit then only its own voices are considered.
+static struct voice *voice_pick(struct ggm *s, struct patch *p) {
+	int limited = (p->voice_limit > 0) && (p->nvoices >= p->voice_limit);
+	if (!limited && s->voice_free) {
+		return s->voice_free;
+	}
+	struct voice *quiet = NULL;
+	struct voice *old = NULL;
+	for (int i = 0; i < NUM_VOICES; i++) {
 		struct voice *v = &s->voices[i];
-		if (v->note == note && v->channel == channel) {
+		if (v->patch == NULL || (limited && v->patch != p)) {
+			continue;
+		}
+		if (!v->patch->ops->active(v)) {
+			// idle, but not yet retired
 			return v;
 		}
+		if (v->released && (quiet == NULL || v->level < quiet->level)) {
+			quiet = v;
+		}
+		if (old == NULL || (int32_t)(v->age - old->age) < 0) {
+			old = v;
+		}
 	}
-	return NULL;
+	return (quiet != NULL) ? quiet : old;
+}
+
+// lookup the voice being used for this channel and note.
+struct voice *voice_lookup(struct ggm *s, uint8_t channel, uint8_t note) {
+	if (channel >= NUM_CHANNELS || note >= NUM_NOTES) {
+		return NULL;
+	}
+	uint8_t idx = s->voice_map[channel][note];
+	return (idx == VOICE_NONE) ? NULL : &s->voices[idx];
 }
 
 // allocate a new voice, possibly reusing a current active voice.
 struct voice *voice_alloc(struct ggm *s, uint8_t channel, uint8_t note) {
 	// validate the channel
-	if (channel >= NUM_CHANNELS || s->patches[channel].ops == NULL) {
+	if (channel >= NUM_CHANNELS || s->patches[s->patch_map[channel]].ops == NULL) {
 		DBG("no patch defined for channel %d\r\n", channel);
 		return NULL;
 	}
-	// TODO: Currently doing simple round robin allocation.
-	// More intelligent voice allocation to follow....
-	struct voice *v = &s->voices[s->voice_idx];
-	s->voice_idx += 1;
-	if (s->voice_idx == NUM_VOICES) {
-		s->voice_idx = 0;
+	if (note >= NUM_NOTES) {
+		return NULL;
 	}
-	// stop an existing patch on this voice
+	struct voice *v = voice_pick(s, &s->patches[s->patch_map[channel]]);
 	if (v->patch) {
-		v->patch->ops->stop(v);
+		// stop an existing patch on this voice
+		if (v->patch->ops->active(v)) {
+			voice_steal(s, v);
+		} else {
+			voice_retire(s, v);
+		}
 	}
+	// the voice is now at the head of the free list
+	s->voice_free = v->next;
 	// setup the new voice
-	v->note = note;
-	v->channel = channel;
-	v->patch = &s->patches[channel];
+	voice_attach(s, v, channel, note);
+	// the note starts with the current channel expression
+	memcpy(v->expr, s->chan_expr[channel], sizeof(v->expr));
+	v->bend = pow2(v->expr[EXPR_BEND] * (1.f / 12.f));
 	v->patch->ops->start(v);
 	return v;
 }
 
 // run an update function for each voice using the patch
 void update_voices(struct patch *p, void (*func) (struct voice *)) {
-	for (int i = 0; i < NUM_VOICES; i++) {
-		struct voice *v = &p->ggm->voices[i];
-		if (v->patch == p) {
-			func(v);
+	for (struct voice *v = p->voices; v != NULL; v = v->next) {
+		func(v);
+	}
+}
+
+// start a note on a voice
+void voice_note_on(struct voice *v, uint8_t vel) {
+	struct ggm *s = v->patch->ggm;
+	v->age = s->voice_age;
+	s->voice_age += 1;
+	v->released = 0;
+	v->patch->ops->note_on(v, vel);
+}
+
+// release the note on a voice
+void voice_note_off(struct voice *v, uint8_t vel) {
+	v->released = 1;
+	// loud until the next span has been measured
+	v->level = 1.f;
+	v->patch->ops->note_off(v, vel);
+}
+
+//-----------------------------------------------------------------------------
+// program changes
+
+// Prepare the patch for a program change in the next free slot.
+// This is called when the message is received, so init() runs in the event
+// loop rather than the audio handler.
+// Return the slot tag, PROGRAM_NONE if there is no such program.
+uint8_t program_prepare(struct ggm *s, uint8_t chan, uint8_t prog) {
+	const struct patch_preset *pp = bank_preset(s->prog.bank[chan], prog);
+	if (pp == NULL) {
+		DBG("no program %d in bank %d\r\n", prog, s->prog.bank[chan]);
+		return PROGRAM_NONE;
+	}
+	DBG("prepare ch %d program %d (%s)\r\n", chan, prog, pp->name);
+	uint8_t tag = s->prog.tag;
+	struct patch_next *next = &s->prog.next[tag & (PROGRAM_SLOTS - 1)];
+	if (next->ops != NULL) {
+		// all the slots are waiting, swap in the oldest now
+		DBG("program slots full\r\n");
+		program_swap(s, next->chan, next->tag);
+	}
+	s->prog.tag = (tag + 1) & (PROGRAM_TAGS - 1);
+	// init() works on a new patch, it must not see the voices of the live patch
+	struct patch p = {
+		.ggm = s,
+		.ops = pp->ops,
+		.tuning = s->patches[chan].tuning,
+	};
+	for (int k = 0; k < PATCH_LFOS; k++) {
+		lfo_init(&p.lfo[k]);
+	}
+	p.ops->init(&p);
+	if (pp->state) {
+		memcpy(p.state, pp->state, pp->size);
+	}
+	next->ops = p.ops;
+	next->chan = chan;
+	next->tag = tag;
+	memcpy(next->lfo, p.lfo, sizeof(next->lfo));
+	memcpy(next->state, p.state, PATCH_STATE_SIZE);
+	return tag;
+}
+
+// Swap in the patch prepared with a tag. This is called between render spans
+// when the program change is due. The voices of the old patch are faded out
+// and the control changes staged for it are dropped.
+void program_swap(struct ggm *s, uint8_t chan, uint8_t tag) {
+	if (tag >= PROGRAM_TAGS) {
+		return;
+	}
+	struct patch_next *next = &s->prog.next[tag & (PROGRAM_SLOTS - 1)];
+	struct patch *p = &s->patches[chan];
+	if (next->ops == NULL || next->tag != tag || next->chan != chan) {
+		// no program, or it was swapped in early when the slots were full
+		return;
+	}
+	while (p->voices) {
+		struct voice *v = p->voices;
+		if (p->ops->active(v)) {
+			voice_steal(s, v);
+		} else {
+			voice_retire(s, v);
 		}
 	}
+	p->ops = next->ops;
+	memcpy(p->lfo, next->lfo, sizeof(p->lfo));
+	memcpy(p->state, next->state, PATCH_STATE_SIZE);
+	next->ops = NULL;
+	memset(s->cc.dirty[chan], 0, sizeof(s->cc.dirty[chan]));
+	s->cc.channels &= ~(1U << chan);
 }
 
 //-----------------------------------------------------------------------------
@@ -79,18 +276,162 @@ static void key_up_handler(struct ggm *s, struct event *e) {
 //-----------------------------------------------------------------------------
 // midi events
 
-// Currently unused.
-// Serial MIDI events are handled as they are read from the buffer.
-// MIDI events from USB might use this....
+// Serial MIDI is read from the buffer before each event.
+// USB MIDI arrives as a batch of packets per usb frame.
 
-// handle a midi event
+// handle a usb midi batch
 static void midi_handler(struct ggm *s, struct event *e) {
-	DBG("midi %06x\r\n", EVENT_MIDI(e->type));
+	struct usbmidi_batch *b = (struct usbmidi_batch *)e->ptr;
+	midi_rx_usb(&s->midi_rx1, b->time, b->pkt, b->n);
+	usbmidi_release(b);
 }
 
 //-----------------------------------------------------------------------------
 // audio request events
 
+// accumulate a voice output in an effects send bus
+static void send_add(float *bus_l, float *bus_r, int *silent, const float *l, const float *r, float k, size_t n) {
+	if (k <= 0.f) {
+		return;
+	}
+	if (*silent) {
+		block_copy_mul_k(bus_l, l, k, n);
+		block_copy_mul_k(bus_r, r, k, n);
+		*silent = 0;
+	} else {
+		block_add_mul_k(bus_l, l, k, n);
+		block_add_mul_k(bus_r, r, k, n);
+	}
+}
+
+// step the patch lfos over n samples
+static void lfos_step(struct ggm *s, size_t n) {
+	for (int i = 0; i < NUM_CHANNELS; i++) {
+		struct patch *p = &s->patches[i];
+		if (p->ops) {
+			for (int k = 0; k < PATCH_LFOS; k++) {
+				lfo_step(&p->lfo[k], n);
+			}
+		}
+	}
+}
+
+// block mix buffers
+struct mix {
+	float *out_l, *out_r;	// main output
+	float *send_l, *send_r;	// reverb send
+	float *echo_l, *echo_r;	// delay/chorus send
+	int send_silent;	// nothing mixed in the reverb send
+	int echo_silent;	// nothing mixed in the delay/chorus send
+};
+
+// generate and mix the voices for n samples starting at ofs in the block
+static void voices_gen(struct ggm *s, struct mix *m, size_t ofs, size_t n) {
+	float *out_l = &m->out_l[ofs];
+	float *out_r = &m->out_r[ofs];
+	float *send_l = &m->send_l[ofs];
+	float *send_r = &m->send_r[ofs];
+	float *echo_l = &m->echo_l[ofs];
+	float *echo_r = &m->echo_r[ofs];
+	int silent = 1;
+	int send_silent = 1;
+	int echo_silent = 1;
+
+	for (int i = 0; i < NUM_VOICES; i++) {
+		struct voice *v = &s->voices[i];
+		struct patch *p = v->patch;
+		if (p && !p->ops->active(v)) {
+			// the voice has gone idle
+			voice_retire(s, v);
+			continue;
+		}
+		if (p) {
+			float buf_l[n], buf_r[n];
+			v->level = 0.f;
+			float *l, *r;
+			if (silent) {
+				// nothing mixed yet, generate directly into the output buffers
+				l = out_l;
+				r = out_r;
+				if (p->ops->generate(v, l, r, n)) {
+					continue;
+				}
+				silent = 0;
+			} else {
+				// generate left/right samples
+				l = buf_l;
+				r = buf_r;
+				if (p->ops->generate(v, l, r, n)) {
+					continue;
+				}
+				// accumulate in the output buffers
+				block_add(out_l, l, n);
+				block_add(out_r, r, n);
+			}
+			if (v->released) {
+				// level for voice stealing
+				float peak_l = block_peak(l, n);
+				float peak_r = block_peak(r, n);
+				v->level = (peak_l > peak_r) ? peak_l : peak_r;
+			}
+			// accumulate in the effects send buffers
+			send_add(send_l, send_r, &send_silent, l, r, s->send[s->patch_map[v->channel]], n);
+			if (s->echo.mem) {
+				send_add(echo_l, echo_r, &echo_silent, l, r, s->echo_send[s->patch_map[v->channel]], n);
+			}
+		}
+	}
+
+	// clear the silent buffers
+	if (silent) {
+		memset(out_l, 0, n * sizeof(float));
+		memset(out_r, 0, n * sizeof(float));
+	}
+	if (send_silent) {
+		memset(send_l, 0, n * sizeof(float));
+		memset(send_r, 0, n * sizeof(float));
+	}
+	if (echo_silent) {
+		memset(echo_l, 0, n * sizeof(float));
+		memset(echo_r, 0, n * sizeof(float));
+	}
+	m->send_silent &= send_silent;
+	m->echo_silent &= echo_silent;
+}
+
+// add k samples of a fade out buffer to dst and shift out the used samples
+static void fade_take(float *dst, float *buf, size_t k) {
+	block_add(dst, buf, k);
+	memmove(buf, &buf[k], (VOICE_FADE - k) * sizeof(float));
+	memset(&buf[VOICE_FADE - k], 0, k * sizeof(float));
+}
+
+// mix the stolen voice fade outs into n samples starting at ofs in the block
+static void fade_mix(struct ggm *s, struct mix *m, size_t ofs, size_t n) {
+	struct voice_fade *f = &s->fade;
+	size_t k = (n < f->n) ? n : f->n;
+	if (k == 0) {
+		return;
+	}
+	fade_take(&m->out_l[ofs], f->out_l, k);
+	fade_take(&m->out_r[ofs], f->out_r, k);
+	if (f->send) {
+		fade_take(&m->send_l[ofs], f->send_l, k);
+		fade_take(&m->send_r[ofs], f->send_r, k);
+		m->send_silent = 0;
+	}
+	if (f->echo) {
+		fade_take(&m->echo_l[ofs], f->echo_l, k);
+		fade_take(&m->echo_r[ofs], f->echo_r, k);
+		m->echo_silent = 0;
+	}
+	f->n -= k;
+	if (f->n == 0) {
+		f->send = 0;
+		f->echo = 0;
+	}
+}
+
 // handle an audio request event
 static void audio_handler(struct ggm *s, struct event *e) {
 	size_t n = EVENT_BLOCK_SIZE(e->type);
@@ -98,26 +439,80 @@ static void audio_handler(struct ggm *s, struct event *e) {
 
 	//DBG("audio %08x %08x\r\n", e->type, e->ptr);
 
-	// clear the output buffers
 	float out_l[n], out_r[n];
-	memset(out_l, 0, n * sizeof(float));
-	memset(out_r, 0, n * sizeof(float));
+	float send_l[n], send_r[n];
+	float echo_l[n], echo_r[n];
+	struct mix m = {
+		.out_l = out_l,
+		.out_r = out_r,
+		.send_l = send_l,
+		.send_r = send_r,
+		.echo_l = echo_l,
+		.echo_r = echo_r,
+		.send_silent = 1,
+		.echo_silent = 1,
+	};
+
+	// apply the control changes and note expression received since the last block
+	midi_cc_flush(s);
+	midi_expr_flush(s);
+
+	// t0 is the sample clock time when this block will be played
+	uint32_t t0 = audio_buffer_time(s->audio, dst);
+	seq_exec(&s->seq0, t0);
+
+	// generate the voices, splitting the block where midi messages are due
+	size_t ofs = 0;
+	while (ofs < n) {
+		size_t k = midi_dispatch(&s->midi_rx0, t0 + ofs, n - ofs);
+		k = midi_dispatch(&s->midi_rx1, t0 + ofs, k);
+		voices_gen(s, &m, ofs, k);
+		fade_mix(s, &m, ofs, k);
+		lfos_step(s, k);
+		ofs += k;
+	}
+	int send_silent = m.send_silent;
+	int echo_silent = m.echo_silent;
 
-	for (int i = 0; i < NUM_VOICES; i++) {
-		struct voice *v = &s->voices[i];
-		struct patch *p = v->patch;
-		if (p && p->ops->active(v)) {
-			// generate left/right samples
-			float buf_l[n], buf_r[n];
-			p->ops->generate(v, buf_l, buf_r, n);
-			// accumulate in the output buffers
-			block_add(out_l, buf_l, n);
-			block_add(out_r, buf_r, n);
+	// effects bus: run the reverb while it has input or a tail
+	if (!send_silent) {
+		s->reverb_active = 1;
+		silence_init(&s->reverb_sd);
+	}
+	if (s->reverb_active) {
+		float ret_l[n], ret_r[n];
+		fdn_gen(&s->reverb, ret_l, ret_r, send_l, send_r, n);
+		if (send_silent && silence_detect(&s->reverb_sd, ret_l, n)) {
+			// the tail has decayed
+			s->reverb_active = 0;
 		}
+		block_add(out_l, ret_l, n);
+		block_add(out_r, ret_r, n);
 	}
 
+	// effects bus: run the delay/chorus while it has input or a tail
+	if (!echo_silent) {
+		s->echo_active = 1;
+	}
+	if (s->echo_active) {
+		float ret_l[n], ret_r[n];
+		echo_ctrl_tempo(&s->echo, s->seq0.beats_per_min);
+		echo_gen(&s->echo, ret_l, ret_r, echo_l, echo_r, n);
+		if (echo_silent && echo_is_idle(&s->echo)) {
+			// the tail has decayed
+			s->echo_active = 0;
+			echo_reset(&s->echo);
+		}
+		block_add(out_l, ret_l, n);
+		block_add(out_r, ret_r, n);
+	}
+
+	// keep the master bus below full scale
+	limiter_gen(&s->limiter, out_l, out_r, n);
 	// write the samples to the dma buffer
 	audio_wr(dst, n, out_l, out_r);
+	// and to the usb audio stream
+	usbaudio_wr(t0, dst, n);
 	// record some realtime stats
 	audio_stats(s->audio, dst);
 }
@@ -128,6 +523,8 @@ static void audio_handler(struct ggm *s, struct event *e) {
 int ggm_run(struct ggm *s) {
 	while (1) {
 		struct event e;
+		// get and queue serial midi messages before rendering the next block
+		midi_rx_serial(&s->midi_rx0, s->serial);
 		if (!event_rd(&e)) {
 			switch (EVENT_TYPE(e.type)) {
 			case EVENT_TYPE_KEY_DN:
@@ -140,24 +537,30 @@ int ggm_run(struct ggm *s) {
 				midi_handler(s, &e);
 				break;
 			case EVENT_TYPE_AUDIO:
-				seq_exec(&s->seq0);
 				audio_handler(s, &e);
 				break;
 			default:
 				DBG("unknown event %08x %08x\r\n", e.type, e.ptr);
 				break;
 			}
+		} else {
+			// nothing to do, top up the entropy pool
+			entropy_idle();
 		}
-		// get and process serial midi messages
-		midi_rx_serial(&s->midi_rx0, s->serial);
 	}
 	return 0;
 }
 
 //-----------------------------------------------------------------------------
 
+// startup program (bank 0) on each channel, -1 for no patch
+static const int8_t ggm_programs[NUM_CHANNELS] = {
+	2, 0, 1, 3, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
 // initialise the ggm state
-int ggm_init(struct ggm *s, struct audio_drv *audio, struct usart_drv *serial) {
+// xmem: external memory for the delay/chorus, NULL if there is none
+int ggm_init(struct ggm *s, struct audio_drv *audio, struct usart_drv *serial, const struct xmem *xmem) {
 	int rc = 0;
 
 	memset(s, 0, sizeof(struct ggm));
@@ -166,28 +569,29 @@ int ggm_init(struct ggm *s, struct audio_drv *audio, struct usart_drv *serial) {
 
 	// setup the midi receivers.
 	s->midi_rx0.ggm = s;
+	s->midi_rx1.ggm = s;
+	midi_init(s);
 
 	rc = event_init();
 	if (rc != 0) {
 		DBG("event_init failed %d\r\n", rc);
 		goto exit;
 	}
-	// setup the patch operations
-	s->patches[0].ops = &patch2;
-	s->patches[1].ops = &patch0;
-	s->patches[2].ops = &patch1;
-	s->patches[3].ops = &patch3;
-	s->patches[4].ops = &patch5;
-	s->patches[5].ops = &patch6;
+	// setup the effects bus
+	fdn_init(&s->reverb);
+	if (echo_init(&s->echo, xmem) != 0) {
+		DBG("no delay/chorus\r\n");
+	}
+	limiter_init(&s->limiter);
 
 	// setup the patch on each channel
 	for (int i = 0; i < NUM_CHANNELS; i++) {
 		struct patch *p = &s->patches[i];
-		// call init for each patch
-		if (p->ops) {
-			p->ggm = s;
-			memset(p->state, 0, PATCH_STATE_SIZE);
-			p->ops->init(p);
+		p->ggm = s;
+		tuning_init(&p->tuning);
+		// load the startup program
+		if (ggm_programs[i] >= 0) {
+			program_swap(s, i, program_prepare(s, i, ggm_programs[i]));
 		}
 	}
 
@@ -198,6 +602,12 @@ int ggm_init(struct ggm *s, struct audio_drv *audio, struct usart_drv *serial) {
 		v->channel = 255;
 		v->note = 255;
 	}
+	memset(s->voice_map, VOICE_NONE, sizeof(s->voice_map));
+	for (int i = NUM_VOICES - 1; i >= 0; i--) {
+		struct voice *v = &s->voices[i];
+		v->next = s->voice_free;
+		s->voice_free = v;
+	}
 
 	// setup the sequencer
 	rc = seq_init(&s->seq0);
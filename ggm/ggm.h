@@ -30,16 +30,34 @@ GooGooMuck Synthesizer
 
 void pow_benchmark(void);
 void block_benchmark(void);
+void lpf_benchmark(void);
+void filter4_benchmark(void);
 
 //-----------------------------------------------------------------------------
 // block operations
 
+// block tags: generators may describe the block they have produced
+#define BLOCK_CONSTANT (1U << 0)	// all samples have the same value
+#define BLOCK_ZERO (1U << 1)	// all samples are zero
+
 void block_mul(float *out, float *buf, size_t n);
 void block_mul_k(float *out, float k, size_t n);
 void block_add(float *out, float *buf, size_t n);
 void block_add_k(float *out, float k, size_t n);
 void block_copy(float *dst, const float *src, size_t n);
 void block_copy_mul_k(float *dst, const float *src, float k, size_t n);
+void block_add_mul_k(float *out, const float *buf, float k, size_t n);
+float block_peak(const float *buf, size_t n);
+
+//-----------------------------------------------------------------------------
+// silence detection
+
+struct silence {
+	int count;		// number of consecutive quiet samples
+};
+
+void silence_init(struct silence *s);
+int silence_detect(struct silence *s, const float *in, size_t n);
 
 //-----------------------------------------------------------------------------
 // power functions
@@ -60,11 +78,31 @@ struct pan {
 void pan_init(struct pan *p);
 void pan_ctrl(struct pan *p, float vol, float pan);
 void pan_gen(struct pan *p, float *out_l, float *out_r, const float *in, size_t n);
+void pan_gen_stereo(struct pan *p, float *out_l, float *out_r, const float *in_l, const float *in_r, size_t n);
+
+//-----------------------------------------------------------------------------
+// entropy pool
+
+struct entropy_stats {
+	uint32_t words_in;	// words written by the producer
+	uint32_t words_out;	// words read by consumers
+	uint32_t underruns;	// reads the pool couldn't supply
+	size_t level;		// current pool level
+	size_t level_min;	// minimum pool level after a read
+};
+
+int entropy_init(int (*poll)(uint32_t * x), uint32_t seed);
+int entropy_wr(uint32_t x);
+int entropy_rd(uint32_t * buf, size_t n);
+void entropy_idle(void);
+void entropy_fill(struct xrand *r, float *out, size_t n);
+void entropy_get_stats(struct entropy_stats *stats);
 
 //-----------------------------------------------------------------------------
 // noise
 
 struct noise {
+	struct xrand rand;	// PRNG stream
 	float b0, b1, b2, b3, b4, b5, b6;
 	//float max;
 	//uint32_t count;
@@ -86,6 +124,7 @@ struct sin {
 	uint32_t xstep;		// current x-step
 };
 
+float cos_lookup(uint32_t x);
 float sin_eval(float x);
 float cos_eval(float x);
 float tan_eval(float x);
@@ -109,6 +148,29 @@ void gwave_ctrl_frequency(struct gwave *osc, float freq);
 void gwave_ctrl_shape(struct gwave *osc, float duty, float slope);
 void gwave_gen(struct gwave *osc, float *out, float *fm, size_t n);
 
+// Unison Goom Waves
+#define UNISON_MAX 8
+
+struct unison {
+	float freq;		// base frequency
+	float detune;		// maximum detuning (semitones)
+	float spread;		// stereo spread
+	int n;			// number of sub-oscillators
+	uint32_t tp;		// s0f0 to s1f1 transition point
+	float k0;		// scaling factor for slope 0
+	float k1;		// scaling factor for slope 1
+	uint32_t x[UNISON_MAX];	// phase positions
+	uint32_t xstep[UNISON_MAX];	// phase steps per sample
+	float kl[UNISON_MAX];	// left channel gains
+	float kr[UNISON_MAX];	// right channel gains
+};
+
+void unison_init(struct unison *osc);
+void unison_ctrl_frequency(struct unison *osc, float freq);
+void unison_ctrl_shape(struct unison *osc, float duty, float slope);
+void unison_ctrl_detune(struct unison *osc, int n, float detune, float spread);
+void unison_gen(struct unison *osc, float *out_l, float *out_r, size_t n);
+
 //-----------------------------------------------------------------------------
 // ADSR envelope
 
@@ -120,12 +182,16 @@ struct adsr {
 	float d_trigger;	// attack->decay trigger level
 	float s_trigger;	// decay->sustain trigger level
 	float i_trigger;	// release->idle trigger level
+	float la;		// ln(1 - ka), for attack segment length
+	float ld;		// ln(1 - kd), for decay segment length
+	float lr;		// ln(1 - kr), for release segment length
+	uint32_t count;		// samples remaining in the current segment
 	int state;		// envelope state
 	float val;		// output value
 };
 
 // generators
-void adsr_gen(struct adsr *e, float *out, size_t n);
+int adsr_gen(struct adsr *e, float *out, size_t n);
 
 // envelopes
 void adsr_init(struct adsr *e, float a, float d, float s, float r);
@@ -151,6 +217,7 @@ struct ks {
 	float k;		// attenuation and averaging constant 0 to 0.5
 	uint32_t x;		// phase position
 	uint32_t xstep;		// phase step per sample
+	struct xrand rand;	// PRNG stream for plucking
 };
 
 void ks_init(struct ks *osc);
@@ -159,6 +226,32 @@ void ks_ctrl_attenuate(struct ks *osc, float attenuate);
 void ks_pluck(struct ks *osc);
 void ks_gen(struct ks *osc, float *out, size_t n);
 
+// Karplus Strong with pitch tracking delay lines from a shared pool
+
+#define KS2_FREQ_MIN (27.5f)	// lowest playable note (A0)
+#define KS2_BEND_DOWN (0.8908987f)	// allow for a 2 semitone pitch bend down
+#define KS2_DELAY_MAX 1856U	// > AUDIO_FS / (KS2_FREQ_MIN * KS2_BEND_DOWN)
+
+struct ks2 {
+	float freq;		// base frequency
+	float k;		// attenuation and averaging constant 0 to 0.5
+	float c;		// allpass coefficient for the fractional delay
+	float *delay;		// delay line (from the shared pool)
+	unsigned int size;	// allocated delay line size
+	unsigned int len;	// delay line length in use
+	unsigned int pos;	// delay line position
+	float x1;		// previous delay line output (averaging filter)
+	float ap_x1, ap_y1;	// allpass filter state
+	struct xrand rand;	// PRNG stream for plucking
+};
+
+void ks2_init(struct ks2 *osc);
+void ks2_ctrl_frequency(struct ks2 *osc, float freq);
+void ks2_ctrl_attenuate(struct ks2 *osc, float attenuate);
+int ks2_pluck(struct ks2 *osc);
+void ks2_free(struct ks2 *osc);
+void ks2_gen(struct ks2 *osc, float *out, size_t n);
+
 //-----------------------------------------------------------------------------
 // Low Pass Filters
 
@@ -173,17 +266,163 @@ void svf_ctrl_cutoff(struct svf *f, float cutoff);
 void svf_ctrl_resonance(struct svf *f, float resonance);
 void svf_init(struct svf *f);
 void svf_gen(struct svf *f, float *out, const float *in, size_t n);
+void svf_gen_mod(struct svf *f, float *out, const float *in, const float *cutoff, size_t n);
+
+struct svf_coeff {
+	uint32_t key;		// quantised cutoff and resonance
+	float g;		// constant for cutoff frequency
+	float k;		// constant for filter resonance
+	float a1, a2, a3;	// derived filter coefficients
+};
+
+const struct svf_coeff *svf_coeff_lookup(float cutoff, float resonance);
 
 struct svf2 {
 	float ic1eq, ic2eq;	// state variables
+	float cutoff;		// cutoff frequency
+	float resonance;	// resonance 0..1
 	float g;		// constant for cutoff frequency
 	float k;		// constant for filter resonance
+	float a1, a2, a3;	// derived filter coefficients
 };
 
+void svf2_ctrl(struct svf2 *f, float cutoff, float resonance);
 void svf2_ctrl_cutoff(struct svf2 *f, float cutoff);
 void svf2_ctrl_resonance(struct svf2 *f, float resonance);
 void svf2_init(struct svf2 *f);
 void svf2_gen(struct svf2 *f, float *out, const float *in, size_t n);
+void svf2_gen_mod(struct svf2 *f, float *out, const float *in, const float *cutoff, size_t n);
+
+struct ladder {
+	float cutoff;		// cutoff frequency
+	float k;		// feedback gain
+	float drive;		// input gain
+	int oversample;		// run at 2x the sample rate
+	float s[4];		// stage state variables
+	float up[3];		// upsampler history
+	float dn[5];		// downsampler history
+};
+
+void ladder_ctrl_cutoff(struct ladder *f, float cutoff);
+void ladder_ctrl_resonance(struct ladder *f, float resonance);
+void ladder_ctrl_drive(struct ladder *f, float drive);
+void ladder_ctrl_oversample(struct ladder *f, int oversample);
+void ladder_init(struct ladder *f);
+void ladder_gen(struct ladder *f, float *out, const float *in, size_t n);
+
+//-----------------------------------------------------------------------------
+// Multi-Lane Filters
+
+#define FILTER_LANES 4
+
+struct biquad4 {
+	float b0[FILTER_LANES], b1[FILTER_LANES], b2[FILTER_LANES];	// feedforward coefficients
+	float a1[FILTER_LANES], a2[FILTER_LANES];	// feedback coefficients
+	float s1[FILTER_LANES], s2[FILTER_LANES];	// state variables
+};
+
+void biquad4_ctrl_lpf(struct biquad4 *f, int lane, float cutoff, float q);
+void biquad4_ctrl_bpf(struct biquad4 *f, int lane, float freq, float q);
+void biquad4_reset(struct biquad4 *f, int lane);
+void biquad4_init(struct biquad4 *f);
+void biquad4_gen(struct biquad4 *f, float *out[FILTER_LANES], const float *in[FILTER_LANES], size_t n);
+
+struct svf4 {
+	float a1[FILTER_LANES], a2[FILTER_LANES], a3[FILTER_LANES];	// filter coefficients
+	float ic1eq[FILTER_LANES], ic2eq[FILTER_LANES];	// state variables
+};
+
+void svf4_ctrl(struct svf4 *f, int lane, float cutoff, float resonance);
+void svf4_reset(struct svf4 *f, int lane);
+void svf4_init(struct svf4 *f);
+void svf4_gen(struct svf4 *f, float *out[FILTER_LANES], const float *in[FILTER_LANES], size_t n);
+
+//-----------------------------------------------------------------------------
+// FDN Reverb
+
+#define FDN_LINES 8
+
+struct fdn {
+	float *delay[FDN_LINES];	// delay lines (in CCM RAM)
+	unsigned int len[FDN_LINES];	// delay line lengths
+	unsigned int pos[FDN_LINES];	// delay line positions
+	float g[FDN_LINES];	// per line gain for the decay time
+	float lp[FDN_LINES];	// damping filter state
+	float kd;		// damping filter coefficient
+};
+
+void fdn_init(struct fdn *r);
+void fdn_ctrl_decay(struct fdn *r, float t60);
+void fdn_ctrl_damping(struct fdn *r, float damping);
+void fdn_gen(struct fdn *r, float *out_l, float *out_r, const float *in_l, const float *in_r, size_t n);
+
+//-----------------------------------------------------------------------------
+// External Memory
+
+// Large but slow memory (E.g. SDRAM) accessed with block copies.
+struct xmem {
+	float *base;		// base address
+	size_t size;		// size in floats
+	void (*copy) (void *dst, const void *src, size_t n);	// queue a copy of n floats
+	void (*wait) (void);	// wait for the queued copies to complete
+};
+
+//-----------------------------------------------------------------------------
+// Stereo Delay/Chorus
+
+#define ECHO_CHANNELS 2
+#define ECHO_SLACK 32		// extra window samples for tap modulation and interpolation
+#define ECHO_WIN_SIZE (AUDIO_BLOCK_SIZE + ECHO_SLACK)
+
+struct echo {
+	const struct xmem *mem;	// external memory for the delay lines
+	float *line[ECHO_CHANNELS];	// delay lines (in external memory)
+	uint32_t mask;		// delay line length - 1
+	uint32_t wr;		// write position for the current block
+	float d0[ECHO_CHANNELS];	// tap delay at the start of the block (samples)
+	float d1[ECHO_CHANNELS];	// tap delay at the end of the block (samples)
+	uint32_t ofs[ECHO_CHANNELS];	// window start offset behind the write position
+	float time;		// delay time (samples)
+	float secs;		// free running delay time (seconds)
+	float beats;		// tempo synced delay time (beats), 0 for free running
+	float bpm;		// tempo
+	float fb;		// feedback
+	float depth;		// chorus depth (samples)
+	uint32_t lfo_x;		// chorus lfo phase
+	uint32_t lfo_step;	// chorus lfo phase step per block
+	int primed;		// the windows for the current block have been read
+	uint32_t quiet;		// number of samples the delay line input has been silent
+	float win[ECHO_CHANNELS][ECHO_WIN_SIZE];	// SRAM windows of the delay line taps
+	float wbuf[ECHO_CHANNELS][AUDIO_BLOCK_SIZE];	// SRAM staging for delay line writes
+};
+
+int echo_init(struct echo *e, const struct xmem *mem);
+void echo_reset(struct echo *e);
+int echo_is_idle(struct echo *e);
+void echo_ctrl_time(struct echo *e, float secs);
+void echo_ctrl_sync(struct echo *e, float beats);
+void echo_ctrl_tempo(struct echo *e, float bpm);
+void echo_ctrl_feedback(struct echo *e, float fb);
+void echo_ctrl_chorus(struct echo *e, float rate, float depth);
+void echo_gen(struct echo *e, float *out_l, float *out_r, const float *in_l, const float *in_r, size_t n);
+
+//-----------------------------------------------------------------------------
+// Master Bus Limiter
+
+#define LIMITER_CHUNK 16	// samples per peak detection chunk
+#define LIMITER_AHEAD 4		// look-ahead (chunks)
+#define LIMITER_DELAY (LIMITER_AHEAD * LIMITER_CHUNK)
+
+struct limiter {
+	float delay_l[LIMITER_DELAY];	// look-ahead delay
+	float delay_r[LIMITER_DELAY];
+	float req[LIMITER_AHEAD + 1];	// gain needed by the last output and the delayed chunks
+	float g;		// gain at the current chunk boundary
+	float kr;		// release coefficient
+};
+
+void limiter_init(struct limiter *lim);
+void limiter_gen(struct limiter *lim, float *out_l, float *out_r, size_t n);
 
 //-----------------------------------------------------------------------------
 // Note Sequencer
@@ -197,6 +436,34 @@ struct seq_sm {
 	int duration;		// operation duration
 };
 
+// midi clock slave
+struct seq_clock {
+	int state;		// lock state
+	uint32_t t_last;	// arrival time of the last clock (sample clock)
+	uint32_t t_clock;	// filtered time of the last clock (sample clock)
+	float t_frac;		// fractional part of t_clock
+	float period;		// filtered clock period (samples)
+	int32_t pos;		// song position of the next clock (clocks)
+	int run;		// the song position is moving (receive time)
+};
+
+#define SEQ_QUEUE_SIZE 8	// transport event queue size (must be a power of 2)
+
+// transport events
+enum {
+	SEQ_EVENT_START,
+	SEQ_EVENT_STOP,
+	SEQ_EVENT_CONTINUE,
+	SEQ_EVENT_SEEK,
+};
+
+// timestamped transport event
+struct seq_event {
+	int op;			// transport event
+	uint32_t ticks;		// seek position (ticks)
+	uint32_t time;		// sample clock time of the message
+};
+
 // sequencer
 struct seq {
 	struct ggm *ggm;	// pointer back to the parent ggm state
@@ -204,30 +471,116 @@ struct seq {
 	float secs_per_tick;
 	float tick_error;
 	uint32_t ticks;
+	int mute;		// don't play notes (while seeking)
+	int seeking;		// a seek is in progress
+	uint32_t seek;		// seek position (ticks)
+	struct seq_clock clk;	// midi clock slave
+	struct seq_event queue[SEQ_QUEUE_SIZE];	// received transport events
+	size_t q_rd, q_wr;	// queue read/write indices
 	struct seq_sm m0;
 };
 
 int seq_init(struct seq *s);
-void seq_exec(struct seq *s);
+void seq_exec(struct seq *s, uint32_t t);
+void seq_clock(struct seq *s, uint32_t t);
+void seq_start(struct seq *s, uint32_t t);
+void seq_stop(struct seq *s, uint32_t t);
+void seq_continue(struct seq *s, uint32_t t);
+void seq_song_position(struct seq *s, uint16_t spp, uint32_t t);
 
 //-----------------------------------------------------------------------------
 // midi
 
+#define MIDI_SYSEX_SIZE 512	// maximum sysex message size
+#define MIDI_QUEUE_SIZE 64	// received message queue size (must be a power of 2)
+
+// Messages are rendered a fixed time after they were received.
+// This covers the time until the next block that can be rendered.
+#define MIDI_LATENCY (2 * AUDIO_BLOCK_SIZE)	// samples
+#define MIDI_TIME_STEP 8	// message render time granularity (samples)
+
+_Static_assert(AUDIO_BLOCK_SIZE % MIDI_TIME_STEP == 0, "AUDIO_BLOCK_SIZE must be a multiple of MIDI_TIME_STEP");
+
+// timestamped midi message
+struct midi_msg {
+	void (*func) (struct ggm * s, const struct midi_msg * m);	// message handler
+	uint32_t time;		// sample clock time of the last byte
+	uint8_t status;		// message status byte
+	uint8_t arg0;		// message byte 0
+	uint8_t arg1;		// message byte 1
+};
+
 // midi message receiver
 struct midi_rx {
 	struct ggm *ggm;	// pointer back to the parent ggm state
-	void (*func) (struct midi_rx * midi);	// event function
+	void (*func) (struct ggm * s, const struct midi_msg * m);	// message handler
 	int state;		// rx state
 	uint8_t status;		// message status byte
 	uint8_t arg0;		// message byte 0
 	uint8_t arg1;		// message byte 1
+	uint32_t now;		// sample clock time of this rx poll
+	uint32_t poll;		// sample clock time of the previous rx poll
+	struct midi_msg queue[MIDI_QUEUE_SIZE];	// received messages
+	size_t q_rd, q_wr;	// queue read/write indices
+	size_t sysex_len;	// sysex message length
+	uint8_t sysex[MIDI_SYSEX_SIZE];	// sysex message (without the F0/F7)
 };
 
 void midi_rx_serial(struct midi_rx *midi, struct usart_drv *serial);
+void midi_rx_usb(struct midi_rx *midi, uint32_t t, const uint32_t * pkt, size_t n);
+size_t midi_dispatch(struct midi_rx *midi, uint32_t t, size_t n);
+void midi_cc_flush(struct ggm *s);
+void midi_expr_flush(struct ggm *s);
+void midi_init(struct ggm *s);
 float midi_map(uint8_t val, float a, float b);
 float midi_to_frequency(float note);
 float midi_pitch_bend(uint16_t val);
 
+//-----------------------------------------------------------------------------
+// usb device
+
+#define USB_IF_AUDIO_CONTROL 0	// audio control interface
+#define USB_IF_MIDI 1		// midi streaming interface
+#define USB_IF_AUDIO 2		// audio streaming interface
+
+#define USB_EP_MIDI_OUT 0x01U	// midi bulk OUT endpoint
+#define USB_EP_AUDIO_IN 0x82U	// audio isochronous IN endpoint
+
+#define USB_MIDI_EP_SIZE 64U	// midi endpoint maximum packet size
+#define USB_AUDIO_RATE 44100	// nominal audio sample rate
+#define USB_AUDIO_FRAMES_MAX 46	// maximum stereo frames per audio packet
+#define USB_AUDIO_EP_SIZE (USB_AUDIO_FRAMES_MAX * 4)	// audio endpoint maximum packet size
+
+int usb_init(struct usbd_drv *usbd, struct audio_drv *audio);
+
+// usb midi
+
+#define USBMIDI_BATCH_SIZE 64	// usb midi packets per batch
+#define USBMIDI_BATCHES 4	// must be a power of 2
+
+// usb midi packets received in a usb frame
+struct usbmidi_batch {
+	uint32_t time;		// sample clock time of the first packet
+	size_t n;		// number of packets
+	uint32_t pkt[USBMIDI_BATCH_SIZE];	// usb midi packets
+};
+
+void usbmidi_init(struct audio_drv *audio);
+void usbmidi_configure(struct usbd_drv *usbd, int config);
+void usbmidi_rx(struct usbd_drv *usbd, int ep, size_t n);
+void usbmidi_sof(struct usbd_drv *usbd);
+void usbmidi_release(struct usbmidi_batch *b);
+
+// usb audio
+
+void usbaudio_init(struct audio_drv *audio);
+void usbaudio_configure(struct usbd_drv *usbd, int config);
+int usbaudio_set_interface(struct usbd_drv *usbd, int alt);
+int usbaudio_setup(struct usbd_drv *usbd, const struct usbd_setup *req);
+void usbaudio_tx(struct usbd_drv *usbd, int ep);
+void usbaudio_sof(struct usbd_drv *usbd);
+void usbaudio_wr(uint32_t t, const int16_t * buf, size_t n);
+
 //-----------------------------------------------------------------------------
 // events
 
@@ -254,22 +607,100 @@ int event_init(void);
 int event_rd(struct event *event);
 int event_wr(uint32_t type, void *ptr);
 
+//-----------------------------------------------------------------------------
+// Low Frequency Oscillators
+
+enum {
+	LFO_SINE,
+	LFO_TRIANGLE,
+	LFO_SAW,
+	LFO_SQUARE,
+	LFO_SHAPES,		// must be last
+};
+
+struct lfo {
+	int shape;		// wave shape
+	uint32_t x;		// phase at the start of the current span
+	uint32_t xstep;		// phase step per sample
+};
+
+void lfo_init(struct lfo *l);
+void lfo_ctrl_rate(struct lfo *l, float rate);
+void lfo_ctrl_shape(struct lfo *l, int shape);
+void lfo_step(struct lfo *l, size_t n);
+float lfo_value(const struct lfo *l, uint32_t ofs);
+void lfo_add_ramp(const struct lfo *l, uint32_t ofs, float k, float *out, size_t n);
+
+// return a per voice phase offset, spread (0..1) across the voices
+static inline uint32_t lfo_voice_phase(int idx, float spread) {
+	return (uint32_t) (spread * (float)(1U << 28)) * (uint32_t) idx;
+}
+
+//-----------------------------------------------------------------------------
+// Tuning Tables
+
+#define TUNING_NOTES 128
+
+struct tuning {
+	float freq[TUNING_NOTES];	// note frequencies (Hz)
+	float bend;		// pitch bend ratio
+};
+
+void tuning_init(struct tuning *t);
+void tuning_ctrl_bend(struct tuning *t, float bend);
+int tuning_sysex(struct ggm *s, const uint8_t * buf, size_t n);
+
+// return the frequency of a note with pitch bend
+static inline float tuning_frequency(const struct tuning *t, uint8_t note) {
+	return t->freq[note & (TUNING_NOTES - 1)] * t->bend;
+}
+
 //-----------------------------------------------------------------------------
 // voices
 
 #define VOICE_STATE_SIZE 1024
+#define VOICE_NONE 255		// no voice in the channel/note map
+
+// per note expression (polyphonic aftertouch, MPE)
+enum {
+	EXPR_PRESSURE,		// note pressure (0..1)
+	EXPR_BEND,		// note pitch bend (semitones)
+	EXPR_TIMBRE,		// note timbre (0..1, CC74)
+	EXPR_NUM,		// must be last
+};
 
 struct voice {
 	int idx;		// index in table
 	uint8_t note;		// current note
 	uint8_t channel;	// current channel
 	struct patch *patch;	// patch in use
+	struct voice *prev;	// previous voice using the patch
+	struct voice *next;	// next voice using the patch
+	uint32_t age;		// note on order stamp
+	int released;		// the note has been released
+	float level;		// output peak level of the last span (while released)
+	float expr[EXPR_NUM];	// per note expression
+	float bend;		// per note pitch bend ratio
 	uint8_t state[VOICE_STATE_SIZE];	// per voice state
 };
 
 struct voice *voice_lookup(struct ggm *s, uint8_t channel, uint8_t note);
 struct voice *voice_alloc(struct ggm *s, uint8_t channel, uint8_t note);
 void update_voices(struct patch *p, void (*func) (struct voice *));
+void voice_note_on(struct voice *v, uint8_t vel);
+void voice_note_off(struct voice *v, uint8_t vel);
+
+// A stolen voice is faded out over VOICE_FADE samples.
+#define VOICE_FADE 64
+
+struct voice_fade {
+	float out_l[VOICE_FADE], out_r[VOICE_FADE];	// main output
+	float send_l[VOICE_FADE], send_r[VOICE_FADE];	// reverb send
+	float echo_l[VOICE_FADE], echo_r[VOICE_FADE];	// delay/chorus send
+	size_t n;		// remaining samples
+	int send;		// the reverb send buffers are in use
+	int echo;		// the delay/chorus send buffers are in use
+};
 
 //-----------------------------------------------------------------------------
 // patches
@@ -282,7 +713,8 @@ struct patch_ops {
 	void (*note_on) (struct voice * v, uint8_t vel);
 	void (*note_off) (struct voice * v, uint8_t vel);
 	int (*active) (struct voice * v);	// is the voice active
-	void (*generate) (struct voice * v, float *out_l, float *out_r, size_t n);	// generate samples
+	int (*generate) (struct voice * v, float *out_l, float *out_r, size_t n);	// generate samples, !=0 for silence
+	void (*expression) (struct voice * v);	// the per note expression has changed (optional)
 	// patch functions
 	void (*init) (struct patch * p);
 	void (*control_change) (struct patch * p, uint8_t ctrl, uint8_t val);
@@ -290,13 +722,24 @@ struct patch_ops {
 };
 
 #define PATCH_STATE_SIZE 128
+#define PATCH_LFOS 2
 
 struct patch {
 	struct ggm *ggm;	// pointer back to the parent ggm state
 	const struct patch_ops *ops;
+	struct lfo lfo[PATCH_LFOS];	// lfos shared by the patch voices
+	struct tuning tuning;	// note tuning table
+	struct voice *voices;	// voices using the patch
+	int nvoices;		// number of voices using the patch
+	int voice_limit;	// maximum voices for the patch (0 for no limit)
 	uint8_t state[PATCH_STATE_SIZE];	// per patch state
 };
 
+// return the frequency of the voice note with the patch and per note pitch bends
+static inline float voice_frequency(const struct voice *v) {
+	return tuning_frequency(&v->patch->tuning, v->note) * v->bend;
+}
+
 // implemented patches
 extern const struct patch_ops patch0;
 extern const struct patch_ops patch1;
@@ -305,6 +748,34 @@ extern const struct patch_ops patch3;
 extern const struct patch_ops patch4;
 extern const struct patch_ops patch5;
 extern const struct patch_ops patch6;
+extern const struct patch_ops patch7;
+
+// A patch preset is a program in a patch bank. The serialized state is a
+// struct p_state image, it is copied over the patch state after init().
+struct patch_preset {
+	const char *name;	// program name
+	const struct patch_ops *ops;	// patch operations
+	const void *state;	// serialized patch state, NULL for the init() defaults
+	size_t size;		// size of the serialized state (<= PATCH_STATE_SIZE)
+};
+
+// patch presets
+extern const struct patch_preset patch1_presets[];
+extern const struct patch_preset patch3_presets[];
+extern const struct patch_preset patch7_presets[];
+
+//-----------------------------------------------------------------------------
+// patch banks
+
+#define NUM_PROGRAMS 128	// programs per bank
+
+struct patch_bank {
+	const char *name;	// bank name
+	const struct patch_preset *const *program;	// programs (NULL for an empty program)
+	size_t n;		// number of programs (<= NUM_PROGRAMS)
+};
+
+const struct patch_preset *bank_preset(unsigned int bank, unsigned int prog);
 
 //-----------------------------------------------------------------------------
 
@@ -312,18 +783,99 @@ extern const struct patch_ops patch6;
 #define NUM_VOICES 16
 // number of concurrent channels
 #define NUM_CHANNELS 16
+// number of midi notes
+#define NUM_NOTES 128
+
+_Static_assert(NUM_VOICES < VOICE_NONE, "voice indices must fit in the channel/note map");
+
+// Control changes for the patches are staged and applied once per block, so
+// a burst of changes to a controller only updates the patch once. A note on
+// applies the changes staged for its channel first, to keep message order.
+#define NUM_CONTROLLERS 128
+
+struct cc_stage {
+	uint8_t val[NUM_CHANNELS][NUM_CONTROLLERS];	// latest controller values
+	uint32_t dirty[NUM_CHANNELS][NUM_CONTROLLERS / 32];	// changed controllers
+	uint32_t channels;	// channels with changed controllers
+};
+
+_Static_assert(NUM_CHANNELS <= 32, "the dirty channel bitmap needs NUM_CHANNELS <= 32");
+_Static_assert(NUM_VOICES <= 32, "the dirty expression bitmap needs NUM_VOICES <= 32");
+
+// MIDI Polyphonic Expression zones
+// The lower zone has master channel 0 and member channels 1..n.
+// The upper zone has master channel 15 and member channels 14..15-n.
+// Notes on the member channels play the patch of the zone master channel.
+enum {
+	MPE_LOWER,
+	MPE_UPPER,
+	MPE_ZONES,		// must be last
+};
+
+struct mpe {
+	uint8_t members[MPE_ZONES];	// number of member channels (0 for no zone)
+	float bend_range[MPE_ZONES];	// member channel pitch bend range (semitones)
+	uint16_t rpn[NUM_CHANNELS];	// selected registered parameter number
+};
+
+// Program changes are double buffered. The new patch is prepared in a slot
+// when the message is received (outside the audio handler) and the queued
+// message carries the slot tag. The slot is swapped in when the message is
+// dispatched, so each program change gets its own patch. The tag identifies
+// the use of the slot, so a message whose slot has been reused is ignored.
+#define PROGRAM_SLOTS 8		// prepared patch slots (must be a power of 2)
+#define PROGRAM_TAGS 128	// slot tags (a multiple of PROGRAM_SLOTS)
+#define PROGRAM_NONE 0xff	// no prepared patch
+
+_Static_assert((PROGRAM_SLOTS & (PROGRAM_SLOTS - 1)) == 0, "PROGRAM_SLOTS must be a power of 2");
+_Static_assert(PROGRAM_TAGS % PROGRAM_SLOTS == 0, "PROGRAM_TAGS must be a multiple of PROGRAM_SLOTS");
+
+struct patch_next {
+	const struct patch_ops *ops;	// prepared patch operations (NULL for none)
+	uint8_t chan;		// channel of the program change
+	uint8_t tag;		// tag of the program change
+	struct lfo lfo[PATCH_LFOS];	// prepared patch lfos
+	uint8_t state[PATCH_STATE_SIZE];	// prepared patch state
+};
+
+struct program {
+	uint8_t bank[NUM_CHANNELS];	// selected bank (bank select msb)
+	struct patch_next next[PROGRAM_SLOTS];	// prepared patches
+	uint8_t tag;		// next tag, the slot is tag & (PROGRAM_SLOTS - 1)
+};
+
+uint8_t program_prepare(struct ggm *s, uint8_t chan, uint8_t prog);
+void program_swap(struct ggm *s, uint8_t chan, uint8_t tag);
 
 struct ggm {
 	struct audio_drv *audio;	// audio output
 	struct usart_drv *serial;	// serial port for midi interface
 	struct midi_rx midi_rx0;	// midi rx from the serial port
+	struct midi_rx midi_rx1;	// midi rx from usb
 	struct seq seq0;	// note sequencer
 	struct patch patches[NUM_CHANNELS];	// current patch set
+	struct cc_stage cc;	// staged control changes
+	struct program prog;	// program changes
+	uint8_t patch_map[NUM_CHANNELS];	// channel to patch index (MPE members use the master patch)
+	struct mpe mpe;		// MPE zones
+	float chan_expr[NUM_CHANNELS][EXPR_NUM];	// latest per channel expression (for new notes)
+	uint32_t expr_dirty;	// voices with changed expression
 	struct voice voices[NUM_VOICES];	// voices
-	int voice_idx;		// FIXME round robin voice allocation
+	uint8_t voice_map[NUM_CHANNELS][NUM_NOTES];	// channel/note to voice index
+	struct voice *voice_free;	// idle voices
+	uint32_t voice_age;	// note on counter
+	struct voice_fade fade;	// stolen voice fade outs
+	float send[NUM_CHANNELS];	// per channel effects send level
+	struct fdn reverb;	// effects bus reverb
+	struct silence reverb_sd;	// reverb tail silence detection
+	int reverb_active;	// the reverb has input or a tail
+	float echo_send[NUM_CHANNELS];	// per channel delay/chorus send level
+	struct echo echo;	// effects bus delay/chorus (needs external memory)
+	int echo_active;	// the delay/chorus has input or a tail
+	struct limiter limiter;	// master bus limiter
 };
 
-int ggm_init(struct ggm *s, struct audio_drv *audio, struct usart_drv *midi);
+int ggm_init(struct ggm *s, struct audio_drv *audio, struct usart_drv *midi, const struct xmem *xmem);
 int ggm_run(struct ggm *s);
 
 //-----------------------------------------------------------------------------
@@ -15,6 +15,8 @@ we do the low pass filtering on it (in this case simple averaging).
 */
 //-----------------------------------------------------------------------------
 
+#include <math.h>
+
 #include "ggm.h"
 #include "utils.h"
 
@@ -57,9 +59,10 @@ void ks_pluck(struct ks *osc) {
 	// Initialise the delay buffer with random samples between -1 and 1.
 	// The values should sum to zero so that multiple rounds of filtering
 	// will make all values fall to zero.
+	entropy_fill(&osc->rand, osc->delay, KS_DELAY_SIZE);
 	float sum = 0.f;
 	for (unsigned int i = 0; i < KS_DELAY_SIZE - 1; i++) {
-		float val = rand_float();
+		float val = osc->delay[i];
 		float x = sum + val;
 		if (x > 1.f || x < -1.f) {
 			val = -val;
@@ -82,7 +85,213 @@ void ks_ctrl_frequency(struct ks *osc, float freq) {
 }
 
 void ks_init(struct ks *osc) {
-	// do nothing
+	xrand_init(&osc->rand, rand_uint32());
+}
+
+//-----------------------------------------------------------------------------
+/*
+
+Karplus Strong with Pitch Tracking Delay Lines
+
+This implementation uses a delay line whose length tracks the period of the
+note. The loop is:
+
+delay line (integer length) -> averaging filter (0.5 sample delay) -> allpass
+
+The first order allpass provides the fractional part of the delay so we get
+fine frequency control without resampling the delay line.
+
+The delay lines are allocated from a shared pool when the string is plucked
+and returned when it is freed, so memory is only used by sounding strings.
+The pool is allocated in chunks and sized to hold a few strings at the lowest
+playable note.
+
+*/
+//-----------------------------------------------------------------------------
+
+#define KS2_CHUNK_SIZE 32U	// pool allocation granularity (floats)
+#define KS2_POOL_STRINGS 4U	// number of lowest note strings in the pool
+#define KS2_POOL_SIZE (KS2_POOL_STRINGS * KS2_DELAY_MAX)
+#define KS2_POOL_CHUNKS (KS2_POOL_SIZE / KS2_CHUNK_SIZE)
+#define KS2_FREQ_LO (KS2_FREQ_MIN * KS2_BEND_DOWN)	// lowest bent frequency
+
+_Static_assert((KS2_DELAY_MAX % KS2_CHUNK_SIZE) == 0, "KS2_DELAY_MAX must be a multiple of KS2_CHUNK_SIZE");
+
+struct ks2_pool {
+	float buf[KS2_POOL_SIZE];	// delay line storage
+	uint32_t used[(KS2_POOL_CHUNKS + 31U) / 32U];	// chunk allocation bitmap
+};
+
+static struct ks2_pool pool;
+
+static int chunk_is_used(unsigned int i) {
+	return pool.used[i >> 5] & (1U << (i & 31));
+}
+
+static void chunk_set(unsigned int i, int used) {
+	if (used) {
+		pool.used[i >> 5] |= (1U << (i & 31));
+	} else {
+		pool.used[i >> 5] &= ~(1U << (i & 31));
+	}
+}
+
+// allocate n contiguous chunks, return the first chunk index or -1
+static int pool_alloc(unsigned int n) {
+	unsigned int run = 0;
+	for (unsigned int i = 0; i < KS2_POOL_CHUNKS; i++) {
+		run = chunk_is_used(i) ? 0 : run + 1;
+		if (run == n) {
+			unsigned int base = i + 1 - n;
+			for (unsigned int j = base; j <= i; j++) {
+				chunk_set(j, 1);
+			}
+			return (int)base;
+		}
+	}
+	return -1;
+}
+
+// free n contiguous chunks starting at base
+static void pool_free(unsigned int base, unsigned int n) {
+	for (unsigned int j = base; j < base + n; j++) {
+		chunk_set(j, 0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void ks2_gen(struct ks2 *osc, float *out, size_t n) {
+	if (osc->delay == NULL) {
+		// no delay line - no sound
+		for (size_t i = 0; i < n; i++) {
+			out[i] = 0.f;
+		}
+		return;
+	}
+
+	float *delay = osc->delay;
+	float k = osc->k;
+	float c = osc->c;
+	float x1 = osc->x1;
+	float ap_x1 = osc->ap_x1;
+	float ap_y1 = osc->ap_y1;
+	unsigned int pos = osc->pos;
+	size_t i = 0;
+
+	while (i < n) {
+		// run up to the end of the block or the end of the delay line
+		size_t run = osc->len - pos;
+		if (run > n - i) {
+			run = n - i;
+		}
+		for (size_t j = 0; j < run; j++) {
+			float x0 = delay[pos];
+			out[i++] = x0;
+			// attenuate and average
+			float lp = k * (x0 + x1);
+			x1 = x0;
+			// fractional delay allpass
+			float ap = (c * (lp - ap_y1)) + ap_x1;
+			ap_x1 = lp;
+			ap_y1 = ap;
+			delay[pos++] = ap;
+		}
+		if (pos >= osc->len) {
+			pos = 0;
+		}
+	}
+
+	osc->x1 = x1;
+	osc->ap_x1 = ap_x1;
+	osc->ap_y1 = ap_y1;
+	osc->pos = pos;
+}
+
+//-----------------------------------------------------------------------------
+
+// Set the delay line length and allpass coefficient for the frequency.
+static void ks2_set_delay(struct ks2 *osc) {
+	// loop delay = delay line length + 0.5 (averaging) + d (allpass)
+	// keep d in 0.1..1.1 for a well behaved allpass
+	float period = AUDIO_FS / osc->freq;
+	float len = truncf(period - 0.6f);
+	len = clampf(len, 2.f, (float)osc->size);
+	float d = period - 0.5f - len;
+	osc->len = (unsigned int)len;
+	osc->c = (1.f - d) / (1.f + d);
+	if (osc->pos >= osc->len) {
+		osc->pos = 0;
+	}
+}
+
+// Return the delay line to the pool.
+void ks2_free(struct ks2 *osc) {
+	if (osc->delay) {
+		unsigned int base = (osc->delay - pool.buf) / KS2_CHUNK_SIZE;
+		pool_free(base, osc->size / KS2_CHUNK_SIZE);
+		osc->delay = NULL;
+		osc->size = 0;
+	}
+}
+
+// Pluck the string, return 0 on success, or -1 if we can't get a delay line.
+int ks2_pluck(struct ks2 *osc) {
+	if (osc->delay == NULL) {
+		// Allocate for the lowest frequency we can bend down to.
+		float freq = clampf_lo(osc->freq * KS2_BEND_DOWN, KS2_FREQ_LO);
+		unsigned int size = (unsigned int)(AUDIO_FS / freq) + 1;
+		unsigned int chunks = (size + KS2_CHUNK_SIZE - 1) / KS2_CHUNK_SIZE;
+		if (chunks > KS2_DELAY_MAX / KS2_CHUNK_SIZE) {
+			chunks = KS2_DELAY_MAX / KS2_CHUNK_SIZE;
+		}
+		int base = pool_alloc(chunks);
+		if (base < 0) {
+			DBG("ks2 pool exhausted\r\n");
+			return -1;
+		}
+		osc->delay = &pool.buf[base * KS2_CHUNK_SIZE];
+		osc->size = chunks * KS2_CHUNK_SIZE;
+	}
+	ks2_set_delay(osc);
+	// Initialise the delay line with random samples between -1 and 1.
+	// The values should sum to zero so that the DC component decays.
+	entropy_fill(&osc->rand, osc->delay, osc->size);
+	float sum = 0.f;
+	for (unsigned int i = 0; i < osc->len - 1; i++) {
+		float val = osc->delay[i];
+		float x = sum + val;
+		if (x > 1.f || x < -1.f) {
+			val = -val;
+		}
+		sum += val;
+		osc->delay[i] = val;
+	}
+	osc->delay[osc->len - 1] = -sum;
+	osc->pos = 0;
+	osc->x1 = 0.f;
+	osc->ap_x1 = 0.f;
+	osc->ap_y1 = 0.f;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void ks2_ctrl_attenuate(struct ks2 *osc, float attenuate) {
+	osc->k = 0.5f * attenuate;
+}
+
+void ks2_ctrl_frequency(struct ks2 *osc, float freq) {
+	osc->freq = clampf_lo(freq, KS2_FREQ_LO);
+	if (osc->delay) {
+		ks2_set_delay(osc);
+	}
+}
+
+void ks2_init(struct ks2 *osc) {
+	osc->delay = NULL;
+	osc->size = 0;
+	xrand_init(&osc->rand, rand_uint32());
 }
 
 //-----------------------------------------------------------------------------
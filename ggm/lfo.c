@@ -0,0 +1,93 @@
+//-----------------------------------------------------------------------------
+/*
+
+Low Frequency Oscillators
+
+Vibrato, tremolo and PWM are normally the same for every voice on a patch, so
+the LFOs are per patch rather than per voice. Each patch has a bank of
+PATCH_LFOS oscillators and the phases are stepped once per rendered span of
+samples (normally an audio block, but a block is split where MIDI messages are
+due).
+
+Voices read the value at the start of the span (for controls that are set
+once per span, E.g. oscillator shape or frequency) or a linear ramp across
+the span (for controls that take a per sample buffer, E.g. filter cutoff).
+A voice can add a phase offset so voices on the same patch aren't in lock
+step.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include "ggm.h"
+#include "utils.h"
+
+//-----------------------------------------------------------------------------
+
+#define LFO_RATE_MAX (50.f)	// maximum rate (Hz)
+
+// lfo frequency to phase step per sample
+#define LFO_PHASE_SCALE ((float)(1ULL << 32) / AUDIO_FS)
+
+// phase to 0..1
+#define LFO_FRAC_SCALE (1.f / (float)(1ULL << 32))
+
+//-----------------------------------------------------------------------------
+
+// return the lfo output (-1..1) for a phase
+static float lfo_eval(int shape, uint32_t x) {
+	float p = (float)x * LFO_FRAC_SCALE;
+	switch (shape) {
+	case LFO_TRIANGLE:
+		return (4.f * ((p < 0.5f) ? (0.5f - p) : (p - 0.5f))) - 1.f;
+	case LFO_SAW:
+		return (2.f * p) - 1.f;
+	case LFO_SQUARE:
+		return (p < 0.5f) ? 1.f : -1.f;
+	default:
+		break;
+	}
+	return cos_lookup(x);
+}
+
+//-----------------------------------------------------------------------------
+
+// return the lfo output at the start of the current span
+float lfo_value(const struct lfo *l, uint32_t ofs) {
+	return lfo_eval(l->shape, l->x + ofs);
+}
+
+// add k * a linear ramp of the lfo output across the current span of n samples
+void lfo_add_ramp(const struct lfo *l, uint32_t ofs, float k, float *out, size_t n) {
+	float y0 = k * lfo_eval(l->shape, l->x + ofs);
+	float y1 = k * lfo_eval(l->shape, l->x + (l->xstep * n) + ofs);
+	float dy = (y1 - y0) / (float)n;
+	for (size_t i = 0; i < n; i++) {
+		out[i] += y0;
+		y0 += dy;
+	}
+}
+
+// step the lfo over a span of n samples
+void lfo_step(struct lfo *l, size_t n) {
+	l->x += l->xstep * n;
+}
+
+//-----------------------------------------------------------------------------
+
+// set the lfo rate (Hz)
+void lfo_ctrl_rate(struct lfo *l, float rate) {
+	l->xstep = (uint32_t) (clampf(rate, 0.f, LFO_RATE_MAX) * LFO_PHASE_SCALE);
+}
+
+// set the lfo wave shape
+void lfo_ctrl_shape(struct lfo *l, int shape) {
+	l->shape = (shape >= 0 && shape < LFO_SHAPES) ? shape : LFO_SINE;
+}
+
+void lfo_init(struct lfo *l) {
+	l->x = 0;
+	lfo_ctrl_shape(l, LFO_SINE);
+	lfo_ctrl_rate(l, 5.f);
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,124 @@
+//-----------------------------------------------------------------------------
+/*
+
+Master Bus Look-Ahead Limiter
+
+Keeps the summed output below full scale without hard clipping.
+
+The signal is delayed by LIMITER_DELAY samples. The peak level of each
+LIMITER_CHUNK sample chunk of the (undelayed) input gives the gain that chunk
+needs. The gain is worked out at the chunk boundaries and linearly
+interpolated across the chunks, so the per-sample cost is a multiply-add.
+
+The look-ahead lets the gain ramp down over several chunks before a peak
+arrives, rather than jumping down at the peak. At each boundary the gain is
+the lowest of:
+
+1) The release curve back towards unity gain.
+2) A straight line from the previous boundary gain to the gain needed at each
+of the next LIMITER_AHEAD boundaries.
+
+Since the gain is linear across a chunk and is never above the needed gain at
+either end, no sample in the chunk goes over the ceiling.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "ggm.h"
+#include "utils.h"
+
+//-----------------------------------------------------------------------------
+
+#define LIMITER_CEILING (0.98f)	// maximum output level
+#define LIMITER_RELEASE (0.05f)	// release time constant (secs)
+
+_Static_assert(AUDIO_BLOCK_SIZE % LIMITER_CHUNK == 0, "AUDIO_BLOCK_SIZE must be a multiple of LIMITER_CHUNK");
+
+//-----------------------------------------------------------------------------
+
+// return the gain a chunk needs
+static inline float chunk_gain(const float *l, const float *r) {
+	float peak = block_peak(l, LIMITER_CHUNK);
+	float peak_r = block_peak(r, LIMITER_CHUNK);
+	peak = (peak_r > peak) ? peak_r : peak;
+	return (peak > LIMITER_CEILING) ? LIMITER_CEILING / peak : 1.f;
+}
+
+//-----------------------------------------------------------------------------
+
+// limit the stereo output in place, n is a multiple of LIMITER_CHUNK
+void limiter_gen(struct limiter *lim, float *out_l, float *out_r, size_t n) {
+	size_t nc = n / LIMITER_CHUNK;
+	float buf_l[LIMITER_DELAY + n], buf_r[LIMITER_DELAY + n];
+	// per chunk gain: the last output chunk, the delayed chunks, the new chunks
+	float req[LIMITER_AHEAD + 1 + nc];
+	// boundary gains
+	float g[nc + 1];
+
+	// delayed samples followed by the new samples
+	memcpy(buf_l, lim->delay_l, LIMITER_DELAY * sizeof(float));
+	memcpy(buf_r, lim->delay_r, LIMITER_DELAY * sizeof(float));
+	memcpy(&buf_l[LIMITER_DELAY], out_l, n * sizeof(float));
+	memcpy(&buf_r[LIMITER_DELAY], out_r, n * sizeof(float));
+
+	// gains for the new chunks
+	memcpy(req, lim->req, (LIMITER_AHEAD + 1) * sizeof(float));
+	for (size_t i = 0; i < nc; i++) {
+		size_t k = LIMITER_DELAY + (i * LIMITER_CHUNK);
+		req[LIMITER_AHEAD + 1 + i] = chunk_gain(&buf_l[k], &buf_r[k]);
+	}
+
+	// boundary gains
+	g[0] = lim->g;
+	for (size_t b = 1; b <= nc; b++) {
+		float g0 = g[b - 1];
+		// release
+		float gb = g0 + (lim->kr * (1.f - g0));
+		// attack: ramp to the gain needed at each boundary in the look-ahead
+		for (size_t k = 0; k < LIMITER_AHEAD; k++) {
+			// a boundary needs the gain of the chunks either side
+			float a = req[b + k];
+			float q = req[b + k + 1];
+			q = (a < q) ? a : q;
+			float x = g0 + ((q - g0) / (float)(k + 1));
+			gb = (x < gb) ? x : gb;
+		}
+		g[b] = gb;
+	}
+
+	// apply the gain
+	for (size_t i = 0; i < nc; i++) {
+		float gi = g[i];
+		float dg = (g[i + 1] - gi) * (1.f / (float)LIMITER_CHUNK);
+		const float *l = &buf_l[i * LIMITER_CHUNK];
+		const float *r = &buf_r[i * LIMITER_CHUNK];
+		float *yl = &out_l[i * LIMITER_CHUNK];
+		float *yr = &out_r[i * LIMITER_CHUNK];
+		for (size_t j = 0; j < LIMITER_CHUNK; j++) {
+			yl[j] = gi * l[j];
+			yr[j] = gi * r[j];
+			gi += dg;
+		}
+	}
+
+	// save the state
+	lim->g = g[nc];
+	memcpy(lim->req, &req[nc], (LIMITER_AHEAD + 1) * sizeof(float));
+	memcpy(lim->delay_l, &buf_l[n], LIMITER_DELAY * sizeof(float));
+	memcpy(lim->delay_r, &buf_r[n], LIMITER_DELAY * sizeof(float));
+}
+
+//-----------------------------------------------------------------------------
+
+void limiter_init(struct limiter *lim) {
+	memset(lim, 0, sizeof(struct limiter));
+	lim->g = 1.f;
+	for (int i = 0; i <= LIMITER_AHEAD; i++) {
+		lim->req[i] = 1.f;
+	}
+	lim->kr = 1.f - powe(-(float)LIMITER_CHUNK / (LIMITER_RELEASE * AUDIO_FS));
+}
+
+//-----------------------------------------------------------------------------
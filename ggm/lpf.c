@@ -6,11 +6,52 @@ Low Pass Filters
 */
 //-----------------------------------------------------------------------------
 
+#include <string.h>
+
 #include "ggm.h"
+#include "utils.h"
 
 #define DEBUG
 #include "logging.h"
 
+//-----------------------------------------------------------------------------
+// Cutoff Modulation
+// The *_gen_mod() functions take a per-sample cutoff frequency buffer.
+// Evaluating the filter coefficients every sample is too expensive, so we
+// evaluate them every SVF_MOD_STEP samples and linearly interpolate.
+// If n is not a multiple of SVF_MOD_STEP the last step is shorter.
+
+#define SVF_MOD_STEP 8U		// samples per coefficient evaluation
+#define SVF_MOD_SCALE (1.f / (float)SVF_MOD_STEP)
+
+// return the length of the modulation step at i, and its interpolation scale
+static inline size_t svf_mod_step(size_t i, size_t n, float *scale) {
+	size_t m = n - i;
+	if (m >= SVF_MOD_STEP) {
+		*scale = SVF_MOD_SCALE;
+		return SVF_MOD_STEP;
+	}
+	// short tail
+	*scale = 1.f / (float)m;
+	return m;
+}
+
+// cutoff frequency to half phase (pi * cutoff / fs) scaling
+#define SVF_PHASE_SCALE ((float)(1ULL << 31) / AUDIO_FS)
+
+// return sin(pi * cutoff / fs)
+static inline float svf_sin(float cutoff) {
+	uint32_t x = (uint32_t)(clampf(cutoff, 0.f, 0.5f * AUDIO_FS) * SVF_PHASE_SCALE);
+	return cos_lookup((1U << 30) - x);
+}
+
+// return tan(pi * cutoff / fs)
+static inline float svf_tan(float cutoff) {
+	// keep away from fs/2 where tan() goes to infinity
+	uint32_t x = (uint32_t)(clampf(cutoff, 0.f, 0.49f * AUDIO_FS) * SVF_PHASE_SCALE);
+	return cos_lookup((1U << 30) - x) / cos_lookup(x);
+}
+
 //-----------------------------------------------------------------------------
 // State Variable Filter
 // See: Hal Chamberlin's "Musical Applications of Microprocessors" pp.489-492.
@@ -33,6 +74,36 @@ void svf_gen(struct svf *f, float *out, const float *in, size_t n) {
 	f->bp = bp;
 }
 
+// generate with a per-sample cutoff frequency
+void svf_gen_mod(struct svf *f, float *out, const float *in, const float *cutoff, size_t n) {
+	float lp = f->lp;
+	float bp = f->bp;
+	float kf = f->kf;
+	float kq = f->kq;
+
+	for (size_t i = 0; i < n;) {
+		float scale;
+		size_t m = svf_mod_step(i, n, &scale);
+		// interpolate to the coefficient at the end of this step
+		float kf1 = 2.f * svf_sin(cutoff[i + m - 1]);
+		float dkf = (kf1 - kf) * scale;
+		for (size_t j = i; j < i + m; j++) {
+			kf += dkf;
+			lp += kf * bp;
+			float hp = in[j] - lp - (kq * bp);
+			bp += kf * hp;
+			out[j] = lp;
+		}
+		kf = kf1;
+		i += m;
+	}
+
+	// update the state variables
+	f->lp = lp;
+	f->bp = bp;
+	f->kf = kf;
+}
+
 // set the cutoff frequency
 void svf_ctrl_cutoff(struct svf *f, float cutoff) {
 	cutoff = clampf(cutoff, 0.f, 0.5f * AUDIO_FS);
@@ -56,9 +127,9 @@ void svf_init(struct svf *f) {
 void svf2_gen(struct svf2 *f, float *out, const float *in, size_t n) {
 	float ic1eq = f->ic1eq;
 	float ic2eq = f->ic2eq;
-	float a1 = 1.f / (1.f + (f->g * (f->g + f->k)));
-	float a2 = f->g * a1;
-	float a3 = f->g * a2;
+	float a1 = f->a1;
+	float a2 = f->a2;
+	float a3 = f->a3;
 
 	for (size_t i = 0; i < n; i++) {
 		float v0, v1, v2, v3;
@@ -82,20 +153,275 @@ void svf2_gen(struct svf2 *f, float *out, const float *in, size_t n) {
 	f->ic2eq = ic2eq;
 }
 
+// generate with a per-sample cutoff frequency
+void svf2_gen_mod(struct svf2 *f, float *out, const float *in, const float *cutoff, size_t n) {
+	float ic1eq = f->ic1eq;
+	float ic2eq = f->ic2eq;
+	float g = f->g;
+	float k = f->k;
+	float a1 = f->a1;
+	float a2 = f->a2;
+	float a3 = f->a3;
+
+	for (size_t i = 0; i < n;) {
+		float scale;
+		size_t m = svf_mod_step(i, n, &scale);
+		// interpolate to the coefficients at the end of this step
+		g = svf_tan(cutoff[i + m - 1]);
+		float b1 = 1.f / (1.f + (g * (g + k)));
+		float b2 = g * b1;
+		float b3 = g * b2;
+		float da1 = (b1 - a1) * scale;
+		float da2 = (b2 - a2) * scale;
+		float da3 = (b3 - a3) * scale;
+		for (size_t j = i; j < i + m; j++) {
+			float v0, v1, v2, v3;
+			a1 += da1;
+			a2 += da2;
+			a3 += da3;
+			v0 = in[j];
+			v3 = v0 - ic2eq;
+			v1 = (a1 * ic1eq) + (a2 * v3);
+			v2 = ic2eq + (a2 * ic1eq) + (a3 * v3);
+			ic1eq = (2.f * v1) - ic1eq;
+			ic2eq = (2.f * v2) - ic2eq;
+			out[j] = v2;	// low
+		}
+		a1 = b1;
+		a2 = b2;
+		a3 = b3;
+		i += m;
+	}
+
+	// update the state variables
+	f->ic1eq = ic1eq;
+	f->ic2eq = ic2eq;
+	// keep the last cutoff so a resonance change doesn't revert it
+	f->cutoff = (n > 0) ? cutoff[n - 1] : f->cutoff;
+	f->g = g;
+	f->a1 = a1;
+	f->a2 = a2;
+	f->a3 = a3;
+}
+
+//-----------------------------------------------------------------------------
+// SVF Coefficient Cache
+// Computing the svf2 coefficients needs a tan() and a divide. Voices often
+// share the same filter settings (E.g. a knob sweep across all the voices), so
+// we cache the coefficients for quantised (cutoff, resonance) values.
+// The cutoff is quantised logarithmically by dropping the low mantissa bits of
+// its float representation. The coefficients are always computed from the
+// quantised values so the result doesn't depend on the cache state.
+
+#define SVF_CACHE_BITS 6U
+#define SVF_CACHE_SIZE (1U << SVF_CACHE_BITS)
+#define SVF_CUTOFF_SHIFT 15U	// keep 8 mantissa bits (~7 cents resolution)
+#define SVF_RESONANCE_BITS 7U	// midi resolution
+#define SVF_KEY_INVALID 0U	// the key for a 0 Hz cutoff isn't used
+
+static struct svf_coeff svf_cache[SVF_CACHE_SIZE];
+
+static uint32_t svf_key(float cutoff, float resonance) {
+	union {
+		float f;
+		uint32_t u;
+	} x;
+	// a positive normalised float, so the key is never SVF_KEY_INVALID
+	x.f = clampf(cutoff, 1.f, 0.49f * AUDIO_FS);
+	uint32_t r = (uint32_t)(clampf(resonance, 0.f, 1.f) * (float)((1U << SVF_RESONANCE_BITS) - 1) + 0.5f);
+	return ((x.u >> SVF_CUTOFF_SHIFT) << SVF_RESONANCE_BITS) | r;
+}
+
+// return the coefficients for a cutoff frequency and resonance (0..1)
+const struct svf_coeff *svf_coeff_lookup(float cutoff, float resonance) {
+	uint32_t key = svf_key(cutoff, resonance);
+	struct svf_coeff *c = &svf_cache[(key * 2654435761U) >> (32U - SVF_CACHE_BITS)];
+	if (c->key != key) {
+		// cache miss: compute from the quantised values
+		union {
+			float f;
+			uint32_t u;
+		} x;
+		x.u = (key >> SVF_RESONANCE_BITS) << SVF_CUTOFF_SHIFT;
+		resonance = (float)(key & ((1U << SVF_RESONANCE_BITS) - 1)) * (1.f / (float)((1U << SVF_RESONANCE_BITS) - 1));
+		c->g = tan_eval(PI * x.f / AUDIO_FS);
+		c->k = 2.f - 2.f * resonance;
+		c->a1 = 1.f / (1.f + (c->g * (c->g + c->k)));
+		c->a2 = c->g * c->a1;
+		c->a3 = c->g * c->a2;
+		c->key = key;
+	}
+	return c;
+}
+
+//-----------------------------------------------------------------------------
+
+static void svf2_update(struct svf2 *f) {
+	const struct svf_coeff *c = svf_coeff_lookup(f->cutoff, f->resonance);
+	f->g = c->g;
+	f->k = c->k;
+	f->a1 = c->a1;
+	f->a2 = c->a2;
+	f->a3 = c->a3;
+}
+
+// set the cutoff frequency and resonance (0..1)
+void svf2_ctrl(struct svf2 *f, float cutoff, float resonance) {
+	f->cutoff = cutoff;
+	f->resonance = resonance;
+	svf2_update(f);
+}
+
 // set the cutoff frequency
 void svf2_ctrl_cutoff(struct svf2 *f, float cutoff) {
-	cutoff = clampf(cutoff, 0.f, 0.5f * AUDIO_FS);
-	f->g = tan_eval(PI * cutoff / AUDIO_FS);
+	f->cutoff = cutoff;
+	svf2_update(f);
 }
 
 // set the resonance (0..1)
 void svf2_ctrl_resonance(struct svf2 *f, float resonance) {
-	resonance = clampf(resonance, 0.f, 1.f);
-	f->k = 2.f - 2.f * resonance;
+	f->resonance = resonance;
+	svf2_update(f);
 }
 
 void svf2_init(struct svf2 *f) {
-	// do nothing
+	svf2_ctrl(f, 0.25f * AUDIO_FS, 0.f);
+}
+
+//-----------------------------------------------------------------------------
+/*
+
+Zero Delay Feedback Ladder Filter
+
+A 4-pole ladder low pass filter using the topology preserving transform.
+See: Vadim Zavalishin's "The Art of VA Filter Design", chapter 5.
+
+The feedback loop is solved instantaneously for the linear filter, and the
+solved input to the ladder is saturated with a rational tanh approximation.
+The coefficients are computed once per block. The filter can optionally run
+at 2x the sample rate (with halfband up/down sampling) to reduce the aliasing
+from the nonlinearity.
+
+*/
+//-----------------------------------------------------------------------------
+
+// maximum feedback gain, the linear filter self oscillates at 4
+#define LADDER_K_MAX 4.2f
+
+// rational approximation of tanh(x), exact at x = +/-3
+static inline float tanh_approx(float x) {
+	x = clampf(x, -3.f, 3.f);
+	float x2 = x * x;
+	return x * (27.f + x2) / (27.f + (9.f * x2));
+}
+
+// per block coefficients
+struct ladder_k {
+	float G;		// one pole gain g/(1+g)
+	float c0, c1, c2, c3;	// stage state contributions to the output
+	float k;		// feedback gain
+	float ku;		// 1/(1 + k*G^4)
+	float drive;		// input gain
+};
+
+static void ladder_coeffs(struct ladder *f, struct ladder_k *c) {
+	float cutoff = (f->oversample) ? 0.5f * f->cutoff : f->cutoff;
+	float g = svf_tan(cutoff);
+	float b = 1.f / (1.f + g);
+	float G = g * b;
+	c->G = G;
+	c->c3 = b;
+	c->c2 = G * b;
+	c->c1 = G * c->c2;
+	c->c0 = G * c->c1;
+	c->k = f->k;
+	c->ku = 1.f / (1.f + (f->k * G * G * G * G));
+	c->drive = f->drive;
+}
+
+// one sample through the ladder
+static inline float ladder_tick(const struct ladder_k *c, float *s, float x) {
+	float S = (c->c0 * s[0]) + (c->c1 * s[1]) + (c->c2 * s[2]) + (c->c3 * s[3]);
+	float u = tanh_approx(((c->drive * x) - (c->k * S)) * c->ku);
+	for (int i = 0; i < 4; i++) {
+		float v = (u - s[i]) * c->G;
+		u = v + s[i];
+		s[i] = u + v;
+	}
+	return u;
+}
+
+// Halfband filter for 2x up/down sampling: (-1, 0, 9, 16, 9, 0, -1)/32
+// This is cheap and has a modest stopband, but the ladder is a low pass
+// filter so it takes care of much of the image/alias content.
+
+void ladder_gen(struct ladder *f, float *out, const float *in, size_t n) {
+	struct ladder_k c;
+	float s[4];
+
+	ladder_coeffs(f, &c);
+	for (int i = 0; i < 4; i++) {
+		s[i] = f->s[i];
+	}
+
+	if (f->oversample) {
+		float x1 = f->up[0], x2 = f->up[1], x3 = f->up[2];
+		float *d = f->dn;
+		for (size_t i = 0; i < n; i++) {
+			float x0 = in[i];
+			// upsample: interpolate between x2 and x1, then x1
+			float y0 = ladder_tick(&c, s, ((9.f / 16.f) * (x1 + x2)) - ((1.f / 16.f) * (x0 + x3)));
+			float y1 = ladder_tick(&c, s, x1);
+			x3 = x2;
+			x2 = x1;
+			x1 = x0;
+			// downsample: d[] holds the previous 5 output samples (oldest first)
+			out[i] = (0.5f * d[3]) + ((9.f / 32.f) * (d[2] + d[4])) - ((1.f / 32.f) * (d[0] + y1));
+			d[0] = d[2];
+			d[1] = d[3];
+			d[2] = d[4];
+			d[3] = y0;
+			d[4] = y1;
+		}
+		f->up[0] = x1;
+		f->up[1] = x2;
+		f->up[2] = x3;
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = ladder_tick(&c, s, in[i]);
+		}
+	}
+
+	// update the state variables
+	for (int i = 0; i < 4; i++) {
+		f->s[i] = s[i];
+	}
+}
+
+// set the cutoff frequency
+void ladder_ctrl_cutoff(struct ladder *f, float cutoff) {
+	f->cutoff = clampf(cutoff, 0.f, 0.49f * AUDIO_FS);
+}
+
+// set the resonance (0..1), self oscillation towards 1
+void ladder_ctrl_resonance(struct ladder *f, float resonance) {
+	f->k = LADDER_K_MAX * clampf(resonance, 0.f, 1.f);
+}
+
+// set the input drive (>= 0)
+void ladder_ctrl_drive(struct ladder *f, float drive) {
+	f->drive = clampf_lo(drive, 0.f);
+}
+
+// enable/disable 2x oversampling
+void ladder_ctrl_oversample(struct ladder *f, int oversample) {
+	f->oversample = oversample;
+}
+
+void ladder_init(struct ladder *f) {
+	memset(f, 0, sizeof(struct ladder));
+	f->cutoff = 0.25f * AUDIO_FS;
+	f->drive = 1.f;
 }
 
 //-----------------------------------------------------------------------------
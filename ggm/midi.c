@@ -3,6 +3,18 @@
 
 MIDI Functions
 
+Received messages are timestamped with the audio sample clock and queued.
+The audio handler dispatches them at their time (plus a fixed latency) within
+the block being rendered, so the timing of the rendered notes matches the
+timing of the received notes rather than the render loop cadence.
+
+Per note expression (polyphonic aftertouch, MPE pitch bend, pressure and
+timbre) is staged in the voices and applied once per block, so a controller
+streaming dense per note data doesn't update the patch for every message.
+Channel pressure and CC74 are only taken as note expression on the channels
+of a configured MPE zone. On other channels CC74 goes to the patch as a
+control change and channel pressure is ignored.
+
 */
 //-----------------------------------------------------------------------------
 
@@ -64,99 +76,340 @@ float midi_to_frequency(float note) {
 #define MIDI_STATUS_COMMON 0xf0
 #define MIDI_STATUS_REALTIME 0xf8
 
+// controllers
+#define MIDI_CC_BANK_MSB 0	// bank select msb
+#define MIDI_CC_BANK_LSB 32	// bank select lsb
+#define MIDI_CC_REVERB_SEND 91	// effects 1 depth
+#define MIDI_CC_CHORUS_SEND 93	// effects 3 depth
+#define MIDI_CC_SWITCH_MIN 64	// sustain pedal
+#define MIDI_CC_SWITCH_MAX 69	// hold 2 pedal
+#define MIDI_CC_DATA_ENTRY 6	// data entry msb
+#define MIDI_CC_TIMBRE 74	// sound controller 5 (MPE timbre)
+#define MIDI_CC_RPN_LSB 100	// registered parameter number lsb
+#define MIDI_CC_RPN_MSB 101	// registered parameter number msb
+#define MIDI_CC_MONO_ON 126	// mono mode on
+#define MIDI_CC_POLY_ON 127	// poly mode on
+
+// registered parameter numbers
+#define MIDI_RPN_PITCH_BEND_RANGE 0x0000
+#define MIDI_RPN_MPE_CONFIG 0x0006
+#define MIDI_RPN_NULL 0x3fff
+
+#define MPE_MASTER_LOWER 0	// lower zone master channel
+#define MPE_MASTER_UPPER 15	// upper zone master channel
+#define MPE_BEND_RANGE (48.f)	// default member channel pitch bend range (semitones)
+
+//-----------------------------------------------------------------------------
+// MPE zones and per note expression
+
+// return the zone of an MPE member channel, -1 if it isn't a member channel
+static int mpe_member_zone(struct ggm *s, uint8_t chan) {
+	if (chan > MPE_MASTER_LOWER && chan <= MPE_MASTER_LOWER + s->mpe.members[MPE_LOWER]) {
+		return MPE_LOWER;
+	}
+	if (chan < MPE_MASTER_UPPER && chan >= MPE_MASTER_UPPER - s->mpe.members[MPE_UPPER]) {
+		return MPE_UPPER;
+	}
+	return -1;
+}
+
+// return non-zero if the channel is an MPE zone master channel
+static int mpe_is_master(struct ggm *s, uint8_t chan) {
+	return (chan == MPE_MASTER_LOWER && s->mpe.members[MPE_LOWER]) || (chan == MPE_MASTER_UPPER && s->mpe.members[MPE_UPPER]);
+}
+
+// return non-zero if the channel is in an MPE zone (master or member)
+static int mpe_in_zone(struct ggm *s, uint8_t chan) {
+	return mpe_member_zone(s, chan) >= 0 || mpe_is_master(s, chan);
+}
+
+// map the member channels onto the zone master patches
+static void mpe_update(struct ggm *s) {
+	for (uint8_t chan = 0; chan < NUM_CHANNELS; chan++) {
+		int zone = mpe_member_zone(s, chan);
+		if (zone == MPE_LOWER) {
+			s->patch_map[chan] = MPE_MASTER_LOWER;
+		} else if (zone == MPE_UPPER) {
+			s->patch_map[chan] = MPE_MASTER_UPPER;
+		} else {
+			s->patch_map[chan] = chan;
+		}
+	}
+}
+
+// MPE configuration message: set the number of member channels for a zone
+static void mpe_config(struct ggm *s, uint8_t chan, uint8_t n) {
+	int zone = (chan == MPE_MASTER_LOWER) ? MPE_LOWER : MPE_UPPER;
+	int other = (zone == MPE_LOWER) ? MPE_UPPER : MPE_LOWER;
+	n = (n > NUM_CHANNELS - 1) ? NUM_CHANNELS - 1 : n;
+	s->mpe.members[zone] = n;
+	s->mpe.bend_range[zone] = MPE_BEND_RANGE;
+	// the zones can't overlap, the new zone shrinks the other zone
+	if (s->mpe.members[other] > NUM_CHANNELS - 2 - n) {
+		s->mpe.members[other] = (n >= NUM_CHANNELS - 2) ? 0 : NUM_CHANNELS - 2 - n;
+	}
+	mpe_update(s);
+	DBG("mpe lower %d upper %d\r\n", s->mpe.members[MPE_LOWER], s->mpe.members[MPE_UPPER]);
+}
+
+// data entry for the selected registered parameter
+static void midi_rpn(struct ggm *s, uint8_t chan, uint8_t val) {
+	switch (s->mpe.rpn[chan]) {
+	case MIDI_RPN_MPE_CONFIG:
+		if (chan == MPE_MASTER_LOWER || chan == MPE_MASTER_UPPER) {
+			mpe_config(s, chan, val);
+		}
+		break;
+	case MIDI_RPN_PITCH_BEND_RANGE:{
+			int zone = mpe_member_zone(s, chan);
+			if (zone >= 0) {
+				s->mpe.bend_range[zone] = (float)val;
+			}
+			break;
+		}
+	default:
+		DBG("unhandled rpn %04x ch %d val %d\r\n", s->mpe.rpn[chan], chan, val);
+		break;
+	}
+}
+
+// Stage a note expression value for the notes on a channel.
+// Values on a zone master channel apply to all the notes in the zone.
+// The patches see the changes in midi_expr_flush().
+static void expr_set(struct ggm *s, uint8_t chan, int expr, float val) {
+	struct patch *p = &s->patches[s->patch_map[chan]];
+	int zone = mpe_is_master(s, chan);
+	s->chan_expr[chan][expr] = val;
+	for (struct voice *v = p->voices; v != NULL; v = v->next) {
+		if (zone || v->channel == chan) {
+			v->expr[expr] = val;
+			s->expr_dirty |= 1U << v->idx;
+		}
+	}
+}
+
+// apply the staged note expression to the voices (called once per block)
+void midi_expr_flush(struct ggm *s) {
+	uint32_t dirty = s->expr_dirty;
+	s->expr_dirty = 0;
+	while (dirty) {
+		struct voice *v = &s->voices[__builtin_ctz(dirty)];
+		dirty &= dirty - 1;
+		if (v->patch == NULL) {
+			continue;
+		}
+		v->bend = pow2(v->expr[EXPR_BEND] * (1.f / 12.f));
+		if (v->patch->ops->expression) {
+			v->patch->ops->expression(v);
+		}
+	}
+}
+
+// setup the channel to patch map and the note expression state
+void midi_init(struct ggm *s) {
+	memset(&s->mpe, 0, sizeof(struct mpe));
+	for (int i = 0; i < NUM_CHANNELS; i++) {
+		s->mpe.rpn[i] = MIDI_RPN_NULL;
+		s->chan_expr[i][EXPR_PRESSURE] = 0.f;
+		s->chan_expr[i][EXPR_BEND] = 0.f;
+		s->chan_expr[i][EXPR_TIMBRE] = 0.5f;
+	}
+	s->expr_dirty = 0;
+	mpe_update(s);
+}
+
 //-----------------------------------------------------------------------------
 // channel events
 
 // process a midi note off event
-static void midi_note_off(struct midi_rx *midi) {
-	uint8_t chan = midi->status & 0xf;
-	uint8_t note = midi->arg0;
-	uint8_t vel = midi->arg1;
+static void midi_note_off(struct ggm *s, const struct midi_msg *m) {
+	uint8_t chan = m->status & 0xf;
+	uint8_t note = m->arg0;
+	uint8_t vel = m->arg1;
 	//DBG("note off ch %d note %d vel %d\r\n", chan, note, vel);
-	struct voice *v = voice_lookup(midi->ggm, chan, note);
+	struct voice *v = voice_lookup(s, chan, note);
 	if (v) {
-		v->patch->ops->note_off(v, vel);
+		voice_note_off(v, vel);
+	}
+}
+
+// apply the staged control changes for a channel to its patch
+static void midi_cc_flush_channel(struct ggm *s, unsigned int chan) {
+	struct cc_stage *cc = &s->cc;
+	struct patch *p = &s->patches[chan];
+	cc->channels &= ~(1U << chan);
+	for (unsigned int i = 0; i < NUM_CONTROLLERS / 32; i++) {
+		uint32_t dirty = cc->dirty[chan][i];
+		cc->dirty[chan][i] = 0;
+		while (dirty && p->ops) {
+			uint8_t ctrl = (i << 5) + __builtin_ctz(dirty);
+			dirty &= dirty - 1;
+			p->ops->control_change(p, ctrl, cc->val[chan][ctrl]);
+		}
 	}
 }
 
 // process a midi note on event
-static void midi_note_on(struct midi_rx *midi) {
-	uint8_t chan = midi->status & 0xf;
-	uint8_t note = midi->arg0;
-	uint8_t vel = midi->arg1;
+static void midi_note_on(struct ggm *s, const struct midi_msg *m) {
+	uint8_t chan = m->status & 0xf;
+	uint8_t note = m->arg0;
+	uint8_t vel = m->arg1;
 	if (vel == 0) {
 		// velocity 0 == note off
-		midi_note_off(midi);
+		midi_note_off(s, m);
 		return;
 	}
 	//DBG("note on ch %d note %d vel %d\r\n", chan, note, vel);
-	struct voice *v = voice_lookup(midi->ggm, chan, note);
+	// The note must see the control changes received before it.
+	// Apply the staged changes for the channel and the patch it plays.
+	uint32_t channels = s->cc.channels & ((1U << chan) | (1U << s->patch_map[chan]));
+	while (channels) {
+		unsigned int i = __builtin_ctz(channels);
+		channels &= channels - 1;
+		midi_cc_flush_channel(s, i);
+	}
+	struct voice *v = voice_lookup(s, chan, note);
 	if (!v) {
-		v = voice_alloc(midi->ggm, chan, note);
+		v = voice_alloc(s, chan, note);
 	}
 	if (v) {
-		v->patch->ops->note_on(v, vel);
+		voice_note_on(v, vel);
 	}
 }
 
 // process a midi control change
-static void midi_control_change(struct midi_rx *midi) {
-	uint8_t chan = midi->status & 0xf;
-	uint8_t ctrl = midi->arg0;
-	uint8_t val = midi->arg1;
+static void midi_control_change(struct ggm *s, const struct midi_msg *m) {
+	uint8_t chan = m->status & 0xf;
+	uint8_t ctrl = m->arg0;
+	uint8_t val = m->arg1;
+	if (ctrl == MIDI_CC_MONO_ON || ctrl == MIDI_CC_POLY_ON) {
+		// limit the channel to one voice in mono mode
+		s->patches[chan].voice_limit = (ctrl == MIDI_CC_MONO_ON) ? 1 : 0;
+		return;
+	}
+	if (ctrl == MIDI_CC_BANK_MSB || ctrl == MIDI_CC_BANK_LSB) {
+		// bank select is handled when it is received (see midi_rx_program)
+		return;
+	}
 	if (ctrl >= 120) {
 		// reserved controller number
 		DBG("reserved control change ctrl %d val %d\r\n", ctrl, val);
 		return;
 	}
+	// registered parameters (E.g. the MPE configuration message)
+	if (ctrl == MIDI_CC_RPN_MSB) {
+		s->mpe.rpn[chan] = (s->mpe.rpn[chan] & 0x7f) | (val << 7);
+		return;
+	}
+	if (ctrl == MIDI_CC_RPN_LSB) {
+		s->mpe.rpn[chan] = (s->mpe.rpn[chan] & ~0x7fU) | val;
+		return;
+	}
+	if (ctrl == MIDI_CC_DATA_ENTRY && s->mpe.rpn[chan] != MIDI_RPN_NULL) {
+		midi_rpn(s, chan, val);
+		return;
+	}
+	if (ctrl == MIDI_CC_TIMBRE && mpe_in_zone(s, chan)) {
+		// per note timbre
+		expr_set(s, chan, EXPR_TIMBRE, midi_map(val, 0.f, 1.f));
+		return;
+	}
 	//DBG("control change ch %d ctrl %d val %d\r\n", chan, ctrl, val);
-	struct patch *p = &midi->ggm->patches[chan];
-	if (p->ops) {
-		p->ops->control_change(p, ctrl, val);
+	if (ctrl == MIDI_CC_REVERB_SEND) {
+		// effects bus send level for the channel
+		s->send[chan] = midi_map(val, 0.f, 1.f);
+		return;
+	}
+	if (ctrl == MIDI_CC_CHORUS_SEND) {
+		// delay/chorus send level for the channel
+		s->echo_send[chan] = midi_map(val, 0.f, 1.f);
+		return;
+	}
+	if (ctrl >= MIDI_CC_SWITCH_MIN && ctrl <= MIDI_CC_SWITCH_MAX) {
+		// pedals/switches take effect right away so no presses are lost
+		struct patch *p = &s->patches[chan];
+		if (p->ops) {
+			p->ops->control_change(p, ctrl, val);
+		}
+		return;
+	}
+	// stage the change, the latest value is applied by midi_cc_flush()
+	// (or before a note on for the channel)
+	struct cc_stage *cc = &s->cc;
+	cc->val[chan][ctrl] = val;
+	cc->dirty[chan][ctrl >> 5] |= 1U << (ctrl & 31);
+	cc->channels |= 1U << chan;
+}
+
+// apply the staged control changes to the patches (called once per block)
+void midi_cc_flush(struct ggm *s) {
+	uint32_t channels = s->cc.channels;
+	while (channels) {
+		unsigned int chan = __builtin_ctz(channels);
+		channels &= channels - 1;
+		midi_cc_flush_channel(s, chan);
 	}
 }
 
 // process a midi pitch wheel change
-static void midi_pitch_wheel(struct midi_rx *midi) {
-	uint8_t chan = midi->status & 0xf;
-	uint16_t val = (midi->arg1 << 7) | midi->arg0;
+static void midi_pitch_wheel(struct ggm *s, const struct midi_msg *m) {
+	uint8_t chan = m->status & 0xf;
+	uint16_t val = (m->arg1 << 7) | m->arg0;
 	//DBG("pitch wheel ch %d val %d\r\n", chan, val);
-	struct patch *p = &midi->ggm->patches[chan];
+	int zone = mpe_member_zone(s, chan);
+	if (zone >= 0) {
+		// per note pitch bend
+		expr_set(s, chan, EXPR_BEND, midi_pitch_bend(val) * 0.5f * s->mpe.bend_range[zone]);
+		return;
+	}
+	struct patch *p = &s->patches[chan];
 	if (p->ops) {
 		p->ops->pitch_wheel(p, val);
 	}
 }
 
 // process a midi polyphonic aftertouch event
-static void midi_polyphonic_aftertouch(struct midi_rx *midi) {
-	uint8_t ch = midi->status & 0xf;
-	DBG("polyphonic aftertouch ch %d key %d val %d\r\n", ch, midi->arg0, midi->arg1);
+static void midi_polyphonic_aftertouch(struct ggm *s, const struct midi_msg *m) {
+	uint8_t chan = m->status & 0xf;
+	struct voice *v = voice_lookup(s, chan, m->arg0);
+	if (v) {
+		v->expr[EXPR_PRESSURE] = midi_map(m->arg1, 0.f, 1.f);
+		s->expr_dirty |= 1U << v->idx;
+	}
 }
 
 // process a midi program change
-static void midi_program_change(struct midi_rx *midi) {
-	uint8_t ch = midi->status & 0xf;
-	DBG("program change ch %d val %d\r\n", ch, midi->arg0);
+// (the patch was prepared when the message was received)
+static void midi_program_change(struct ggm *s, const struct midi_msg *m) {
+	uint8_t chan = m->status & 0xf;
+	DBG("program change ch %d val %d\r\n", chan, m->arg0);
+	// arg1 is the prepared patch tag (see midi_rx_program)
+	program_swap(s, chan, m->arg1);
 }
 
 // process a midi channel aftertouch
-static void midi_channel_aftertouch(struct midi_rx *midi) {
-	uint8_t ch = midi->status & 0xf;
-	DBG("channel aftertouch ch %d val %d\r\n", ch, midi->arg0);
+// (per note pressure on an MPE member channel)
+static void midi_channel_aftertouch(struct ggm *s, const struct midi_msg *m) {
+	uint8_t chan = m->status & 0xf;
+	if (!mpe_in_zone(s, chan)) {
+		DBG("channel aftertouch ch %d val %d\r\n", chan, m->arg0);
+		return;
+	}
+	expr_set(s, chan, EXPR_PRESSURE, midi_map(m->arg0, 0.f, 1.f));
 }
 
 //-----------------------------------------------------------------------------
 // common events
 
-static void midi_quarter_frame(struct midi_rx *midi) {
+static void midi_quarter_frame(struct ggm *s, const struct midi_msg *m) {
 	DBG("quarter frame\r\n");
 }
 
-static void midi_song_pointer(struct midi_rx *midi) {
-	DBG("song pointer\r\n");
+static void midi_song_pointer(struct ggm *s, const struct midi_msg *m) {
+	seq_song_position(&s->seq0, (m->arg1 << 7) | m->arg0, m->time);
 }
 
-static void midi_song_select(struct midi_rx *midi) {
+static void midi_song_select(struct ggm *s, const struct midi_msg *m) {
 	DBG("song select\r\n");
 }
 
@@ -164,16 +417,27 @@ static void midi_song_select(struct midi_rx *midi) {
 // sysex events
 
 static void midi_sysex_start(struct midi_rx *midi) {
-	DBG("sysex start\r\n");
+	midi->sysex_len = 0;
 }
 
 // receive a sysex byte
 static void midi_rx_sysex(struct midi_rx *midi, uint8_t x) {
-	DBG("midi sysex %02x\r\n", x);
+	if (midi->sysex_len < MIDI_SYSEX_SIZE) {
+		midi->sysex[midi->sysex_len] = x;
+	}
+	// keep counting so we know it overflowed
+	midi->sysex_len += 1;
 }
 
 static void midi_sysex_end(struct midi_rx *midi) {
-	DBG("sysex end\r\n");
+	if (midi->sysex_len > MIDI_SYSEX_SIZE) {
+		DBG("sysex too long (%d bytes)\r\n", midi->sysex_len);
+		return;
+	}
+	if (tuning_sysex(midi->ggm, midi->sysex, midi->sysex_len) == 0) {
+		return;
+	}
+	DBG("unhandled sysex (%d bytes)\r\n", midi->sysex_len);
 }
 
 //-----------------------------------------------------------------------------
@@ -187,14 +451,138 @@ enum {
 	MIDI_RX_SYSEX,		// get system exclusive bytes
 };
 
+//-----------------------------------------------------------------------------
+// message queue
+
+// bytes/sec at the standard MIDI baud rate (1 start, 8 data, 1 stop bits)
+#define MIDI_BYTES_PER_SEC (31250.f / 10.f)
+#define MIDI_BYTE_SAMPLES (AUDIO_FS / MIDI_BYTES_PER_SEC)
+
+// return the estimated sample clock time a byte was received
+// after: the number of bytes received after it
+static uint32_t midi_rx_time(struct midi_rx *midi, size_t after) {
+	// The bytes are read some time after they arrive. Back date the byte
+	// by the time taken to receive the bytes that came after it, but it
+	// can't have arrived before the previous poll.
+	uint32_t t = midi->now - (uint32_t) ((float)after * MIDI_BYTE_SAMPLES);
+	if ((int32_t) (t - midi->poll) < 0) {
+		t = midi->poll;
+	}
+	return t;
+}
+
+// Program changes are prepared when they are received. They are dispatched
+// MIDI_LATENCY later, so the new patch is ready to be swapped in on time.
+// Bank select is tracked here as well so it applies to the program changes
+// that follow it.
+static void midi_rx_program(struct midi_rx *midi) {
+	uint8_t chan = midi->status & 0xf;
+	if (midi->func == midi_program_change) {
+		midi->arg1 = program_prepare(midi->ggm, chan, midi->arg0);
+	} else if (midi->func == midi_control_change && midi->arg0 == MIDI_CC_BANK_MSB) {
+		midi->ggm->prog.bank[chan] = midi->arg1;
+	}
+}
+
+// queue the received message
+// after: the number of bytes received after the last byte of the message
+static void midi_queue(struct midi_rx *midi, size_t after) {
+	midi_rx_program(midi);
+	size_t wr = (midi->q_wr + 1) & (MIDI_QUEUE_SIZE - 1);
+	if (wr == midi->q_rd) {
+		// queue full, dispatch the oldest message now
+		DBG("midi queue full\r\n");
+		struct midi_msg *m = &midi->queue[midi->q_rd];
+		m->func(midi->ggm, m);
+		midi->q_rd = (midi->q_rd + 1) & (MIDI_QUEUE_SIZE - 1);
+	}
+	struct midi_msg *m = &midi->queue[midi->q_wr];
+	m->func = midi->func;
+	m->time = midi_rx_time(midi, after);
+	m->status = midi->status;
+	m->arg0 = midi->arg0;
+	m->arg1 = midi->arg1;
+	midi->q_wr = wr;
+}
+
+// Dispatch the queued messages that are due at sample clock time t.
+// Return the number of samples to render before the next message is due (<= n).
+size_t midi_dispatch(struct midi_rx *midi, uint32_t t, size_t n) {
+	while (midi->q_rd != midi->q_wr) {
+		struct midi_msg *m = &midi->queue[midi->q_rd];
+		int32_t dt = (int32_t) (m->time + MIDI_LATENCY - t);
+		if (dt > 0) {
+			// round up to the render granularity
+			size_t k = ((size_t)dt + MIDI_TIME_STEP - 1) & ~(MIDI_TIME_STEP - 1);
+			return (k < n) ? k : n;
+		}
+		m->func(midi->ggm, m);
+		midi->q_rd = (midi->q_rd + 1) & (MIDI_QUEUE_SIZE - 1);
+	}
+	return n;
+}
+
+// a complete message has been received
+static void midi_rx_msg(struct midi_rx *midi, size_t after) {
+	if (midi->status == 0) {
+		// System common messages are handled now so they stay in order
+		// with the realtime transport messages. E.g. song position/continue.
+		struct midi_msg m = {
+			.time = midi_rx_time(midi, after),
+			.arg0 = midi->arg0,
+			.arg1 = midi->arg1,
+		};
+		midi->func(midi->ggm, &m);
+		return;
+	}
+	midi_queue(midi, after);
+}
+
+//-----------------------------------------------------------------------------
+
+// Handle a system realtime message. These can appear anywhere in the byte
+// stream (even between the bytes of other messages) so they bypass the
+// message state machine.
+static void midi_realtime(struct midi_rx *midi, uint8_t c, size_t after) {
+	struct seq *seq = &midi->ggm->seq0;
+	switch (c) {
+	case MIDI_STATUS_TIMING_CLOCK:
+		seq_clock(seq, midi_rx_time(midi, after));
+		break;
+	case MIDI_STATUS_START:
+		seq_start(seq, midi_rx_time(midi, after));
+		break;
+	case MIDI_STATUS_CONTINUE:
+		seq_continue(seq, midi_rx_time(midi, after));
+		break;
+	case MIDI_STATUS_STOP:
+		seq_stop(seq, midi_rx_time(midi, after));
+		break;
+	case MIDI_STATUS_ACTIVE_SENSING:
+		break;
+	case MIDI_STATUS_RESET:
+	default:
+		DBG("unhandled system realtime msg %02x\r\n", c);
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
 // Receive a buffer of midi bytes
-static void midi_rxbuf(struct midi_rx *midi, uint8_t * buf, size_t n) {
+// after: the number of bytes received after this buffer
+static void midi_rxbuf(struct midi_rx *midi, const uint8_t * buf, size_t n, size_t after) {
 	for (size_t i = 0; i < n; i++) {
 		uint8_t c = buf[i];
+		if (c >= MIDI_STATUS_REALTIME) {
+			// fast path for realtime messages
+			midi_realtime(midi, c, n - 1 - i + after);
+			continue;
+		}
 		if (c & 0x80) {
 			// status byte
-			// any non-realtime status byte will end the sysex mode
-			if (midi->state == MIDI_RX_SYSEX && c < MIDI_STATUS_REALTIME) {
+			// any status byte will end the sysex mode
+			if (midi->state == MIDI_RX_SYSEX) {
 				midi_sysex_end(midi);
 				midi->state = MIDI_RX_NULL;
 			}
@@ -234,7 +622,7 @@ static void midi_rxbuf(struct midi_rx *midi, uint8_t * buf, size_t n) {
 					DBG("unhandled channel msg %02x\r\n", c);
 					break;
 				}
-			} else if (c < MIDI_STATUS_REALTIME) {
+			} else {
 				// system common message
 				midi->status = 0;	// clear the running status
 				switch (c) {
@@ -264,19 +652,6 @@ static void midi_rxbuf(struct midi_rx *midi, uint8_t * buf, size_t n) {
 					DBG("unhandled system commmon msg %02x\r\n", c);
 					break;
 				}
-			} else {
-				// system real time message
-				switch (c) {
-				case MIDI_STATUS_TIMING_CLOCK:
-				case MIDI_STATUS_START:
-				case MIDI_STATUS_CONTINUE:
-				case MIDI_STATUS_STOP:
-				case MIDI_STATUS_ACTIVE_SENSING:
-				case MIDI_STATUS_RESET:
-				default:
-					DBG("unhandled system realtime msg %02x\r\n", c);
-					break;
-				}
 			}
 		} else {
 			// data byte
@@ -287,7 +662,7 @@ static void midi_rxbuf(struct midi_rx *midi, uint8_t * buf, size_t n) {
 				break;
 			case MIDI_RX_1OF1:
 				midi->arg0 = c;
-				midi->func(midi);
+				midi_rx_msg(midi, n - 1 - i + after);
 				midi->state = (midi->status) ? MIDI_RX_1OF1 : MIDI_RX_NULL;
 				break;
 			case MIDI_RX_1OF2:
@@ -296,7 +671,7 @@ static void midi_rxbuf(struct midi_rx *midi, uint8_t * buf, size_t n) {
 				break;
 			case MIDI_RX_2OF2:
 				midi->arg1 = c;
-				midi->func(midi);
+				midi_rx_msg(midi, n - 1 - i + after);
 				midi->state = (midi->status) ? MIDI_RX_1OF2 : MIDI_RX_NULL;
 				break;
 			case MIDI_RX_SYSEX:
@@ -315,18 +690,42 @@ static void midi_rxbuf(struct midi_rx *midi, uint8_t * buf, size_t n) {
 
 // Receive midi messages from a serial port.
 void midi_rx_serial(struct midi_rx *midi, struct usart_drv *serial) {
-	// Use a buffer size large enough to get all serial bytes in a single read.
-	// At the standard MIDI baud rate that's about 3 bytes/ms.
-	uint8_t buf[16];
-	size_t n;
-	do {
-		// read a buffer from the serial port
-		n = usart_rxbuf(serial, buf, sizeof(buf));
-		if (n != 0) {
-			// write the buffer to the midi receiver
-			midi_rxbuf(midi, buf, n);
+	size_t avail = usart_rxavail(serial);
+	midi->now = audio_time(midi->ggm->audio);
+	// parse the serial rx buffer in place
+	// the unread data may wrap around the end of the buffer
+	for (int i = 0; i < 2 && avail != 0; i++) {
+		const uint8_t *buf;
+		size_t n = usart_rxpeek(serial, &buf);
+		n = (n < avail) ? n : avail;
+		if (n == 0) {
+			break;
 		}
-	} while (n == sizeof(buf));
+		avail -= n;
+		midi_rxbuf(midi, buf, n, avail);
+		usart_rxskip(serial, n);
+	}
+	midi->poll = midi->now;
+}
+
+// number of midi bytes for each usb midi code index number
+static const uint8_t cin_len[16] = { 0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1 };
+
+// Receive usb midi packets.
+// t: sample clock time the packets arrived
+void midi_rx_usb(struct midi_rx *midi, uint32_t t, const uint32_t * pkt, size_t n) {
+	// The packets in a batch arrive within a usb frame, so they all get
+	// the batch time. No back dating, these aren't at the serial byte rate.
+	midi->now = t;
+	midi->poll = t;
+	for (size_t i = 0; i < n; i++) {
+		uint32_t p = pkt[i];
+		uint8_t buf[3] = { p >> 8, p >> 16, p >> 24 };
+		size_t len = cin_len[p & 15];
+		if (len) {
+			midi_rxbuf(midi, buf, len, 0);
+		}
+	}
 }
 
 //-----------------------------------------------------------------------------
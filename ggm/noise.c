@@ -7,6 +7,7 @@ Noise Generation
 //-----------------------------------------------------------------------------
 
 #include "ggm.h"
+#include "utils.h"
 
 //-----------------------------------------------------------------------------
 
@@ -35,22 +36,23 @@ static void record_max(struct noise *ns, float x) {
 // https://en.wikipedia.org/wiki/White_noise
 // https://en.wikipedia.org/wiki/Brownian_noise
 
-void noise_init(struct noise *n) {
-	// do nothing
+void noise_init(struct noise *ns) {
+	// each noise generator has its own PRNG stream
+	xrand_init(&ns->rand, rand_uint32());
 }
 
 // white noise (spectral density = k)
 void noise_gen_white(struct noise *ns, float *out, size_t n) {
-	for (size_t i = 0; i < n; i++) {
-		out[i] = rand_float();
-	}
+	entropy_fill(&ns->rand, out, n);
 }
 
 // brown noise (spectral density = k/f*f)
 void noise_gen_brown(struct noise *ns, float *out, size_t n) {
 	float b0 = ns->b0;
+	float buf[n];
+	entropy_fill(&ns->rand, buf, n);
 	for (size_t i = 0; i < n; i++) {
-		float white = rand_float();
+		float white = buf[i];
 		b0 = (b0 + (0.02f * white)) * (1.f / 1.02f);
 		out[i] = b0 * (1.f / 0.38f);
 	}
@@ -62,8 +64,10 @@ void noise_gen_pink1(struct noise *ns, float *out, size_t n) {
 	float b0 = ns->b0;
 	float b1 = ns->b1;
 	float b2 = ns->b2;
+	float buf[n];
+	entropy_fill(&ns->rand, buf, n);
 	for (size_t i = 0; i < n; i++) {
-		float white = rand_float();
+		float white = buf[i];
 		b0 = 0.99765f * b0 + white * 0.0990460f;
 		b1 = 0.96300f * b1 + white * 0.2965164f;
 		b2 = 0.57000f * b2 + white * 1.0526913f;
@@ -84,8 +88,10 @@ void noise_gen_pink2(struct noise *ns, float *out, size_t n) {
 	float b4 = ns->b4;
 	float b5 = ns->b5;
 	float b6 = ns->b6;
+	float buf[n];
+	entropy_fill(&ns->rand, buf, n);
 	for (size_t i = 0; i < n; i++) {
-		float white = rand_float();
+		float white = buf[i];
 		b0 = 0.99886f * b0 + white * 0.0555179f;
 		b1 = 0.99332f * b1 + white * 0.0750759f;
 		b2 = 0.96900f * b2 + white * 0.1538520f;
@@ -15,6 +15,12 @@ void pan_gen(struct pan *p, float *out_l, float *out_r, const float *in, size_t
 	block_copy_mul_k(out_r, in, p->vol_r, n);
 }
 
+// pan a stereo input (e.g. from a unison oscillator)
+void pan_gen_stereo(struct pan *p, float *out_l, float *out_r, const float *in_l, const float *in_r, size_t n) {
+	block_copy_mul_k(out_l, in_l, p->vol_l, n);
+	block_copy_mul_k(out_r, in_r, p->vol_r, n);
+}
+
 void pan_ctrl(struct pan *p, float vol, float pan) {
 	// convert to a linear volume
 	vol = pow2(vol) - 1.f;
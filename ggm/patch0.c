@@ -27,7 +27,6 @@ struct v_state {
 struct p_state {
 	float vol;		// volume
 	float pan;		// left/right pan
-	float bend;		// pitch bend
 };
 
 _Static_assert(sizeof(struct v_state) <= VOICE_STATE_SIZE, "sizeof(struct v_state) > VOICE_STATE_SIZE");
@@ -38,8 +37,7 @@ _Static_assert(sizeof(struct p_state) <= PATCH_STATE_SIZE, "sizeof(struct p_stat
 
 static void ctrl_frequency(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
-	struct p_state *ps = (struct p_state *)v->patch->state;
-	float freq = midi_to_frequency((float)v->note + ps->bend);
+	float freq = voice_frequency(v);
 	sin_ctrl_frequency(&vs->sin, freq);
 }
 
@@ -91,19 +89,27 @@ static int active(struct voice *v) {
 	return adsr_is_active(&vs->adsr);
 }
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	struct v_state *vs = (struct v_state *)v->state;
 	float am[n];
 	float out[n];
 	// generate the envelope
-	adsr_gen(&vs->adsr, am, n);
+	int am_tag = adsr_gen(&vs->adsr, am, n);
+	if (am_tag & BLOCK_ZERO) {
+		return 1;
+	}
 	// generate the sine wave
 	sin_gen(&vs->sin, out, NULL, n);
 	// apply the envelope
-	block_mul(out, am, n);
+	if (am_tag & BLOCK_CONSTANT) {
+		block_mul_k(out, am[0], n);
+	} else {
+		block_mul(out, am, n);
+	}
 	// pan to left/right channels
 	pan_gen(&vs->pan, out_l, out_r, out, n);
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -139,9 +145,8 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 }
 
 static void pitch_wheel(struct patch *p, uint16_t val) {
-	struct p_state *ps = (struct p_state *)p->state;
 	DBG("p0 pitch %d\r\n", val);
-	ps->bend = midi_pitch_bend(val);
+	tuning_ctrl_bend(&p->tuning, midi_pitch_bend(val));
 	update_voices(p, ctrl_frequency);
 }
 
@@ -157,6 +162,7 @@ const struct patch_ops patch0 = {
 	.init = init,
 	.control_change = control_change,
 	.pitch_wheel = pitch_wheel,
+	.expression = ctrl_frequency,
 };
 
 //-----------------------------------------------------------------------------
@@ -5,6 +5,12 @@ Patch One
 
 An ADSR envelope on a goom wave.
 
+LFO 0 modulates the goom wave duty cycle (PWM), LFO 1 modulates the pitch
+(vibrato).
+
+Per note expression: pressure adds vibrato, timbre offsets the duty cycle.
+Pressure is polyphonic aftertouch, or MPE channel pressure. Timbre is MPE CC74.
+
 */
 //-----------------------------------------------------------------------------
 
@@ -27,9 +33,11 @@ struct v_state {
 struct p_state {
 	float vol;		// volume
 	float pan;		// left/right pan
-	float bend;		// pitch bend
 	float duty;		// duty cycle for gwave (0..1)
 	float slope;		// slope for gwave (0..1)
+	float pwm;		// lfo 0 duty cycle modulation depth (0..0.5)
+	float vibrato;		// lfo 1 pitch modulation depth (semitones)
+	float spread;		// lfo phase spread across the voices (0..1)
 };
 
 _Static_assert(sizeof(struct v_state) <= VOICE_STATE_SIZE, "sizeof(struct v_state) > VOICE_STATE_SIZE");
@@ -41,13 +49,24 @@ _Static_assert(sizeof(struct p_state) <= PATCH_STATE_SIZE, "sizeof(struct p_stat
 static void ctrl_frequency(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
 	struct p_state *ps = (struct p_state *)v->patch->state;
-	gwave_ctrl_frequency(&vs->gwave, midi_to_frequency((float)v->note + ps->bend));
+	float freq = voice_frequency(v);
+	float depth = ps->vibrato + v->expr[EXPR_PRESSURE];
+	if (depth != 0.f) {
+		float vib = depth * lfo_value(&v->patch->lfo[1], lfo_voice_phase(v->idx, ps->spread));
+		freq *= pow2(vib * (1.f / 12.f));
+	}
+	gwave_ctrl_frequency(&vs->gwave, freq);
 }
 
 static void ctrl_shape(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
 	struct p_state *ps = (struct p_state *)v->patch->state;
-	gwave_ctrl_shape(&vs->gwave, ps->duty, ps->slope);
+	float duty = ps->duty + (v->expr[EXPR_TIMBRE] - 0.5f);
+	if (ps->pwm != 0.f) {
+		duty += ps->pwm * lfo_value(&v->patch->lfo[0], lfo_voice_phase(v->idx, ps->spread));
+	}
+	duty = clampf(duty, 0.f, 1.f);
+	gwave_ctrl_shape(&vs->gwave, duty, ps->slope);
 }
 
 static void ctrl_pan(struct voice *v) {
@@ -99,19 +118,41 @@ static int active(struct voice *v) {
 	return adsr_is_active(&vs->adsr);
 }
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	struct v_state *vs = (struct v_state *)v->state;
+	struct p_state *ps = (struct p_state *)v->patch->state;
 	float am[n];
 	float out[n];
 	// generate the envelope
-	adsr_gen(&vs->adsr, am, n);
+	int am_tag = adsr_gen(&vs->adsr, am, n);
+	if (am_tag & BLOCK_ZERO) {
+		return 1;
+	}
+	// apply the lfos
+	if (ps->pwm != 0.f) {
+		ctrl_shape(v);
+	}
+	if (ps->vibrato != 0.f || v->expr[EXPR_PRESSURE] != 0.f) {
+		ctrl_frequency(v);
+	}
 	// generate the gwave
 	gwave_gen(&vs->gwave, out, NULL, n);
 	// apply the envelope
-	block_mul(out, am, n);
+	if (am_tag & BLOCK_CONSTANT) {
+		block_mul_k(out, am[0], n);
+	} else {
+		block_mul(out, am, n);
+	}
 	// pan to left/right channels
 	pan_gen(&vs->pan, out_l, out_r, out, n);
+	return 0;
+}
+
+// the per note expression has changed
+static void expression(struct voice *v) {
+	ctrl_frequency(v);
+	ctrl_shape(v);
 }
 
 //-----------------------------------------------------------------------------
@@ -123,6 +164,10 @@ static void init(struct patch *p) {
 	ps->pan = 0.5f;
 	ps->duty = 0.5f;
 	ps->slope = 0.5f;
+	ps->spread = 0.5f;
+	lfo_ctrl_rate(&p->lfo[0], 0.5f);
+	lfo_ctrl_shape(&p->lfo[0], LFO_TRIANGLE);
+	lfo_ctrl_rate(&p->lfo[1], 5.f);
 }
 
 static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
@@ -148,6 +193,23 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 		ps->slope = midi_map(val, 0.f, 1.f);
 		update = 2;
 		break;
+	case 7:		// pwm depth
+		ps->pwm = midi_map(val, 0.f, 0.5f);
+		update = 2;
+		break;
+	case 8:		// pwm rate
+		lfo_ctrl_rate(&p->lfo[0], midi_map(val, 0.05f, 10.f));
+		break;
+	case 9:		// vibrato depth
+		ps->vibrato = midi_map(val, 0.f, 1.f);
+		update = 3;
+		break;
+	case 10:		// vibrato rate
+		lfo_ctrl_rate(&p->lfo[1], midi_map(val, 0.5f, 10.f));
+		break;
+	case 11:		// lfo phase spread across the voices
+		ps->spread = midi_map(val, 0.f, 1.f);
+		break;
 	default:
 		break;
 	}
@@ -157,12 +219,14 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 	if (update == 2) {
 		update_voices(p, ctrl_shape);
 	}
+	if (update == 3) {
+		update_voices(p, ctrl_frequency);
+	}
 }
 
 static void pitch_wheel(struct patch *p, uint16_t val) {
-	struct p_state *ps = (struct p_state *)p->state;
 	DBG("p1 pitch %d\r\n", val);
-	ps->bend = midi_pitch_bend(val);
+	tuning_ctrl_bend(&p->tuning, midi_pitch_bend(val));
 	update_voices(p, ctrl_frequency);
 }
 
@@ -178,6 +242,35 @@ const struct patch_ops patch1 = {
 	.init = init,
 	.control_change = control_change,
 	.pitch_wheel = pitch_wheel,
+	.expression = expression,
+};
+
+//-----------------------------------------------------------------------------
+// presets (serialized patch states for the patch banks)
+
+static const struct p_state pwm_strings = {
+	.vol = 0.8f,
+	.pan = 0.5f,
+	.duty = 0.5f,
+	.slope = 0.3f,
+	.pwm = 0.35f,
+	.vibrato = 0.1f,
+	.spread = 1.f,
+};
+
+static const struct p_state vibrato_lead = {
+	.vol = 1.f,
+	.pan = 0.5f,
+	.duty = 0.2f,
+	.slope = 0.8f,
+	.pwm = 0.f,
+	.vibrato = 0.4f,
+	.spread = 0.f,
+};
+
+const struct patch_preset patch1_presets[] = {
+	{"pwm strings", &patch1, &pwm_strings, sizeof(pwm_strings)},
+	{"vibrato lead", &patch1, &vibrato_lead, sizeof(vibrato_lead)},
 };
 
 //-----------------------------------------------------------------------------
@@ -19,14 +19,15 @@ Karplus Strong Testing
 //-----------------------------------------------------------------------------
 
 struct v_state {
-	struct ks ks;
+	struct ks2 ks;
 	struct pan pan;
+	struct silence sd;
+	int active;		// the string is sounding
 };
 
 struct p_state {
 	float vol;		// volume
 	float pan;		// left/right pan
-	float bend;		// pitch bend
 	float attenuate;
 };
 
@@ -38,14 +39,13 @@ _Static_assert(sizeof(struct p_state) <= PATCH_STATE_SIZE, "sizeof(struct p_stat
 
 static void ctrl_frequency(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
-	struct p_state *ps = (struct p_state *)v->patch->state;
-	ks_ctrl_frequency(&vs->ks, midi_to_frequency((float)v->note + ps->bend));
+	ks2_ctrl_frequency(&vs->ks, voice_frequency(v));
 }
 
 static void ctrl_attenuate(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
 	struct p_state *ps = (struct p_state *)v->patch->state;
-	ks_ctrl_attenuate(&vs->ks, ps->attenuate);
+	ks2_ctrl_attenuate(&vs->ks, ps->attenuate);
 }
 
 static void ctrl_pan(struct voice *v) {
@@ -63,7 +63,7 @@ static void start(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
 	memset(vs, 0, sizeof(struct v_state));
 
-	ks_init(&vs->ks);
+	ks2_init(&vs->ks);
 	pan_init(&vs->pan);
 
 	ctrl_frequency(v);
@@ -74,13 +74,19 @@ static void start(struct voice *v) {
 // stop the patch
 static void stop(struct voice *v) {
 	DBG("p2 stop v%d c%d n%d\r\n", v->idx, v->channel, v->note);
+	struct v_state *vs = (struct v_state *)v->state;
+	ks2_free(&vs->ks);
 }
 
 // note on
 static void note_on(struct voice *v, uint8_t vel) {
 	DBG("p2 note on v%d c%d n%d\r\n", v->idx, v->channel, v->note);
 	struct v_state *vs = (struct v_state *)v->state;
-	ks_pluck(&vs->ks);
+	if (ks2_pluck(&vs->ks) < 0) {
+		return;
+	}
+	silence_init(&vs->sd);
+	vs->active = 1;
 }
 
 // note off
@@ -89,15 +95,23 @@ static void note_off(struct voice *v, uint8_t vel) {
 
 // return !=0 if the patch is active
 static int active(struct voice *v) {
-	return 1;
+	struct v_state *vs = (struct v_state *)v->state;
+	return vs->active;
 }
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	struct v_state *vs = (struct v_state *)v->state;
 	float out[n];
-	ks_gen(&vs->ks, out, n);
+	ks2_gen(&vs->ks, out, n);
+	// retire the voice once the string has decayed
+	if (silence_detect(&vs->sd, out, n)) {
+		// return the delay line to the pool
+		ks2_free(&vs->ks);
+		vs->active = 0;
+	}
 	pan_gen(&vs->pan, out_l, out_r, out, n);
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -107,7 +121,6 @@ static void init(struct patch *p) {
 	struct p_state *ps = (struct p_state *)p->state;
 	ps->vol = 1.f;
 	ps->pan = 0.5f;
-	ps->bend = 0.f;
 	ps->attenuate = 0.99f;
 }
 
@@ -142,9 +155,8 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 }
 
 static void pitch_wheel(struct patch *p, uint16_t val) {
-	struct p_state *ps = (struct p_state *)p->state;
 	DBG("p2 pitch %d\r\n", val);
-	ps->bend = midi_pitch_bend(val);
+	tuning_ctrl_bend(&p->tuning, midi_pitch_bend(val));
 	update_voices(p, ctrl_frequency);
 }
 
@@ -160,6 +172,7 @@ const struct patch_ops patch2 = {
 	.init = init,
 	.control_change = control_change,
 	.pitch_wheel = pitch_wheel,
+	.expression = ctrl_frequency,
 };
 
 //-----------------------------------------------------------------------------
@@ -45,7 +45,6 @@ enum {
 struct p_state {
 	float vol;		// volume
 	float pan;		// left/right pan
-	float bend;		// pitch bend
 	// oscillator 0
 	float o0_duty, o0_slope;	// oscillator 0 duty cycle and slope
 	// oscillator 1
@@ -57,7 +56,9 @@ struct p_state {
 	float o1_level;		// oscillator 1 output level
 	// filter
 	float feg_a, feg_d, feg_s, feg_r;	// filter envelope generator adsr parameters
-	float sensitivity, cutoff, resonance;	// filter controls
+	float sensitivity, cutoff, resonance;	// filter controls (sensitivity, cutoff in Hz)
+	float lfo_cutoff;	// lfo 0 filter cutoff modulation depth (Hz)
+	float lfo_spread;	// lfo phase spread across the voices (0..1)
 	// output
 	float aeg_a, aeg_d, aeg_s, aeg_r;	// amplitude envelope generator adsr parameters
 };
@@ -70,8 +71,7 @@ _Static_assert(sizeof(struct p_state) <= PATCH_STATE_SIZE, "sizeof(struct p_stat
 
 static void ctrl_frequency_o0(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
-	struct p_state *ps = (struct p_state *)v->patch->state;
-	gwave_ctrl_frequency(&vs->o0, midi_to_frequency((float)v->note + ps->bend));
+	gwave_ctrl_frequency(&vs->o0, tuning_frequency(&v->patch->tuning, v->note));
 }
 
 static void ctrl_shape_o0(struct voice *v) {
@@ -84,8 +84,7 @@ static void ctrl_frequency_o1(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
 	struct p_state *ps = (struct p_state *)v->patch->state;
 	float note = (ps->f_mode) ? ps->f_mode : v->note;
-	// TODO tuning
-	gwave_ctrl_frequency(&vs->o1, midi_to_frequency((float)note + ps->bend));
+	gwave_ctrl_frequency(&vs->o1, tuning_frequency(&v->patch->tuning, note));
 }
 
 static void ctrl_shape_o1(struct voice *v) {
@@ -170,25 +169,39 @@ static int active(struct voice *v) {
 	return adsr_is_active(&vs->aeg);
 }
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	struct v_state *vs = (struct v_state *)v->state;
 	struct p_state *ps = (struct p_state *)v->patch->state;
 
 	float buf0[n];
 	float buf1[n];
+	float am[n];
 	float out[n];
 
+	// generate the amplitude envelope
+	int am_tag = adsr_gen(&vs->aeg, am, n);
+	if (am_tag & BLOCK_ZERO) {
+		// silent output, keep the other envelopes in step
+		adsr_gen(&vs->eg, buf0, n);
+		adsr_gen(&vs->feg, buf1, n);
+		return 1;
+	}
+
 	// oscillator 1
 	if (ps->o_mode == OMODE_FM_FB) {
 		// feedback
 		// TODO
 	} else {
 		// no feedback
-		adsr_gen(&vs->eg, buf0, n);
+		int eg_tag = adsr_gen(&vs->eg, buf0, n);
 		gwave_gen(&vs->o1, buf1, NULL, n);
-		block_mul(buf1, buf0, n);
-		block_mul_k(buf1, ps->o1_level, n);
+		if (eg_tag & BLOCK_CONSTANT) {
+			block_mul_k(buf1, buf0[0] * ps->o1_level, n);
+		} else {
+			block_mul(buf1, buf0, n);
+			block_mul_k(buf1, ps->o1_level, n);
+		}
 	}
 	// buf1 has the oscillator 1 output
 
@@ -207,19 +220,24 @@ static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	adsr_gen(&vs->feg, buf1, n);
 	block_mul_k(buf1, vs->velocity * ps->sensitivity, n);
 	block_add_k(buf1, ps->cutoff, n);
-	// TODO use buf1 for the RT cutoff
-	svf_gen(&vs->lpf, out, buf0, n);
+	if (ps->lfo_cutoff != 0.f) {
+		lfo_add_ramp(&v->patch->lfo[0], lfo_voice_phase(v->idx, ps->lfo_spread), ps->lfo_cutoff, buf1, n);
+	}
+	// buf1 has the filter cutoff frequency
+	svf_gen_mod(&vs->lpf, out, buf0, buf1, n);
 	// out has the filter output
 
-	// generate the envelope
-	adsr_gen(&vs->aeg, buf0, n);
-	block_mul_k(buf0, vs->velocity, n);
-
 	// apply the envelope
-	block_mul(out, buf0, n);
+	if (am_tag & BLOCK_CONSTANT) {
+		block_mul_k(out, am[0] * vs->velocity, n);
+	} else {
+		block_mul_k(am, vs->velocity, n);
+		block_mul(out, am, n);
+	}
 
 	// pan to left/right channels
 	pan_gen(&vs->pan, out_l, out_r, out, n);
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -228,7 +246,6 @@ static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 static void init(struct patch *p) {
 	struct p_state *ps = (struct p_state *)p->state;
 
-	ps->bend = 0.f;
 	ps->vol = 0.3f;
 	ps->pan = 0.5f;
 
@@ -252,9 +269,12 @@ static void init(struct patch *p) {
 	ps->feg_d = 0.2f;
 	ps->feg_s = 0.5f;
 	ps->feg_r = 0.5f;
-	ps->sensitivity = 1.f;
-	ps->cutoff = 1.f;
-	ps->resonance = 1.f;
+	ps->sensitivity = 5000.f;
+	ps->cutoff = 200.f;
+	ps->resonance = 0.5f;
+	ps->lfo_cutoff = 0.f;
+	ps->lfo_spread = 0.f;
+	lfo_ctrl_rate(&p->lfo[0], 2.f);
 
 	// output
 	ps->aeg_a = 0.05f;
@@ -288,6 +308,18 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 	case 7:
 		ps->eg_d = midi_map(val, 0.05f, 5.f);
 		break;
+	case 8:		// lfo filter cutoff modulation depth
+		ps->lfo_cutoff = midi_map(val, 0.f, 2000.f);
+		break;
+	case 9:		// lfo rate
+		lfo_ctrl_rate(&p->lfo[0], midi_map(val, 0.05f, 20.f));
+		break;
+	case 10:		// lfo shape
+		lfo_ctrl_shape(&p->lfo[0], (val * LFO_SHAPES) >> 7);
+		break;
+	case 11:		// lfo phase spread across the voices
+		ps->lfo_spread = midi_map(val, 0.f, 1.f);
+		break;
 	default:
 		break;
 	}
@@ -298,9 +330,8 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 }
 
 static void pitch_wheel(struct patch *p, uint16_t val) {
-	struct p_state *ps = (struct p_state *)p->state;
 	DBG("p3 pitch %d\r\n", val);
-	ps->bend = midi_pitch_bend(val);
+	tuning_ctrl_bend(&p->tuning, midi_pitch_bend(val));
 	// update each voice using this patch
 	//,,,
 }
@@ -320,3 +351,43 @@ const struct patch_ops patch3 = {
 };
 
 //-----------------------------------------------------------------------------
+// presets (serialized patch states for the patch banks)
+
+static const struct p_state fm_bass = {
+	.vol = 0.4f,
+	.pan = 0.5f,
+	// oscillator 0
+	.o0_duty = 0.5f,
+	.o0_slope = 0.5f,
+	// oscillator 1
+	.f_mode = 0,
+	.o_mode = OMODE_FM,
+	.o1_coarse = 0.f,
+	.o1_fine = 0.f,
+	.o1_duty = 0.5f,
+	.o1_slope = 0.9f,
+	.eg_a = 0.01f,
+	.eg_d = 0.3f,
+	.o1_level = 15.f,
+	// filter
+	.feg_a = 0.01f,
+	.feg_d = 0.3f,
+	.feg_s = 0.2f,
+	.feg_r = 0.2f,
+	.sensitivity = 3000.f,
+	.cutoff = 150.f,
+	.resonance = 0.7f,
+	.lfo_cutoff = 0.f,
+	.lfo_spread = 0.f,
+	// output
+	.aeg_a = 0.01f,
+	.aeg_d = 0.5f,
+	.aeg_s = 0.7f,
+	.aeg_r = 0.2f,
+};
+
+const struct patch_preset patch3_presets[] = {
+	{"fm bass", &patch3, &fm_bass, sizeof(fm_bass)},
+};
+
+//-----------------------------------------------------------------------------
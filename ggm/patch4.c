@@ -414,11 +414,8 @@ static void procctrl(struct patch *p) {
 	ps->rvol = (sintab[128 + (ct[23] & ~1)] * i) >> 15;
 
 	// update each voice using this patch
-	for (int i = 0; i < NUM_VOICES; i++) {
-		struct voice *v = &p->ggm->voices[i];
-		if (v->patch == p) {
-			setfreqvol(v, ct);
-		}
+	for (struct voice *v = p->voices; v != NULL; v = v->next) {
+		setfreqvol(v, ct);
 	}
 }
 
@@ -471,8 +468,8 @@ static int active(struct voice *v) {
 // L,R samples being prepared
 int tbuf[4][2];
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	for (size_t i = 0; i < n; i += 4) {
 		CT32B0handler(v, (i >> 2) & 1);
 		out_l[i + 0] = q31_to_float(tbuf[0][0]);
@@ -484,6 +481,7 @@ static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 		out_r[i + 2] = q31_to_float(tbuf[2][1]);
 		out_r[i + 3] = q31_to_float(tbuf[3][1]);
 	}
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -520,11 +518,8 @@ static void pitch_wheel(struct patch *p, uint16_t val) {
 	DBG("p4 pitch %d\r\n", val);
 	ps->pbend = val - 0x2000;
 	// update each voice using this patch
-	for (int i = 0; i < NUM_VOICES; i++) {
-		struct voice *v = &p->ggm->voices[i];
-		if (v->patch == p) {
-			setfreqvol(v, ps->ctrl);
-		}
+	for (struct voice *v = p->voices; v != NULL; v = v->next) {
+		setfreqvol(v, ps->ctrl);
 	}
 }
 
@@ -3,6 +3,8 @@
 
 Patch 5 - FM Synthesis
 
+Per note expression: timbre (MPE CC74) moves the filter cutoff by +/- 2 octaves.
+
 */
 //-----------------------------------------------------------------------------
 
@@ -27,6 +29,7 @@ struct v_state {
 	struct svf2 lpf;
 	struct adsr aeg;
 	struct pan pan;
+	struct silence sd;
 	float fm_level;		// modulator amplitude
 };
 
@@ -56,23 +59,22 @@ static void ctrl_frequency(struct voice *v) {
 	float freq;
 
 	// set the modulator frequency
-	float fm_note = (ps->f_mode) ? ps->f_mode : (float)v->note + ps->bend;
+	float fm_note = (ps->f_mode) ? ps->f_mode : (float)v->note + ps->bend + v->expr[EXPR_BEND];
 	fm_note *= ps->fm_tune;
 	freq = midi_to_frequency(fm_note);
 	sin_ctrl_frequency(&vs->modulator, freq);
 	vs->fm_level = freq * ps->fm_level;
 
 	// set the carrier frequency
-	freq = midi_to_frequency((float)v->note + ps->bend);
+	freq = voice_frequency(v);
 	sin_ctrl_frequency(&vs->carrier, freq);
 }
 
 static void ctrl_lpf(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
 	struct p_state *ps = (struct p_state *)v->patch->state;
-	float freq = midi_to_frequency((float)v->note + ps->bend);
-	svf2_ctrl_cutoff(&vs->lpf, ps->cutoff * freq);
-	svf2_ctrl_resonance(&vs->lpf, ps->resonance);
+	float freq = voice_frequency(v) * pow2((v->expr[EXPR_TIMBRE] - 0.5f) * 4.f);
+	svf2_ctrl(&vs->lpf, ps->cutoff * freq, ps->resonance);
 }
 
 static void ctrl_pan(struct voice *v) {
@@ -84,6 +86,12 @@ static void ctrl_pan(struct voice *v) {
 //-----------------------------------------------------------------------------
 // voice operations
 
+// the per note expression has changed
+static void expression(struct voice *v) {
+	ctrl_frequency(v);
+	ctrl_lpf(v);
+}
+
 // start the patch
 static void start(struct voice *v) {
 	struct v_state *vs = (struct v_state *)v->state;
@@ -108,6 +116,7 @@ static void stop(struct voice *v) {
 static void note_on(struct voice *v, uint8_t vel) {
 	DBG("p5 note on v%d c%d n%d\r\n", v->idx, v->channel, v->note);
 	struct v_state *vs = (struct v_state *)v->state;
+	silence_init(&vs->sd);
 	adsr_attack(&vs->aeg);
 }
 
@@ -116,6 +125,7 @@ static void note_off(struct voice *v, uint8_t vel) {
 	DBG("p5 note off v%d c%d n%d\r\n", v->idx, v->channel, v->note);
 	struct v_state *vs = (struct v_state *)v->state;
 	adsr_release(&vs->aeg);
+	silence_init(&vs->sd);
 }
 
 // return !=0 if the patch is active
@@ -124,17 +134,23 @@ static int active(struct voice *v) {
 	return adsr_is_active(&vs->aeg);
 }
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	struct v_state *vs = (struct v_state *)v->state;
 	//struct p_state *ps = (struct p_state *)v->patch->state;
 
 	float buf0[n];
 	float buf1[n];
+	float am[n];
 	float *fm = buf0;
 	float *cout = buf1;
 	float *out = buf0;
-	float *am = buf1;
+
+	// generate the output envelope
+	int am_tag = adsr_gen(&vs->aeg, am, n);
+	if (am_tag & BLOCK_ZERO) {
+		return 1;
+	}
 
 	// generate the modulator
 	sin_gen(&vs->modulator, fm, NULL, n);
@@ -148,11 +164,20 @@ static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	block_copy(out, cout, n);
 
 	// apply the output envelope
-	adsr_gen(&vs->aeg, am, n);
-	block_mul(out, am, n);
+	if (am_tag & BLOCK_CONSTANT) {
+		block_mul_k(out, am[0], n);
+	} else {
+		block_mul(out, am, n);
+	}
+
+	// retire the released voice once it is inaudible
+	if (v->released && silence_detect(&vs->sd, out, n)) {
+		adsr_idle(&vs->aeg);
+	}
 
 	// pan to left/right channels
 	pan_gen(&vs->pan, out_l, out_r, out, n);
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -228,6 +253,7 @@ static void pitch_wheel(struct patch *p, uint16_t val) {
 	struct p_state *ps = (struct p_state *)p->state;
 	DBG("p5 pitch %d\r\n", val);
 	ps->bend = midi_pitch_bend(val);
+	tuning_ctrl_bend(&p->tuning, ps->bend);
 	update_voices(p, ctrl_frequency);
 }
 
@@ -243,6 +269,7 @@ const struct patch_ops patch5 = {
 	.init = init,
 	.control_change = control_change,
 	.pitch_wheel = pitch_wheel,
+	.expression = expression,
 };
 
 //-----------------------------------------------------------------------------
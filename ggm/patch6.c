@@ -5,6 +5,10 @@ Patch 6
 
 A simple patch - Just an envelope on noise.
 
+The noise can be pitched by a bank of band pass filters on the first
+FILTER_LANES harmonics of the note. The filters run side by side in a
+multi-lane biquad.
+
 */
 //-----------------------------------------------------------------------------
 
@@ -22,6 +26,8 @@ struct v_state {
 	struct adsr adsr;
 	struct noise ns;
 	struct pan pan;
+	struct silence sd;
+	struct biquad4 bpf;	// harmonic band pass filters
 	int algo;
 };
 
@@ -29,10 +35,13 @@ struct p_state {
 	float vol;		// volume
 	float pan;		// left/right pan
 	float bend;		// pitch bend
+	float tone;		// pitched (filtered) noise mix (0..1)
+	float q;		// band pass filter q
 };
 
 _Static_assert(sizeof(struct v_state) <= VOICE_STATE_SIZE, "sizeof(struct v_state) > VOICE_STATE_SIZE");
 _Static_assert(sizeof(struct p_state) <= PATCH_STATE_SIZE, "sizeof(struct p_state) > PATCH_STATE_SIZE");
+_Static_assert(FILTER_LANES == 4, "the harmonic filters are written for 4 lanes");
 
 //-----------------------------------------------------------------------------
 // control functions
@@ -43,6 +52,16 @@ static void ctrl_pan(struct voice *v) {
 	pan_ctrl(&vs->pan, ps->vol, ps->pan);
 }
 
+// tune the band pass filters to the harmonics of the note
+static void ctrl_filter(struct voice *v) {
+	struct v_state *vs = (struct v_state *)v->state;
+	struct p_state *ps = (struct p_state *)v->patch->state;
+	float freq = voice_frequency(v);
+	for (int k = 0; k < FILTER_LANES; k++) {
+		biquad4_ctrl_bpf(&vs->bpf, k, freq * (float)(k + 1), ps->q);
+	}
+}
+
 //-----------------------------------------------------------------------------
 // voice operations
 
@@ -56,6 +75,8 @@ static void start(struct voice *v) {
 	noise_init(&vs->ns);
 	pan_init(&vs->pan);
 	ctrl_pan(v);
+	biquad4_init(&vs->bpf);
+	ctrl_filter(v);
 
 	vs->algo = v->note % 4;
 	DBG("algo %d\r\n", vs->algo);
@@ -70,6 +91,7 @@ static void stop(struct voice *v) {
 static void note_on(struct voice *v, uint8_t vel) {
 	DBG("p6 note on (%d %d %d)\r\n", v->idx, v->channel, v->note);
 	struct v_state *vs = (struct v_state *)v->state;
+	silence_init(&vs->sd);
 	adsr_attack(&vs->adsr);
 }
 
@@ -78,6 +100,7 @@ static void note_off(struct voice *v, uint8_t vel) {
 	DBG("p6 note off (%d %d %d)\r\n", v->idx, v->channel, v->note);
 	struct v_state *vs = (struct v_state *)v->state;
 	adsr_release(&vs->adsr);
+	silence_init(&vs->sd);
 }
 
 // return !=0 if the patch is active
@@ -86,13 +109,17 @@ static int active(struct voice *v) {
 	return adsr_is_active(&vs->adsr);
 }
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	struct v_state *vs = (struct v_state *)v->state;
+	struct p_state *ps = (struct p_state *)v->patch->state;
 	float am[n];
 	float out[n];
 	// generate the envelope
-	adsr_gen(&vs->adsr, am, n);
+	int am_tag = adsr_gen(&vs->adsr, am, n);
+	if (am_tag & BLOCK_ZERO) {
+		return 1;
+	}
 
 	// generate the noise
 	if (vs->algo == 0) {
@@ -104,10 +131,32 @@ static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
 	} else if (vs->algo == 3) {
 		noise_gen_brown(&vs->ns, out, n);
 	}
+	// pitch the noise
+	if (ps->tone > 0.f) {
+		float h0[n], h1[n], h2[n], h3[n];
+		float *h[FILTER_LANES] = { h0, h1, h2, h3 };
+		const float *in[FILTER_LANES] = { out, out, out, out };
+		biquad4_gen(&vs->bpf, h, in, n);
+		// harmonic k has a 1/k level
+		float dry = 1.f - ps->tone;
+		for (size_t i = 0; i < n; i++) {
+			float x = h0[i] + (0.5f * h1[i]) + (0.333f * h2[i]) + (0.25f * h3[i]);
+			out[i] = (dry * out[i]) + (ps->tone * x);
+		}
+	}
 	// apply the envelope
-	block_mul(out, am, n);
+	if (am_tag & BLOCK_CONSTANT) {
+		block_mul_k(out, am[0], n);
+	} else {
+		block_mul(out, am, n);
+	}
+	// retire the released voice once it is inaudible
+	if (v->released && silence_detect(&vs->sd, out, n)) {
+		adsr_idle(&vs->adsr);
+	}
 	// pan to left/right channels
 	pan_gen(&vs->pan, out_l, out_r, out, n);
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -117,6 +166,8 @@ static void init(struct patch *p) {
 	struct p_state *ps = (struct p_state *)p->state;
 	ps->vol = 1.f;
 	ps->pan = 0.5f;
+	ps->tone = 0.f;
+	ps->q = 10.f;
 }
 
 static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
@@ -134,6 +185,13 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 		ps->pan = midi_map(val, 0.f, 1.f);
 		update = 1;
 		break;
+	case 5:		// pitched noise mix
+		ps->tone = midi_map(val, 0.f, 1.f);
+		break;
+	case 6:		// band pass filter q
+		ps->q = midi_map(val, 1.f, 50.f);
+		update_voices(p, ctrl_filter);
+		break;
 	default:
 		break;
 	}
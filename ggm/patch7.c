@@ -0,0 +1,247 @@
+//-----------------------------------------------------------------------------
+/*
+
+Patch 7
+
+An ADSR envelope on a unison stack of goom waves.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <assert.h>
+#include <string.h>
+
+#include "ggm.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+struct v_state {
+	struct unison osc;
+	struct adsr adsr;
+	struct pan pan;
+};
+
+struct p_state {
+	float vol;		// volume
+	float pan;		// left/right pan
+	float duty;		// duty cycle for gwave (0..1)
+	float slope;		// slope for gwave (0..1)
+	int n;			// number of unison oscillators
+	float detune;		// unison detuning (semitones)
+	float spread;		// unison stereo spread (0..1)
+};
+
+_Static_assert(sizeof(struct v_state) <= VOICE_STATE_SIZE, "sizeof(struct v_state) > VOICE_STATE_SIZE");
+_Static_assert(sizeof(struct p_state) <= PATCH_STATE_SIZE, "sizeof(struct p_state) > PATCH_STATE_SIZE");
+
+//-----------------------------------------------------------------------------
+// control functions
+
+static void ctrl_frequency(struct voice *v) {
+	struct v_state *vs = (struct v_state *)v->state;
+	unison_ctrl_frequency(&vs->osc, tuning_frequency(&v->patch->tuning, v->note));
+}
+
+static void ctrl_shape(struct voice *v) {
+	struct v_state *vs = (struct v_state *)v->state;
+	struct p_state *ps = (struct p_state *)v->patch->state;
+	unison_ctrl_shape(&vs->osc, ps->duty, ps->slope);
+}
+
+static void ctrl_detune(struct voice *v) {
+	struct v_state *vs = (struct v_state *)v->state;
+	struct p_state *ps = (struct p_state *)v->patch->state;
+	unison_ctrl_detune(&vs->osc, ps->n, ps->detune, ps->spread);
+}
+
+static void ctrl_pan(struct voice *v) {
+	struct v_state *vs = (struct v_state *)v->state;
+	struct p_state *ps = (struct p_state *)v->patch->state;
+	pan_ctrl(&vs->pan, ps->vol, ps->pan);
+}
+
+//-----------------------------------------------------------------------------
+// voice operations
+
+// start the patch
+static void start(struct voice *v) {
+	DBG("p7 start (%d %d %d)\r\n", v->idx, v->channel, v->note);
+	struct v_state *vs = (struct v_state *)v->state;
+	memset(vs, 0, sizeof(struct v_state));
+
+	adsr_init(&vs->adsr, 0.05f, 0.2f, 0.5f, 0.5f);
+	unison_init(&vs->osc);
+	pan_init(&vs->pan);
+
+	ctrl_detune(v);
+	ctrl_frequency(v);
+	ctrl_shape(v);
+	ctrl_pan(v);
+}
+
+// stop the patch
+static void stop(struct voice *v) {
+	DBG("p7 stop (%d %d %d)\r\n", v->idx, v->channel, v->note);
+}
+
+// note on
+static void note_on(struct voice *v, uint8_t vel) {
+	DBG("p7 note on (%d %d %d)\r\n", v->idx, v->channel, v->note);
+	struct v_state *vs = (struct v_state *)v->state;
+	adsr_attack(&vs->adsr);
+}
+
+// note off
+static void note_off(struct voice *v, uint8_t vel) {
+	DBG("p7 note off (%d %d %d)\r\n", v->idx, v->channel, v->note);
+	struct v_state *vs = (struct v_state *)v->state;
+	adsr_release(&vs->adsr);
+}
+
+// return !=0 if the patch is active
+static int active(struct voice *v) {
+	struct v_state *vs = (struct v_state *)v->state;
+	return adsr_is_active(&vs->adsr);
+}
+
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+	struct v_state *vs = (struct v_state *)v->state;
+	float am[n];
+	float buf_l[n];
+	float buf_r[n];
+	// generate the envelope
+	int am_tag = adsr_gen(&vs->adsr, am, n);
+	if (am_tag & BLOCK_ZERO) {
+		return 1;
+	}
+	// generate the unison stack
+	unison_gen(&vs->osc, buf_l, buf_r, n);
+	// apply the envelope
+	if (am_tag & BLOCK_CONSTANT) {
+		block_mul_k(buf_l, am[0], n);
+		block_mul_k(buf_r, am[0], n);
+	} else {
+		block_mul(buf_l, am, n);
+		block_mul(buf_r, am, n);
+	}
+	// pan to left/right channels
+	pan_gen_stereo(&vs->pan, out_l, out_r, buf_l, buf_r, n);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// global operations
+
+static void init(struct patch *p) {
+	struct p_state *ps = (struct p_state *)p->state;
+	ps->vol = 1.f;
+	ps->pan = 0.5f;
+	ps->duty = 0.5f;
+	ps->slope = 0.5f;
+	ps->n = 5;
+	ps->detune = 0.2f;
+	ps->spread = 0.8f;
+}
+
+static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
+	struct p_state *ps = (struct p_state *)p->state;
+	int update = 0;
+
+	DBG("p7 ctrl %d val %d\r\n", ctrl, val);
+
+	switch (ctrl) {
+	case 1:		// volume
+		ps->vol = midi_map(val, 0.f, 1.5f);
+		update = 1;
+		break;
+	case 2:		// left/right pan
+		ps->pan = midi_map(val, 0.f, 1.f);
+		update = 1;
+		break;
+	case 5:
+		ps->duty = midi_map(val, 0.f, 1.f);
+		update = 2;
+		break;
+	case 6:
+		ps->slope = midi_map(val, 0.f, 1.f);
+		update = 2;
+		break;
+	case 7:		// number of unison oscillators
+		ps->n = 1 + ((val * UNISON_MAX) >> 7);
+		update = 3;
+		break;
+	case 8:		// unison detuning
+		ps->detune = midi_map(val, 0.f, 1.f);
+		update = 3;
+		break;
+	case 9:		// unison stereo spread
+		ps->spread = midi_map(val, 0.f, 1.f);
+		update = 3;
+		break;
+	default:
+		break;
+	}
+	if (update == 1) {
+		update_voices(p, ctrl_pan);
+	}
+	if (update == 2) {
+		update_voices(p, ctrl_shape);
+	}
+	if (update == 3) {
+		update_voices(p, ctrl_detune);
+	}
+}
+
+static void pitch_wheel(struct patch *p, uint16_t val) {
+	DBG("p7 pitch %d\r\n", val);
+	tuning_ctrl_bend(&p->tuning, midi_pitch_bend(val));
+	update_voices(p, ctrl_frequency);
+}
+
+//-----------------------------------------------------------------------------
+
+const struct patch_ops patch7 = {
+	.start = start,
+	.stop = stop,
+	.note_on = note_on,
+	.note_off = note_off,
+	.active = active,
+	.generate = generate,
+	.init = init,
+	.control_change = control_change,
+	.pitch_wheel = pitch_wheel,
+};
+
+//-----------------------------------------------------------------------------
+// presets (serialized patch states for the patch banks)
+
+static const struct p_state wide_unison = {
+	.vol = 0.8f,
+	.pan = 0.5f,
+	.duty = 1.f,
+	.slope = 0.f,
+	.n = UNISON_MAX,
+	.detune = 0.3f,
+	.spread = 1.f,
+};
+
+static const struct p_state thin_unison = {
+	.vol = 1.f,
+	.pan = 0.5f,
+	.duty = 0.5f,
+	.slope = 0.5f,
+	.n = 2,
+	.detune = 0.05f,
+	.spread = 0.4f,
+};
+
+const struct patch_preset patch7_presets[] = {
+	{"wide unison", &patch7, &wide_unison, sizeof(wide_unison)},
+	{"thin unison", &patch7, &thin_unison, sizeof(thin_unison)},
+};
+
+//-----------------------------------------------------------------------------
@@ -55,8 +55,9 @@ static int active(struct voice *v) {
 	return 0;
 }
 
-// generate samples
-static void generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+// generate samples, return !=0 for a silent output
+static int generate(struct voice *v, float *out_l, float *out_r, size_t n) {
+	return 1;
 }
 
 //-----------------------------------------------------------------------------
@@ -77,11 +78,8 @@ static void control_change(struct patch *p, uint8_t ctrl, uint8_t val) {
 	}
 	if (update) {
 		// update each voice using this patch
-		for (int i = 0; i < NUM_VOICES; i++) {
-			struct voice *v = &p->ggm->voices[i];
-			if (v->patch == p) {
-				// ....
-			}
+		for (struct voice *v = p->voices; v != NULL; v = v->next) {
+			// ....
 		}
 	}
 }
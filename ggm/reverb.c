@@ -0,0 +1,172 @@
+//-----------------------------------------------------------------------------
+/*
+
+Feedback Delay Network Reverb
+
+FDN_LINES delay lines with mutually prime lengths. The delay line outputs are
+damped (one pole low pass), attenuated for the decay time, mixed with a
+Hadamard matrix and fed back into the delay lines along with the input.
+
+The shortest delay line is longer than an audio block, so we can read a whole
+block from each delay line, run the per-sample mixing on local buffers and then
+write the whole block back. The mixing runs across the delay lines for each
+sample so the compiler can vectorise/unroll it.
+
+The delay lines live in the CCM RAM. It isn't zeroed by the startup code so we
+clear it in fdn_init(). Note: the CCM RAM can't be accessed by DMA.
+
+There is only one reverb (on the effects bus), so the delay line memory and
+the per block scratch buffer are statically allocated. The scratch buffer
+would be a large stack allocation in the audio handler.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "ggm.h"
+#include "utils.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+// mutually prime delay line lengths (~14ms to ~46ms)
+static const unsigned int fdn_len[FDN_LINES] = {
+	601, 797, 1009, 1213, 1429, 1621, 1831, 2029,
+};
+
+#define FDN_SIZE (601 + 797 + 1009 + 1213 + 1429 + 1621 + 1831 + 2029)
+
+static float fdn_buf[FDN_SIZE] CCM_BSS;
+
+// delay line outputs/inputs for a block
+static float fdn_y[FDN_LINES][AUDIO_BLOCK_SIZE] CCM_BSS;
+
+_Static_assert(FDN_LINES == 8, "hadamard8() needs FDN_LINES == 8");
+_Static_assert(601 >= AUDIO_BLOCK_SIZE, "delay lines must be longer than an audio block");
+
+#define LN_1000 (6.9077553f)	// logf(1000.f)
+#define FDN_SCALE (0.35355339f)	// 1/sqrt(FDN_LINES), keeps the matrix orthonormal
+
+//-----------------------------------------------------------------------------
+
+// 8 point fast Walsh-Hadamard transform (unscaled)
+static inline void hadamard8(float *x) {
+	for (int h = 1; h < FDN_LINES; h <<= 1) {
+		for (int i = 0; i < FDN_LINES; i += (h << 1)) {
+			for (int j = i; j < i + h; j++) {
+				float a = x[j];
+				float b = x[j + h];
+				x[j] = a + b;
+				x[j + h] = a - b;
+			}
+		}
+	}
+}
+
+// read n samples from a delay line
+static void delay_rd(struct fdn *r, int k, float *out, size_t n) {
+	const float *buf = r->delay[k];
+	unsigned int len = r->len[k];
+	unsigned int pos = r->pos[k];
+	for (size_t i = 0; i < n; i++) {
+		out[i] = buf[pos];
+		pos = (pos + 1 == len) ? 0 : pos + 1;
+	}
+}
+
+// write n samples to a delay line and advance its position
+static void delay_wr(struct fdn *r, int k, const float *in, size_t n) {
+	float *buf = r->delay[k];
+	unsigned int len = r->len[k];
+	unsigned int pos = r->pos[k];
+	for (size_t i = 0; i < n; i++) {
+		buf[pos] = in[i];
+		pos = (pos + 1 == len) ? 0 : pos + 1;
+	}
+	r->pos[k] = pos;
+}
+
+//-----------------------------------------------------------------------------
+
+// generate up to AUDIO_BLOCK_SIZE samples
+static void fdn_gen_block(struct fdn *r, float *out_l, float *out_r, const float *in_l, const float *in_r, size_t n) {
+	float (*y)[AUDIO_BLOCK_SIZE] = fdn_y;
+	float g[FDN_LINES], lp[FDN_LINES];
+	float kd = r->kd;
+
+	// read the delay line outputs
+	for (int k = 0; k < FDN_LINES; k++) {
+		delay_rd(r, k, y[k], n);
+		g[k] = r->g[k] * FDN_SCALE;
+		lp[k] = r->lp[k];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		float x[FDN_LINES];
+		// damping and decay
+		for (int k = 0; k < FDN_LINES; k++) {
+			lp[k] += kd * (y[k][i] - lp[k]);
+			x[k] = g[k] * lp[k];
+		}
+		// stereo output from the even/odd lines
+		out_l[i] = 0.5f * (y[0][i] + y[2][i] + y[4][i] + y[6][i]);
+		out_r[i] = 0.5f * (y[1][i] + y[3][i] + y[5][i] + y[7][i]);
+		// mix and feed back with the input
+		hadamard8(x);
+		for (int k = 0; k < FDN_LINES; k += 2) {
+			y[k][i] = x[k] + in_l[i];
+			y[k + 1][i] = x[k + 1] + in_r[i];
+		}
+	}
+
+	// write the delay line inputs
+	for (int k = 0; k < FDN_LINES; k++) {
+		delay_wr(r, k, y[k], n);
+		r->lp[k] = lp[k];
+	}
+}
+
+void fdn_gen(struct fdn *r, float *out_l, float *out_r, const float *in_l, const float *in_r, size_t n) {
+	while (n > 0) {
+		size_t k = (n < AUDIO_BLOCK_SIZE) ? n : AUDIO_BLOCK_SIZE;
+		fdn_gen_block(r, out_l, out_r, in_l, in_r, k);
+		out_l += k;
+		out_r += k;
+		in_l += k;
+		in_r += k;
+		n -= k;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// set the decay time (seconds to -60dB)
+void fdn_ctrl_decay(struct fdn *r, float t60) {
+	t60 = clampf_lo(t60, 0.1f);
+	for (int k = 0; k < FDN_LINES; k++) {
+		r->g[k] = powe(-LN_1000 * (float)r->len[k] / (t60 * AUDIO_FS));
+	}
+}
+
+// set the high frequency damping (0..1)
+void fdn_ctrl_damping(struct fdn *r, float damping) {
+	r->kd = 1.f - (0.9f * clampf(damping, 0.f, 1.f));
+}
+
+void fdn_init(struct fdn *r) {
+	memset(r, 0, sizeof(struct fdn));
+	memset(fdn_buf, 0, sizeof(fdn_buf));
+	float *buf = fdn_buf;
+	for (int k = 0; k < FDN_LINES; k++) {
+		r->delay[k] = buf;
+		r->len[k] = fdn_len[k];
+		buf += fdn_len[k];
+	}
+	fdn_ctrl_decay(r, 2.f);
+	fdn_ctrl_damping(r, 0.5f);
+}
+
+//-----------------------------------------------------------------------------
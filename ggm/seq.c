@@ -8,10 +8,25 @@ This is divided down to give the desired beats per minute.
 Each beat is a quarter note. Each beat is divided into TICKS_PER_BEAT ticks.
 Note durations are specified with a tick count.
 
+The sequencer can be slaved to a MIDI clock (24 clocks per beat). The clock
+arrival times are smoothed with a PLL that tracks the clock period (the tempo)
+and phase. While the PLL is locked the ticks follow the master song position
+rather than counting audio blocks, so slaved boards don't drift. MIDI
+Start/Stop/Continue and Song Position Pointer control the transport.
+
+The clock ticks are played MIDI_LATENCY after the clocks are received, so the
+transport messages are timestamped and queued, and applied to the sequencer
+at the same delay. The song position of the clock is kept in receive time.
+A song position seek is spread over blocks (SEQ_SEEK_TICKS per block) so a
+long seek doesn't hold up the event loop.
+
 */
 //-----------------------------------------------------------------------------
 
+#include <math.h>
+
 #include "ggm.h"
+#include "utils.h"
 
 #define DEBUG
 #include "logging.h"
@@ -22,6 +37,19 @@ Note durations are specified with a tick count.
 #define SECS_PER_MIN (60.f)
 #define SECS_PER_BLOCK (AUDIO_BLOCK_SIZE / AUDIO_FS)
 
+#define MIDI_CLOCKS_PER_BEAT (24)
+#define MIDI_CLOCKS_PER_SPP (6)	// a song position unit is a 1/16 note
+
+// midi clock pll
+#define CLOCK_KP (0.125f)	// phase error gain
+#define CLOCK_KF (0.004f)	// period error gain
+#define CLOCK_BPM_MIN (20.f)
+#define CLOCK_BPM_MAX (300.f)
+#define CLOCK_PERIOD(bpm) ((SECS_PER_MIN * AUDIO_FS) / ((bpm) * (float)MIDI_CLOCKS_PER_BEAT))
+#define CLOCK_TIMEOUT ((int32_t)(0.5f * AUDIO_FS))	// lose lock with no clock for this long (samples)
+
+#define SEQ_SEEK_TICKS 256	// maximum ticks per block while seeking
+
 //-----------------------------------------------------------------------------
 // Note durations
 
@@ -42,6 +70,13 @@ enum {
 	S_STATE_RUN,
 };
 
+// midi clock state
+enum {
+	CLOCK_STATE_NONE,	// 0, no clock
+	CLOCK_STATE_FIRST,	// got the first clock
+	CLOCK_STATE_LOCKED,	// pll is tracking the clock
+};
+
 // operation state
 enum {
 	O_STATE_INIT,		// 0
@@ -67,20 +102,28 @@ struct rest_args {
 
 // process a sequencer note off event
 static void seq_note_off(struct seq *s, struct note_args *args) {
+	if (s->mute) {
+		return;
+	}
+	DBG("note off (%d)\r\n", s->ticks);
 	struct voice *v = voice_lookup(s->ggm, args->chan, args->note);
 	if (v) {
-		v->patch->ops->note_off(v, 0);
+		voice_note_off(v, 0);
 	}
 }
 
 // process a sequencer note on event
 static void seq_note_on(struct seq *s, struct note_args *args) {
+	if (s->mute) {
+		return;
+	}
+	DBG("note on %d (%d)\r\n", args->note, s->ticks);
 	struct voice *v = voice_lookup(s->ggm, args->chan, args->note);
 	if (!v) {
 		v = voice_alloc(s->ggm, args->chan, args->note);
 	}
 	if (v) {
-		v->patch->ops->note_on(v, args->vel);
+		voice_note_on(v, args->vel);
 	}
 }
 
@@ -105,14 +148,12 @@ static int op_note(struct seq *s, struct seq_sm *m) {
 		// init
 		m->duration = args->dur;
 		m->op_state = O_STATE_WAIT;
-		DBG("note on %d (%d)\r\n", args->note, s->ticks);
 		seq_note_on(s, args);
 	}
 	m->duration -= 1;
 	if (m->duration == 0) {
 		// done
 		m->op_state = O_STATE_INIT;
-		DBG("note off (%d)\r\n", s->ticks);
 		seq_note_off(s, args);
 		return sizeof(struct note_args);
 	}
@@ -160,6 +201,36 @@ static void ssm_tick(struct seq *s, struct seq_sm *m) {
 	}
 }
 
+// stop the state machine, turn off a sounding note
+static void ssm_stop(struct seq *s, struct seq_sm *m) {
+	if (m->op_state == O_STATE_WAIT && m->prog[m->pc] == OP_NOTE) {
+		seq_note_off(s, (struct note_args *)&m->prog[m->pc]);
+	}
+	m->s_state = S_STATE_STOP;
+}
+
+// rewind the state machine to the start
+static void ssm_rewind(struct seq *s, struct seq_sm *m) {
+	m->pc = 0;
+	m->op_state = O_STATE_INIT;
+	s->ticks = 0;
+}
+
+// move the state machine toward a tick position (without playing notes)
+// Return 0 when the position is reached, else 1 (call again next block).
+static int ssm_seek(struct seq *s, struct seq_sm *m, uint32_t ticks) {
+	int state = m->s_state;
+	m->s_state = S_STATE_RUN;
+	s->mute = 1;
+	for (int i = 0; i < SEQ_SEEK_TICKS && (int32_t) (ticks - s->ticks) > 0; i++) {
+		s->ticks++;
+		ssm_tick(s, m);
+	}
+	s->mute = 0;
+	m->s_state = state;
+	return ((int32_t) (ticks - s->ticks) > 0) ? 1 : 0;
+}
+
 //-----------------------------------------------------------------------------
 
 static uint8_t metronome[] = {
@@ -176,7 +247,108 @@ static uint8_t metronome[] = {
 
 //-----------------------------------------------------------------------------
 
-void seq_exec(struct seq *s) {
+// set the tempo
+static void seq_set_tempo(struct seq *s, float bpm) {
+	s->beats_per_min = bpm;
+	s->secs_per_tick = SECS_PER_MIN / (bpm * (float)TICKS_PER_BEAT);
+}
+
+// return the number of ticks due by time t per the master clock position
+static uint32_t seq_clock_ticks(struct seq *s, uint32_t t) {
+	struct seq_clock *c = &s->clk;
+	// position relative to the last clock, don't run past the next clock
+	float frac = ((float)(int32_t) (t - c->t_clock) - c->t_frac) / c->period;
+	frac = clampf(frac, -1.f, 0.999f);
+	float pos = (float)(c->pos - 1) + frac;
+	if (pos < 0.f) {
+		return 0;
+	}
+	return (uint32_t) (pos * ((float)TICKS_PER_BEAT / (float)MIDI_CLOCKS_PER_BEAT)) + 1;
+}
+
+// apply a transport event to the sequencer
+static void seq_transport(struct seq *s, const struct seq_event *e) {
+	switch (e->op) {
+	case SEQ_EVENT_START:
+		ssm_stop(s, &s->m0);
+		ssm_rewind(s, &s->m0);
+		s->seeking = 0;
+		s->tick_error = 0.f;
+		s->m0.s_state = S_STATE_RUN;
+		break;
+	case SEQ_EVENT_STOP:
+		ssm_stop(s, &s->m0);
+		break;
+	case SEQ_EVENT_CONTINUE:
+		s->m0.s_state = S_STATE_RUN;
+		break;
+	case SEQ_EVENT_SEEK:
+		ssm_rewind(s, &s->m0);
+		s->seek = e->ticks;
+		s->seeking = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+// queue a transport event received at time t
+static void seq_queue(struct seq *s, int op, uint32_t ticks, uint32_t t) {
+	size_t wr = (s->q_wr + 1) & (SEQ_QUEUE_SIZE - 1);
+	if (wr == s->q_rd) {
+		// queue full, apply the oldest event now
+		DBG("seq queue full\r\n");
+		seq_transport(s, &s->queue[s->q_rd]);
+		s->q_rd = (s->q_rd + 1) & (SEQ_QUEUE_SIZE - 1);
+	}
+	struct seq_event *e = &s->queue[s->q_wr];
+	e->op = op;
+	e->ticks = ticks;
+	e->time = t;
+	s->q_wr = wr;
+}
+
+// t is the sample clock time of the audio block being rendered
+void seq_exec(struct seq *s, uint32_t t) {
+	struct seq_clock *c = &s->clk;
+
+	// apply the transport events that are due, delayed like the midi messages
+	while (s->q_rd != s->q_wr) {
+		struct seq_event *e = &s->queue[s->q_rd];
+		if ((int32_t) (t - MIDI_LATENCY - e->time) < 0) {
+			break;
+		}
+		seq_transport(s, e);
+		s->q_rd = (s->q_rd + 1) & (SEQ_QUEUE_SIZE - 1);
+	}
+
+	if (c->state != CLOCK_STATE_NONE && (int32_t) (t - c->t_last) > CLOCK_TIMEOUT) {
+		DBG("midi clock lost\r\n");
+		c->state = CLOCK_STATE_NONE;
+		s->tick_error = 0.f;
+	}
+
+	if (s->seeking) {
+		uint32_t ticks = s->seek;
+		if (c->state == CLOCK_STATE_LOCKED) {
+			// the master may have moved on while we were seeking
+			uint32_t due = seq_clock_ticks(s, t - MIDI_LATENCY);
+			ticks = ((int32_t) (due - ticks) > 0) ? due : ticks;
+		}
+		s->seeking = ssm_seek(s, &s->m0, ticks);
+		return;
+	}
+
+	if (c->state == CLOCK_STATE_LOCKED) {
+		// follow the master clock position, delayed like the midi messages
+		uint32_t due = seq_clock_ticks(s, t - MIDI_LATENCY);
+		while ((int32_t) (due - s->ticks) > 0) {
+			s->ticks++;
+			ssm_tick(s, &s->m0);
+		}
+		return;
+	}
+
 	// The desired BPM will generally not correspond to an integral number
 	// of audio blocks, so accumulate an error and tick when needed.
 	// ie- Bresenham style.
@@ -189,12 +361,100 @@ void seq_exec(struct seq *s) {
 	}
 }
 
+//-----------------------------------------------------------------------------
+// midi clock and transport
+
+// a midi clock was received at time t
+void seq_clock(struct seq *s, uint32_t t) {
+	struct seq_clock *c = &s->clk;
+	int32_t dt = (int32_t) (t - c->t_last);
+	c->t_last = t;
+
+	switch (c->state) {
+	case CLOCK_STATE_NONE:
+		c->state = CLOCK_STATE_FIRST;
+		return;
+	case CLOCK_STATE_FIRST:
+		if (dt < CLOCK_PERIOD(CLOCK_BPM_MAX) || dt > CLOCK_PERIOD(CLOCK_BPM_MIN)) {
+			// out of range, try again
+			return;
+		}
+		// start the pll from the first interval
+		c->state = CLOCK_STATE_LOCKED;
+		c->period = (float)dt;
+		c->t_clock = t;
+		c->t_frac = 0.f;
+		// carry on from the current (internally clocked) position
+		c->pos = (int32_t) ((s->ticks * MIDI_CLOCKS_PER_BEAT + TICKS_PER_BEAT - 1) / TICKS_PER_BEAT);
+		if (c->run) {
+			// this clock is at the previous position
+			c->pos -= 1;
+		}
+		DBG("midi clock locked\r\n");
+		break;
+	default:{
+			// phase error from the predicted time
+			float err = (float)(int32_t) (t - c->t_clock) - c->t_frac - c->period;
+			if (fabsf(err) > 0.5f * c->period) {
+				// tempo jump, restart the pll
+				c->state = CLOCK_STATE_FIRST;
+				return;
+			}
+			// advance the filtered clock time
+			float adv = c->t_frac + c->period + (CLOCK_KP * err);
+			uint32_t whole = (uint32_t) adv;
+			c->t_clock += whole;
+			c->t_frac = adv - (float)whole;
+			c->period = clampf(c->period + (CLOCK_KF * err), CLOCK_PERIOD(CLOCK_BPM_MAX), CLOCK_PERIOD(CLOCK_BPM_MIN));
+			break;
+		}
+	}
+
+	// the song position only moves while the sequencer is running
+	if (c->run) {
+		c->pos += 1;
+	}
+	seq_set_tempo(s, (SECS_PER_MIN * AUDIO_FS) / (c->period * (float)MIDI_CLOCKS_PER_BEAT));
+}
+
+// The transport messages update the clock song position when they are
+// received (t), and are applied to the sequencer MIDI_LATENCY later.
+
+// midi start: play from the beginning
+void seq_start(struct seq *s, uint32_t t) {
+	s->clk.pos = 0;
+	s->clk.run = 1;
+	seq_queue(s, SEQ_EVENT_START, 0, t);
+}
+
+// midi stop
+void seq_stop(struct seq *s, uint32_t t) {
+	s->clk.run = 0;
+	seq_queue(s, SEQ_EVENT_STOP, 0, t);
+}
+
+// midi continue: play from the current position
+void seq_continue(struct seq *s, uint32_t t) {
+	s->clk.run = 1;
+	seq_queue(s, SEQ_EVENT_CONTINUE, 0, t);
+}
+
+// midi song position pointer (1/16 notes since the start)
+void seq_song_position(struct seq *s, uint16_t spp, uint32_t t) {
+	if (s->clk.run) {
+		// only valid while stopped
+		return;
+	}
+	s->clk.pos = spp * MIDI_CLOCKS_PER_SPP;
+	seq_queue(s, SEQ_EVENT_SEEK, (uint32_t) spp * TICKS_PER_BEAT / 4, t);
+}
+
 //-----------------------------------------------------------------------------
 
 int seq_init(struct seq *s) {
 
-	s->beats_per_min = 120.f;
-	s->secs_per_tick = SECS_PER_MIN / (s->beats_per_min * (float)TICKS_PER_BEAT);
+	seq_set_tempo(s, 120.f);
+	s->clk.state = CLOCK_STATE_NONE;
 	DBG("secs_per_tick %08x\r\n", *(uint32_t *) & s->secs_per_tick);
 
 	float secs_per_block = SECS_PER_BLOCK;
@@ -202,6 +462,7 @@ int seq_init(struct seq *s) {
 
 	s->m0.prog = metronome;
 	s->m0.s_state = S_STATE_RUN;
+	s->clk.run = 1;
 
 	return 0;
 }
@@ -9,6 +9,7 @@ Sine Wave Oscillators
 #include <math.h>
 
 #include "ggm.h"
+#include "utils.h"
 
 #define DEBUG
 #include "logging.h"
@@ -170,20 +171,27 @@ void gwave_gen(struct gwave *osc, float *out, float *fm, size_t n) {
 	}
 }
 
-// Control the shape of the Goom wave.
+// Work out the goom wave shape constants.
 // duty = duty cycle 0..1
 // slope = slope 0..1
-void gwave_ctrl_shape(struct gwave *osc, float duty, float slope) {
+static void gwave_shape(float duty, float slope, uint32_t * tp, float *k0, float *k1) {
 	duty = clampf(duty, 0.f, 1.f);
 	slope = clampf(slope, 0.f, 1.f);
 	// This is where we transition from s0f0 to s1f1.
-	osc->tp = (uint32_t) (FULL_CYCLE * mapf(duty, TP_MIN, 0.5));
+	*tp = (uint32_t) (FULL_CYCLE * mapf(duty, TP_MIN, 0.5));
 	// Work out the portion of s0f0/s1f1 that is sloped.
 	float s = mapf(slope, SLOPE_MIN, 1.0);
 	// scaling constant for s0, map the slope to the LUT.
-	osc->k0 = 1.f / ((float)osc->tp * s);
+	*k0 = 1.f / ((float)*tp * s);
 	// scaling constant for s1, map the slope to the LUT.
-	osc->k1 = 1.f / ((FULL_CYCLE - (float)osc->tp) * s);
+	*k1 = 1.f / ((FULL_CYCLE - (float)*tp) * s);
+}
+
+// Control the shape of the Goom wave.
+// duty = duty cycle 0..1
+// slope = slope 0..1
+void gwave_ctrl_shape(struct gwave *osc, float duty, float slope) {
+	gwave_shape(duty, slope, &osc->tp, &osc->k0, &osc->k1);
 }
 
 void gwave_ctrl_frequency(struct gwave *osc, float freq) {
@@ -196,3 +204,116 @@ void gwave_init(struct gwave *osc) {
 }
 
 //-----------------------------------------------------------------------------
+/*
+
+Unison Goom Waves
+
+A stack of up to UNISON_MAX goom waves with a common shape. Each sub-oscillator
+is detuned from the base frequency and placed at a different point in the
+stereo field. This gives the thick "supersaw" sound using a single voice.
+
+The phases are held in arrays and all of them are stepped within the same
+sample loop. The Cortex-M4 has no floating point SIMD, so the win comes from
+keeping the per-voice envelope, filter and call overheads out of the stack.
+
+*/
+//-----------------------------------------------------------------------------
+
+void unison_gen(struct unison *osc, float *out_l, float *out_r, size_t n) {
+	uint32_t x[UNISON_MAX];
+	int m = osc->n;
+	// local copies of the phase positions
+	for (int j = 0; j < m; j++) {
+		x[j] = osc->x[j];
+	}
+	for (size_t i = 0; i < n; i++) {
+		float l = 0.f;
+		float r = 0.f;
+		for (int j = 0; j < m; j++) {
+			uint32_t ofs;
+			float y;
+			// what portion of the goom wave are we in?
+			if (x[j] < osc->tp) {
+				y = (float)x[j] * osc->k0;
+				ofs = 0;
+			} else {
+				y = (float)(x[j] - osc->tp) * osc->k1;
+				ofs = HALF_CYCLE;
+			}
+			y = (y > 1.f) ? 1.f : y;
+			y = cos_lookup((uint32_t) (y * (float)HALF_CYCLE) + ofs);
+			// accumulate the left/right outputs
+			l += y * osc->kl[j];
+			r += y * osc->kr[j];
+			// step the phase
+			x[j] += osc->xstep[j];
+		}
+		out_l[i] = l;
+		out_r[i] = r;
+	}
+	// update the phase positions
+	for (int j = 0; j < m; j++) {
+		osc->x[j] = x[j];
+	}
+}
+
+// Work out the per sub-oscillator phase steps.
+static void unison_ctrl_xstep(struct unison *osc) {
+	int m = osc->n;
+	for (int j = 0; j < m; j++) {
+		// spread the detuning evenly over -1..1 semitones
+		float d = (m == 1) ? 0.f : (2.f * (float)j / (float)(m - 1)) - 1.f;
+		float k = pow2(d * osc->detune * (1.f / 12.f));
+		osc->xstep[j] = (uint32_t) (osc->freq * k * FREQ_SCALE);
+	}
+}
+
+// Work out the per sub-oscillator left/right gains.
+static void unison_ctrl_gain(struct unison *osc) {
+	int m = osc->n;
+	// scale the output to keep the total power constant
+	float k = 1.f / sqrtf((float)m);
+	for (int j = 0; j < m; j++) {
+		// spread the sub-oscillators across the stereo field
+		float d = (m == 1) ? 0.f : (2.f * (float)j / (float)(m - 1)) - 1.f;
+		float pan = 0.5f + (0.5f * d * osc->spread);
+		// use sin/cos so that l*l + r*r = K (constant power)
+		pan *= PI / 2.f;
+		osc->kl[j] = k * cos_eval(pan);
+		osc->kr[j] = k * sin_eval(pan);
+	}
+}
+
+// Control the shape of the unison goom waves.
+// duty = duty cycle 0..1
+// slope = slope 0..1
+void unison_ctrl_shape(struct unison *osc, float duty, float slope) {
+	gwave_shape(duty, slope, &osc->tp, &osc->k0, &osc->k1);
+}
+
+// Control the unison stack.
+// n = number of sub-oscillators 1..UNISON_MAX
+// detune = maximum detuning 0..1 semitones
+// spread = stereo spread 0..1
+void unison_ctrl_detune(struct unison *osc, int n, float detune, float spread) {
+	osc->n = (n < 1) ? 1 : ((n > UNISON_MAX) ? UNISON_MAX : n);
+	osc->detune = clampf(detune, 0.f, 1.f);
+	osc->spread = clampf(spread, 0.f, 1.f);
+	unison_ctrl_xstep(osc);
+	unison_ctrl_gain(osc);
+}
+
+void unison_ctrl_frequency(struct unison *osc, float freq) {
+	osc->freq = freq;
+	unison_ctrl_xstep(osc);
+}
+
+void unison_init(struct unison *osc) {
+	// randomise the starting phases to avoid a phasing "whoosh" on note on
+	for (int j = 0; j < UNISON_MAX; j++) {
+		osc->x[j] = rand_uint32() << 1;
+	}
+	osc->n = 1;
+}
+
+//-----------------------------------------------------------------------------
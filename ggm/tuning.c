@@ -0,0 +1,180 @@
+//-----------------------------------------------------------------------------
+/*
+
+Tuning Tables
+
+Each patch has a table with the frequency of each MIDI note. Working out a
+note frequency (E.g. on a note on) is then a table lookup rather than a
+pow2() call, and the notes can be tuned to any scale.
+
+Pitch bend is applied as a ratio that is worked out when the pitch wheel
+changes, so a bent note is a lookup and a multiply.
+
+The table defaults to 12-TET (A4 = 440 Hz). Other tunings (E.g. from Scala)
+can be loaded with the MIDI Tuning Standard SysEx messages:
+
+* Bulk tuning dump: F0 7E <dev> 08 01 tt <name x16> [xx yy zz] x128 <chk> F7
+* Single note tuning change: F0 7F <dev> 08 02 tt ll [kk xx yy zz] x ll F7
+* Scale/octave tuning (1 byte): F0 7E <dev> 08 08 ff gg hh ss x12 F7
+
+We don't support tuning program selection, so the tuning program number (tt)
+is the MIDI channel the tuning applies to. A new tuning is used by the next
+note on.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include "ggm.h"
+#include "utils.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+// sysex ids
+#define SYSEX_NON_REALTIME 0x7e
+#define SYSEX_REALTIME 0x7f
+#define SYSEX_TUNING 0x08	// sub id 1: MIDI tuning standard
+#define SYSEX_TUNING_BULK_DUMP 0x01	// sub id 2: bulk tuning dump
+#define SYSEX_TUNING_NOTE_CHANGE 0x02	// sub id 2: single note tuning change
+#define SYSEX_TUNING_SCALE_OCTAVE 0x08	// sub id 2: scale/octave tuning (1 byte)
+
+#define BULK_DUMP_NAME_SIZE 16
+#define BULK_DUMP_SIZE (5 + BULK_DUMP_NAME_SIZE + (3 * TUNING_NOTES) + 1)
+
+//-----------------------------------------------------------------------------
+
+// set the tuning of a note from the MTS 3 byte frequency format
+static void tuning_set_mts(struct tuning *t, uint8_t note, const uint8_t *x) {
+	if (x[0] == 0x7f && x[1] == 0x7f && x[2] == 0x7f) {
+		// no change
+		return;
+	}
+	// semitone + 14 bit fraction of a semitone
+	float semitone = (float)x[0] + ((float)((x[1] << 7) | x[2]) * (1.f / 16384.f));
+	t->freq[note & (TUNING_NOTES - 1)] = midi_to_frequency(semitone);
+}
+
+// return the tuning table for a tuning program number (the MIDI channel)
+static struct tuning *tuning_program(struct ggm *s, uint8_t tt) {
+	if (tt >= NUM_CHANNELS) {
+		DBG("tuning program %d not supported\r\n", tt);
+		return NULL;
+	}
+	return &s->patches[tt].tuning;
+}
+
+//-----------------------------------------------------------------------------
+
+// bulk tuning dump
+static void tuning_bulk_dump(struct ggm *s, const uint8_t *buf, size_t n) {
+	if (n != BULK_DUMP_SIZE) {
+		DBG("bad bulk tuning dump size %d\r\n", n);
+		return;
+	}
+	// checksum of everything up to the checksum byte
+	uint8_t chk = 0;
+	for (size_t i = 0; i < n - 1; i++) {
+		chk ^= buf[i];
+	}
+	if ((chk & 0x7f) != buf[n - 1]) {
+		DBG("bad bulk tuning dump checksum\r\n");
+		return;
+	}
+	struct tuning *t = tuning_program(s, buf[4]);
+	if (t == NULL) {
+		return;
+	}
+	const uint8_t *x = &buf[5 + BULK_DUMP_NAME_SIZE];
+	for (unsigned int i = 0; i < TUNING_NOTES; i++) {
+		tuning_set_mts(t, i, &x[3 * i]);
+	}
+}
+
+// single note tuning change
+static void tuning_note_change(struct ggm *s, const uint8_t *buf, size_t n) {
+	if (n < 6) {
+		return;
+	}
+	struct tuning *t = tuning_program(s, buf[4]);
+	if (t == NULL) {
+		return;
+	}
+	size_t count = buf[5];
+	const uint8_t *x = &buf[6];
+	if (n < 6 + (4 * count)) {
+		DBG("short note tuning change\r\n");
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		tuning_set_mts(t, x[0], &x[1]);
+		x += 4;
+	}
+}
+
+// scale/octave tuning, 1 byte form (-64..63 cents per note of the scale)
+static void tuning_scale_octave(struct ggm *s, const uint8_t *buf, size_t n) {
+	if (n != 4 + 3 + 12) {
+		DBG("bad scale/octave tuning size %d\r\n", n);
+		return;
+	}
+	// channel bitmap: ff = 15..14, gg = 13..7, hh = 6..0
+	uint32_t chans = (buf[4] << 14) | (buf[5] << 7) | buf[6];
+	const uint8_t *ss = &buf[7];
+	for (int c = 0; c < NUM_CHANNELS; c++) {
+		if ((chans & (1U << c)) == 0) {
+			continue;
+		}
+		struct tuning *t = &s->patches[c].tuning;
+		for (unsigned int i = 0; i < TUNING_NOTES; i++) {
+			float cents = (float)ss[i % 12] - 64.f;
+			t->freq[i] = midi_to_frequency((float)i + (cents * (1.f / 100.f)));
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// handle a sysex message (without the F0/F7), return !=0 if it isn't a tuning message
+int tuning_sysex(struct ggm *s, const uint8_t *buf, size_t n) {
+	if (n < 4 || buf[2] != SYSEX_TUNING) {
+		return -1;
+	}
+	if (buf[0] != SYSEX_NON_REALTIME && buf[0] != SYSEX_REALTIME) {
+		return -1;
+	}
+	// ignore the device id
+	switch (buf[3]) {
+	case SYSEX_TUNING_BULK_DUMP:
+		tuning_bulk_dump(s, buf, n);
+		break;
+	case SYSEX_TUNING_NOTE_CHANGE:
+		tuning_note_change(s, buf, n);
+		break;
+	case SYSEX_TUNING_SCALE_OCTAVE:
+		tuning_scale_octave(s, buf, n);
+		break;
+	default:
+		DBG("unsupported tuning message %02x\r\n", buf[3]);
+		break;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// set the pitch bend (semitones)
+void tuning_ctrl_bend(struct tuning *t, float bend) {
+	t->bend = pow2(bend * (1.f / 12.f));
+}
+
+// set 12-TET tuning with no pitch bend
+void tuning_init(struct tuning *t) {
+	for (unsigned int i = 0; i < TUNING_NOTES; i++) {
+		t->freq[i] = midi_to_frequency((float)i);
+	}
+	t->bend = 1.f;
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,202 @@
+//-----------------------------------------------------------------------------
+/*
+
+USB Device
+
+A composite USB MIDI + USB Audio (class 1.0) device:
+
+interface 0: audio control (synthesizer input terminal -> usb streaming output terminal)
+interface 1: midi streaming, bulk OUT endpoint (host to synth)
+interface 2: audio streaming, isochronous asynchronous IN endpoint (synth to host)
+
+The audio control interface owns both streaming interfaces. The descriptors
+and the usb device callbacks live here, the streaming is in usbmidi.c and
+usbaudio.c.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include "ggm.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+#define USB_VID 0x1209		// pid.codes
+#define USB_PID 0x0001		// pid.codes test PID
+
+//-----------------------------------------------------------------------------
+// descriptors
+
+static const uint8_t dev_desc[] = {
+	18,			// bLength
+	1,			// bDescriptorType (device)
+	0x00, 0x02,		// bcdUSB 2.00
+	0,			// bDeviceClass (per interface)
+	0,			// bDeviceSubClass
+	0,			// bDeviceProtocol
+	USBD_EP0_SIZE,		// bMaxPacketSize0
+	USB_VID & 0xff, USB_VID >> 8,	// idVendor
+	USB_PID & 0xff, USB_PID >> 8,	// idProduct
+	0x00, 0x01,		// bcdDevice 1.00
+	0,			// iManufacturer
+	1,			// iProduct
+	0,			// iSerialNumber
+	1,			// bNumConfigurations
+};
+
+#define CFG_DESC_SIZE 161	// total configuration descriptor length
+#define AC_DESC_SIZE 31		// total class specific audio control length
+#define MS_DESC_SIZE 51		// total class specific midi streaming length
+
+// audio terminal ids
+#define AUDIO_IT_SYNTH 1	// synthesizer input terminal
+#define AUDIO_OT_USB 2		// usb streaming output terminal
+
+static const uint8_t cfg_desc[] = {
+	// configuration
+	9,			// bLength
+	2,			// bDescriptorType (configuration)
+	CFG_DESC_SIZE & 0xff, CFG_DESC_SIZE >> 8,	// wTotalLength
+	3,			// bNumInterfaces
+	1,			// bConfigurationValue
+	0,			// iConfiguration
+	0x80,			// bmAttributes (bus powered)
+	50,			// bMaxPower (100 mA)
+	// audio control interface
+	9, 4, USB_IF_AUDIO_CONTROL, 0, 0,	// bLength, INTERFACE, bInterfaceNumber, bAlternateSetting, bNumEndpoints
+	1, 1, 0, 0,		// AUDIO, AUDIOCONTROL, bInterfaceProtocol, iInterface
+	// class specific audio control header
+	10, 0x24, 1,		// bLength, CS_INTERFACE, HEADER
+	0x00, 0x01,		// bcdADC 1.00
+	AC_DESC_SIZE, 0,	// wTotalLength
+	2, USB_IF_MIDI, USB_IF_AUDIO,	// bInCollection, baInterfaceNr(1), baInterfaceNr(2)
+	// input terminal: synthesizer
+	12, 0x24, 2, AUDIO_IT_SYNTH,	// bLength, CS_INTERFACE, INPUT_TERMINAL, bTerminalID
+	0x13, 0x07,		// wTerminalType (synthesizer)
+	0, 2, 0x03, 0x00,	// bAssocTerminal, bNrChannels, wChannelConfig (left, right)
+	0, 0,			// iChannelNames, iTerminal
+	// output terminal: usb streaming
+	9, 0x24, 3, AUDIO_OT_USB,	// bLength, CS_INTERFACE, OUTPUT_TERMINAL, bTerminalID
+	0x01, 0x01,		// wTerminalType (usb streaming)
+	0, AUDIO_IT_SYNTH, 0,	// bAssocTerminal, bSourceID, iTerminal
+	// midi streaming interface
+	9, 4, USB_IF_MIDI, 0, 1,	// bLength, INTERFACE, bInterfaceNumber, bAlternateSetting, bNumEndpoints
+	1, 3, 0, 0,		// AUDIO, MIDISTREAMING, bInterfaceProtocol, iInterface
+	// class specific midi streaming header
+	7, 0x24, 1,		// bLength, CS_INTERFACE, MS_HEADER
+	0x00, 0x01,		// bcdMSC 1.00
+	MS_DESC_SIZE & 0xff, MS_DESC_SIZE >> 8,	// wTotalLength
+	// midi in jack (embedded, id 1): host data into the synth
+	6, 0x24, 2, 1, 1, 0,	// bLength, CS_INTERFACE, MIDI_IN_JACK, EMBEDDED, bJackID, iJack
+	// midi in jack (external, id 2)
+	6, 0x24, 2, 2, 2, 0,	// bLength, CS_INTERFACE, MIDI_IN_JACK, EXTERNAL, bJackID, iJack
+	// midi out jack (embedded, id 3), source: external in jack 2
+	9, 0x24, 3, 1, 3, 1, 2, 1, 0,	// bLength, CS_INTERFACE, MIDI_OUT_JACK, EMBEDDED, bJackID, bNrInputPins, baSourceID, baSourcePin, iJack
+	// midi out jack (external, id 4), source: embedded in jack 1
+	9, 0x24, 3, 2, 4, 1, 1, 1, 0,	// bLength, CS_INTERFACE, MIDI_OUT_JACK, EXTERNAL, bJackID, bNrInputPins, baSourceID, baSourcePin, iJack
+	// bulk out endpoint
+	9, 5, USB_EP_MIDI_OUT, USBD_EP_BULK,	// bLength, ENDPOINT, bEndpointAddress, bmAttributes
+	USB_MIDI_EP_SIZE, 0,	// wMaxPacketSize
+	0, 0, 0,		// bInterval, bRefresh, bSynchAddress
+	// class specific bulk out endpoint
+	5, 0x25, 1, 1, 1,	// bLength, CS_ENDPOINT, MS_GENERAL, bNumEmbMIDIJack, baAssocJackID (in jack 1)
+	// audio streaming interface, alternate 0: zero bandwidth
+	9, 4, USB_IF_AUDIO, 0, 0,	// bLength, INTERFACE, bInterfaceNumber, bAlternateSetting, bNumEndpoints
+	1, 2, 0, 0,		// AUDIO, AUDIOSTREAMING, bInterfaceProtocol, iInterface
+	// audio streaming interface, alternate 1: streaming
+	9, 4, USB_IF_AUDIO, 1, 1,	// bLength, INTERFACE, bInterfaceNumber, bAlternateSetting, bNumEndpoints
+	1, 2, 0, 0,		// AUDIO, AUDIOSTREAMING, bInterfaceProtocol, iInterface
+	// class specific audio streaming general
+	7, 0x24, 1, AUDIO_OT_USB,	// bLength, CS_INTERFACE, AS_GENERAL, bTerminalLink
+	1, 0x01, 0x00,		// bDelay, wFormatTag (PCM)
+	// format type I: 2 channels, 16 bits, 1 sample rate
+	11, 0x24, 2, 1,		// bLength, CS_INTERFACE, FORMAT_TYPE, FORMAT_TYPE_I
+	2, 2, 16, 1,		// bNrChannels, bSubframeSize, bBitResolution, bSamFreqType
+	USB_AUDIO_RATE & 0xff, (USB_AUDIO_RATE >> 8) & 0xff, USB_AUDIO_RATE >> 16,	// tSamFreq
+	// isochronous asynchronous in endpoint
+	9, 5, USB_EP_AUDIO_IN, USBD_EP_ISOC | (1U << 2),	// bLength, ENDPOINT, bEndpointAddress, bmAttributes (async)
+	USB_AUDIO_EP_SIZE & 0xff, USB_AUDIO_EP_SIZE >> 8,	// wMaxPacketSize
+	1, 0, 0,		// bInterval, bRefresh, bSynchAddress
+	// class specific isochronous endpoint
+	7, 0x25, 1,		// bLength, CS_ENDPOINT, EP_GENERAL
+	0x01, 0, 0, 0,		// bmAttributes (sampling frequency control), bLockDelayUnits, wLockDelay
+};
+
+_Static_assert(sizeof(cfg_desc) == CFG_DESC_SIZE, "bad configuration descriptor length");
+
+static const uint8_t str_lang[] = {
+	4, 3, 0x09, 0x04,	// english (US)
+};
+
+static const uint8_t str_product[] = {
+	22, 3,
+	'G', 0, 'o', 0, 'o', 0, 'G', 0, 'o', 0, 'o', 0, 'M', 0, 'u', 0, 'c', 0, 'k', 0,
+};
+
+static const uint8_t *const str_desc[] = {
+	str_lang,
+	str_product,
+};
+
+//-----------------------------------------------------------------------------
+// usb callbacks (called from the usb isr)
+
+static void usb_configure(struct usbd_drv *usbd, int config) {
+	usbmidi_configure(usbd, config);
+	usbaudio_configure(usbd, config);
+}
+
+static int usb_set_interface(struct usbd_drv *usbd, int iface, int alt) {
+	if (iface == USB_IF_AUDIO) {
+		return usbaudio_set_interface(usbd, alt);
+	}
+	return (alt == 0) ? 0 : -1;
+}
+
+static int usb_setup(struct usbd_drv *usbd, const struct usbd_setup *req) {
+	return usbaudio_setup(usbd, req);
+}
+
+static void usb_rx(struct usbd_drv *usbd, int ep, size_t n) {
+	if (ep == USB_EP_MIDI_OUT) {
+		usbmidi_rx(usbd, ep, n);
+	}
+}
+
+static void usb_tx(struct usbd_drv *usbd, int ep) {
+	if (ep == (USB_EP_AUDIO_IN & 0x7f)) {
+		usbaudio_tx(usbd, ep);
+	}
+}
+
+static void usb_sof(struct usbd_drv *usbd) {
+	usbmidi_sof(usbd);
+	usbaudio_sof(usbd);
+}
+
+static struct usbd_cfg usb_cfg = {
+	.dev_desc = dev_desc,
+	.cfg_desc = cfg_desc,
+	.str_desc = str_desc,
+	.num_str = sizeof(str_desc) / sizeof(str_desc[0]),
+	.rx_fifo = 128,
+	.tx_fifo = {16, 0, (USB_AUDIO_EP_SIZE + 3) >> 2, 0},
+	.configure = usb_configure,
+	.set_interface = usb_set_interface,
+	.setup = usb_setup,
+	.rx = usb_rx,
+	.tx = usb_tx,
+	.sof = usb_sof,
+};
+
+//-----------------------------------------------------------------------------
+
+int usb_init(struct usbd_drv *usbd, struct audio_drv *audio) {
+	usbmidi_init(audio);
+	usbaudio_init(audio);
+	return usbd_init(usbd, &usb_cfg);
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,173 @@
+//-----------------------------------------------------------------------------
+/*
+
+USB Audio Streaming
+
+Streams the stereo output mix to the host on an isochronous asynchronous IN
+endpoint (16-bit stereo, nominally 44.1 kHz).
+
+The sample clock is the I2S clock (AUDIO_FS), not the usb frame clock, so the
+number of samples per usb frame is not fixed. Each packet carries the samples
+played since the previous packet (E.g. 44 or 45 samples), so the packet sizes
+follow the sample clock and the host measures the actual rate from the data.
+This is the asynchronous source equivalent of a feedback endpoint, which is
+only used for host to device streams.
+
+The I2S buffer halves are rewritten at some point within each block, so the
+packets can't safely be read from them. Instead the audio handler writes each
+rendered block to a ring buffer indexed by sample clock time, and the packets
+are written from the ring straight into the endpoint tx FIFO.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "ggm.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+#define USBAUDIO_RING (4U * AUDIO_BLOCK_SIZE)	// ring buffer size (stereo frames)
+#define USBAUDIO_NOMINAL 44	// nominal frames per packet
+#define USBAUDIO_MIN (USBAUDIO_NOMINAL - 1)	// minimum frames per packet
+#define USBAUDIO_MAX USB_AUDIO_FRAMES_MAX	// maximum frames per packet
+#define USBAUDIO_DELAY 8	// stream delay behind the sample clock (frames)
+#define USBAUDIO_RESYNC (4 * USBAUDIO_MAX)	// restart the stream if it gets this far behind
+
+_Static_assert((USBAUDIO_RING & (USBAUDIO_RING - 1)) == 0, "USBAUDIO_RING must be a power of 2");
+_Static_assert(USBAUDIO_RING >= (2 * AUDIO_BLOCK_SIZE) + USBAUDIO_RESYNC, "the ring is too small for the i2s buffer and the stream delay");
+
+// class specific requests
+#define UAC_SET_CUR 0x01U
+#define UAC_GET_CUR 0x81U
+#define UAC_SAMPLING_FREQ_CONTROL 0x01U
+
+//-----------------------------------------------------------------------------
+
+static struct audio_drv *usbaudio_audio;
+static uint32_t usbaudio_ring[USBAUDIO_RING];	// rendered samples (16-bit left/right pairs)
+static uint32_t usbaudio_rd;	// sample clock time of the next frame to send
+static int usbaudio_streaming;	// alternate setting 1 is selected
+static int usbaudio_sync;	// usbaudio_rd follows the sample clock
+static int usbaudio_busy;	// a packet is queued on the endpoint
+
+// queue the next packet
+static void usbaudio_send(struct usbd_drv *usbd) {
+	uint32_t end = audio_time(usbaudio_audio) - USBAUDIO_DELAY;
+	int32_t k = (int32_t) (end - usbaudio_rd);
+	if (!usbaudio_sync || k < 0 || k > USBAUDIO_RESYNC) {
+		// (re)start the stream a packet behind the sample clock
+		usbaudio_rd = end - USBAUDIO_NOMINAL;
+		usbaudio_sync = 1;
+		k = USBAUDIO_NOMINAL;
+	}
+	// the packet size can change by a frame from the nominal size
+	k = (k < USBAUDIO_MIN) ? USBAUDIO_MIN : k;
+	k = (k > USBAUDIO_MAX) ? USBAUDIO_MAX : k;
+	// the packet may wrap around the end of the ring
+	size_t i = usbaudio_rd & (USBAUDIO_RING - 1);
+	size_t n0 = USBAUDIO_RING - i;
+	n0 = (n0 < (size_t)k) ? n0 : (size_t)k;
+	usbd_tx2(usbd, USB_EP_AUDIO_IN & 0x7f, (const uint8_t *)&usbaudio_ring[i], n0 * sizeof(uint32_t), (const uint8_t *)usbaudio_ring, (k - n0) * sizeof(uint32_t));
+	usbaudio_rd += k;
+	usbaudio_busy = 1;
+}
+
+//-----------------------------------------------------------------------------
+// usb callbacks (called from the usb isr)
+
+void usbaudio_configure(struct usbd_drv *usbd, int config) {
+	if (usbaudio_streaming) {
+		usbd_ep_close(usbd, USB_EP_AUDIO_IN);
+	}
+	usbaudio_streaming = 0;
+	usbaudio_busy = 0;
+}
+
+int usbaudio_set_interface(struct usbd_drv *usbd, int alt) {
+	switch (alt) {
+	case 0:
+		// zero bandwidth
+		if (usbaudio_streaming) {
+			usbd_ep_close(usbd, USB_EP_AUDIO_IN);
+		}
+		usbaudio_streaming = 0;
+		break;
+	case 1:
+		if (!usbaudio_streaming) {
+			usbd_ep_open(usbd, USB_EP_AUDIO_IN, USBD_EP_ISOC, USB_AUDIO_EP_SIZE);
+		}
+		usbaudio_streaming = 1;
+		usbaudio_sync = 0;
+		break;
+	default:
+		return -1;
+	}
+	usbaudio_busy = 0;
+	return 0;
+}
+
+// sampling frequency requests on the streaming endpoint
+int usbaudio_setup(struct usbd_drv *usbd, const struct usbd_setup *req) {
+	if (USBD_REQ_TYPE(req->bmRequestType) != USBD_REQ_CLASS ||
+	    USBD_REQ_RECIPIENT(req->bmRequestType) != USBD_REQ_ENDPOINT ||
+	    (req->wIndex & 0xff) != USB_EP_AUDIO_IN || (req->wValue >> 8) != UAC_SAMPLING_FREQ_CONTROL) {
+		return -1;
+	}
+	switch (req->bRequest) {
+	case UAC_SET_CUR:
+		// the rate is fixed, accept and ignore it
+		return usbd_ctrl_rx(usbd);
+	case UAC_GET_CUR:
+		usbd->ctrl_buf[0] = USB_AUDIO_RATE & 0xff;
+		usbd->ctrl_buf[1] = (USB_AUDIO_RATE >> 8) & 0xff;
+		usbd->ctrl_buf[2] = USB_AUDIO_RATE >> 16;
+		usbd_ctrl_tx(usbd, usbd->ctrl_buf, 3);
+		return 0;
+	default:
+		break;
+	}
+	return -1;
+}
+
+void usbaudio_tx(struct usbd_drv *usbd, int ep) {
+	usbaudio_busy = 0;
+	if (usbaudio_streaming) {
+		usbaudio_send(usbd);
+	}
+}
+
+void usbaudio_sof(struct usbd_drv *usbd) {
+	// start the stream (or restart it after a dropped packet)
+	if (usbaudio_streaming && !usbaudio_busy) {
+		usbaudio_send(usbd);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// write a block of rendered samples (16-bit left/right pairs) to the ring
+// t: sample clock time of the block
+void usbaudio_wr(uint32_t t, const int16_t * buf, size_t n) {
+	size_t i = t & (USBAUDIO_RING - 1);
+	size_t n0 = USBAUDIO_RING - i;
+	n0 = (n0 < n) ? n0 : n;
+	memcpy(&usbaudio_ring[i], buf, n0 * sizeof(uint32_t));
+	memcpy(usbaudio_ring, &buf[2 * n0], (n - n0) * sizeof(uint32_t));
+}
+
+//-----------------------------------------------------------------------------
+
+void usbaudio_init(struct audio_drv *audio) {
+	usbaudio_audio = audio;
+	memset(usbaudio_ring, 0, sizeof(usbaudio_ring));
+	usbaudio_rd = 0;
+	usbaudio_streaming = 0;
+	usbaudio_sync = 0;
+	usbaudio_busy = 0;
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,111 @@
+//-----------------------------------------------------------------------------
+/*
+
+USB MIDI Device
+
+The USB MIDI 1.0 streaming interface of the usb device. It has a single
+MIDI OUT endpoint (host to synth).
+
+USB MIDI packets are 4 bytes: a cable number/code index byte followed by up
+to 3 MIDI bytes. The received packets are collected into a batch and the
+batch is stamped with the sample clock time the first packet arrived. At each
+start of frame (1 ms) a non-empty batch is passed to the event loop as a midi
+event. The event loop parses the batch into the midi_rx1 queue and releases
+it. Batching per frame keeps the event queue traffic at one event per
+millisecond regardless of the MIDI data rate.
+
+If all the batches are in use the OUT endpoint is left unarmed, so the host
+gets NAKs until the event loop catches up rather than us dropping data.
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "ggm.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+#define USBMIDI_PKTS (USB_MIDI_EP_SIZE >> 2)	// usb midi packets per usb packet
+
+//-----------------------------------------------------------------------------
+
+static struct audio_drv *usbmidi_audio;
+static struct usbmidi_batch usbmidi_batch[USBMIDI_BATCHES];
+static size_t usbmidi_wr;	// batch being filled
+static volatile int usbmidi_free;	// batches not owned by the event loop
+static int usbmidi_rx_busy;	// the OUT endpoint is armed
+static int usbmidi_config;	// the device is configured
+static uint32_t usbmidi_buf[USBMIDI_PKTS];	// usb packet buffer
+
+// arm the OUT endpoint if the current batch has room for a usb packet
+static void usbmidi_arm(struct usbd_drv *usbd) {
+	struct usbmidi_batch *b = &usbmidi_batch[usbmidi_wr];
+	if (!usbmidi_config || usbmidi_rx_busy || (USBMIDI_BATCH_SIZE - b->n) < USBMIDI_PKTS) {
+		return;
+	}
+	usbmidi_rx_busy = 1;
+	usbd_rx(usbd, USB_EP_MIDI_OUT, (uint8_t *) usbmidi_buf);
+}
+
+//-----------------------------------------------------------------------------
+// usb callbacks (called from the usb isr)
+
+void usbmidi_configure(struct usbd_drv *usbd, int config) {
+	usbmidi_config = config;
+	usbmidi_rx_busy = 0;
+	if (config) {
+		usbd_ep_open(usbd, USB_EP_MIDI_OUT, USBD_EP_BULK, USB_MIDI_EP_SIZE);
+		usbmidi_arm(usbd);
+	}
+}
+
+void usbmidi_rx(struct usbd_drv *usbd, int ep, size_t n) {
+	struct usbmidi_batch *b = &usbmidi_batch[usbmidi_wr];
+	size_t k = n >> 2;
+	usbmidi_rx_busy = 0;
+	if (k) {
+		if (b->n == 0) {
+			b->time = audio_time(usbmidi_audio);
+		}
+		memcpy(&b->pkt[b->n], usbmidi_buf, k * sizeof(uint32_t));
+		b->n += k;
+	}
+	usbmidi_arm(usbd);
+}
+
+void usbmidi_sof(struct usbd_drv *usbd) {
+	struct usbmidi_batch *b = &usbmidi_batch[usbmidi_wr];
+	// pass the batch to the event loop if there is a free batch to replace it
+	if (b->n && usbmidi_free > 1 && event_wr(EVENT_TYPE_MIDI, b) == 0) {
+		usbmidi_free -= 1;
+		usbmidi_wr = (usbmidi_wr + 1) & (USBMIDI_BATCHES - 1);
+		usbmidi_batch[usbmidi_wr].n = 0;
+	}
+	usbmidi_arm(usbd);
+}
+
+//-----------------------------------------------------------------------------
+
+// the event loop is done with a batch
+void usbmidi_release(struct usbmidi_batch *b) {
+	uint32_t saved = disable_irq();
+	usbmidi_free += 1;
+	restore_irq(saved);
+}
+
+//-----------------------------------------------------------------------------
+
+void usbmidi_init(struct audio_drv *audio) {
+	usbmidi_audio = audio;
+	memset(usbmidi_batch, 0, sizeof(usbmidi_batch));
+	usbmidi_wr = 0;
+	usbmidi_free = USBMIDI_BATCHES;
+	usbmidi_rx_busy = 0;
+	usbmidi_config = 0;
+}
+
+//-----------------------------------------------------------------------------
@@ -170,6 +170,20 @@ void dma_isr(struct dma_drv *dma) {
 
 //-----------------------------------------------------------------------------
 
+// start a (non-circular) memory to memory transfer of nitems
+// The transfer complete callback is called when it is done.
+void dma_m2m(struct dma_drv *dma, uint32_t dst, uint32_t src, uint32_t nitems) {
+	dma->sregs->PAR = src;
+	dma->sregs->M0AR = dst;
+	dma->sregs->NDTR = nitems;
+	dma_clr_irq_flags(dma, DMA_IRQ_ALL);
+	// the isr disables the transfer complete interrupt for non-circular transfers
+	dma->sregs->CR |= DMA_SxCR_TCIE;
+	dma_enable(dma);
+}
+
+//-----------------------------------------------------------------------------
+
 // define the non-reserved register bits
 #define DMA_SxCR_MASK   0x0fefffffU
 #define DMA_SxNDTR_MASK 0x0000ffffU
@@ -225,7 +239,13 @@ int dma_init(struct dma_drv *dma, struct dma_cfg *cfg) {
 		dma->sregs->PAR = cfg->dst;
 		dma->sregs->M0AR = cfg->src;
 	} else if (cfg->dir == DMA_DIR_M2M) {
-		// TODO memory to memory
+		// memory to memory (only on DMA2)
+		if (cfg->controller != DMA2_BASE) {
+			rc = -1;
+			goto exit;
+		}
+		dma->sregs->PAR = cfg->src;
+		dma->sregs->M0AR = cfg->dst;
 	} else {
 		rc = -1;
 		goto exit;
@@ -123,6 +123,7 @@ static inline void dma_enable(struct dma_drv *dma) {
 int dma_init(struct dma_drv *dma, struct dma_cfg *cfg);
 int dma_disable(struct dma_drv *dma);
 void dma_isr(struct dma_drv *dma);
+void dma_m2m(struct dma_drv *dma, uint32_t dst, uint32_t src, uint32_t nitems);
 
 //-----------------------------------------------------------------------------
 
@@ -0,0 +1,190 @@
+//-----------------------------------------------------------------------------
+/*
+
+SDRAM Driver (FMC)
+
+Sets up an SDRAM on FMC bank 1 and provides a queue of memory to memory DMA
+copies between the SDRAM and internal SRAM. The CPU can access the SDRAM
+directly, but it is slow, so bulk data should be staged through SRAM using
+sdram_copy() and sdram_wait().
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "stm32f4_soc.h"
+#include "utils.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+// SDCMR commands
+#define SDRAM_CMD_CLK_ENABLE 1U
+#define SDRAM_CMD_PALL 2U
+#define SDRAM_CMD_AUTOREFRESH 3U
+#define SDRAM_CMD_LOAD_MODE 4U
+
+#define SDCMR_CTB1 (1U << 4)
+#define SDCMR_NRFS(x) ((((x) - 1) & 15) << 5)
+#define SDCMR_MRD(x) (((x) & 0x1fff) << 9)
+
+//-----------------------------------------------------------------------------
+
+// send a command to the sdram, wait for it to complete
+static int sdram_cmd(uint32_t cmd) {
+	uint32_t timeout = SystemCoreClock / 9600U;
+	uint32_t count = 0;
+	FMC_Bank5_6->SDCMR = cmd | SDCMR_CTB1;
+	while (FMC_Bank5_6->SDSR & FMC_SDSR_BUSY) {
+		if (count > timeout) {
+			return -1;
+		}
+		count += 1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// dma copies
+
+// start the next queued copy (called with interrupts disabled or from the isr)
+static void sdram_next(struct sdram_drv *sdram) {
+	if (sdram->rd == sdram->wr) {
+		sdram->busy = 0;
+		return;
+	}
+	struct sdram_xfer *x = &sdram->queue[sdram->rd];
+	sdram->rd = (sdram->rd + 1) & (SDRAM_QUEUE_SIZE - 1);
+	sdram->busy = 1;
+	dma_m2m(&sdram->dma, x->dst, x->src, x->n);
+}
+
+static void sdram_err_callback(struct dma_drv *dma, uint32_t errors) {
+	struct sdram_drv *sdram = (struct sdram_drv *)dma;
+	sdram->errors |= errors;
+	// A FIFO error doesn't stop the transfer, its transfer complete will
+	// still move the queue along.
+	if ((errors & (DMA_IRQ_TEIF | DMA_IRQ_DMEIF)) == 0) {
+		return;
+	}
+	// The transfer has failed. Make sure the stream has stopped and won't
+	// also signal a transfer complete, then keep the queue moving.
+	// (dma_m2m() clears the stale flags when it starts the next copy)
+	dma_disable(dma);
+	dma->sregs->CR &= ~DMA_SxCR_TCIE;
+	sdram_next(sdram);
+}
+
+static void sdram_tc_callback(struct dma_drv *dma, int idx) {
+	sdram_next((struct sdram_drv *)dma);
+}
+
+// queue a copy of n 32-bit words, return 0 on success
+int sdram_copy(struct sdram_drv *sdram, void *dst, const void *src, size_t n) {
+	uint32_t saved;
+	size_t wr;
+	if (n == 0) {
+		return 0;
+	}
+	if (n > 0xffff) {
+		return -1;
+	}
+	// wait for space in the queue
+	while (1) {
+		saved = disable_irq();
+		wr = (sdram->wr + 1) & (SDRAM_QUEUE_SIZE - 1);
+		if (wr != sdram->rd) {
+			break;
+		}
+		restore_irq(saved);
+	}
+	struct sdram_xfer *x = &sdram->queue[sdram->wr];
+	x->dst = (uint32_t) dst;
+	x->src = (uint32_t) src;
+	x->n = n;
+	sdram->wr = wr;
+	if (!sdram->busy) {
+		sdram_next(sdram);
+	}
+	restore_irq(saved);
+	return 0;
+}
+
+// wait for all queued copies to complete
+void sdram_wait(struct sdram_drv *sdram) {
+	while (sdram->busy) ;
+}
+
+// Called from DMA2_StreamX_IRQHandler()
+void sdram_isr(struct sdram_drv *sdram) {
+	dma_isr(&sdram->dma);
+}
+
+//-----------------------------------------------------------------------------
+
+int sdram_init(struct sdram_drv *sdram, struct sdram_cfg *cfg) {
+	int rc = 0;
+
+	memset(sdram, 0, sizeof(struct sdram_drv));
+
+	// enable the FMC clock
+	RCC->AHB3ENR |= RCC_AHB3ENR_FMCEN;
+
+	// setup the controller
+	FMC_Bank5_6->SDCR[0] = cfg->sdcr;
+	FMC_Bank5_6->SDTR[0] = cfg->sdtr;
+
+	// SDRAM initialisation sequence
+	rc = sdram_cmd(SDRAM_CMD_CLK_ENABLE);
+	if (rc != 0) {
+		goto exit;
+	}
+	// wait for the power up delay
+	udelay(200);
+	rc = sdram_cmd(SDRAM_CMD_PALL);
+	if (rc != 0) {
+		goto exit;
+	}
+	rc = sdram_cmd(SDRAM_CMD_AUTOREFRESH | SDCMR_NRFS(cfg->nrfs));
+	if (rc != 0) {
+		goto exit;
+	}
+	rc = sdram_cmd(SDRAM_CMD_LOAD_MODE | SDCMR_MRD(cfg->mode));
+	if (rc != 0) {
+		goto exit;
+	}
+	// set the refresh rate
+	FMC_Bank5_6->SDRTR = (cfg->refresh & 0x1fff) << 1;
+	sdram->base = (void *)SDRAM_BANK1_BASE;
+	sdram->size = cfg->size;
+
+	// setup the memory to memory dma
+	struct dma_cfg dma_cfg = {
+		.controller = DMA2_BASE,
+		.stream = cfg->stream,
+		.chsel = DMA_CHSEL(0),
+		.pl = DMA_PL(1),
+		.dir = DMA_DIR_M2M,
+		.msize = DMA_MSIZE(32),
+		.psize = DMA_PSIZE(32),
+		.mburst = DMA_MBURST_INCR1,
+		.pburst = DMA_PBURST_INCR1,
+		.minc = DMA_MINC_ON,
+		.pinc = DMA_PINC_ON,
+		.circ = DMA_CIRC_OFF,
+		.pfctrl = DMA_PFCTRL_DMA,
+		.fifo = DMA_FIFO_ENABLE,
+		.fth = DMA_FTH(3),
+		.err_callback = sdram_err_callback,
+		.tc_callback = sdram_tc_callback,
+	};
+	rc = dma_init(&sdram->dma, &dma_cfg);
+
+ exit:
+	return rc;
+}
+
+//-----------------------------------------------------------------------------
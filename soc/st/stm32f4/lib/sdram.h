@@ -0,0 +1,88 @@
+//-----------------------------------------------------------------------------
+/*
+
+SDRAM Driver (FMC)
+
+*/
+//-----------------------------------------------------------------------------
+
+#ifndef SDRAM_H
+#define SDRAM_H
+
+//-----------------------------------------------------------------------------
+
+#ifndef STM32F4_SOC_H
+#warning "please include this file using the toplevel stm32f4_soc.h"
+#endif
+
+//-----------------------------------------------------------------------------
+
+// SDCR register fields
+#define SDRAM_NC(x) ((((x) - 8) & 3) << 0)	// column address bits, x = 8..11
+#define SDRAM_NR(x) ((((x) - 11) & 3) << 2)	// row address bits, x = 11..13
+#define SDRAM_MWID(x) ((((x) >> 4) & 3) << 4)	// data bus width, x = 8,16,32
+#define SDRAM_NB(x) ((((x) >> 2) & 1) << 6)	// internal banks, x = 2,4
+#define SDRAM_CAS(x) (((x) & 3) << 7)	// CAS latency, x = 1..3
+#define SDRAM_SDCLK(x) (((x) & 3) << 10)	// SDCLK period in HCLK cycles, x = 2,3
+#define SDRAM_RBURST (1U << 12)	// burst read
+#define SDRAM_RPIPE(x) (((x) & 3) << 13)	// read pipe delay in HCLK cycles, x = 0..2
+
+// SDTR register fields (in SDCLK cycles)
+#define SDRAM_TMRD(x) ((((x) - 1) & 15) << 0)	// load mode register to active
+#define SDRAM_TXSR(x) ((((x) - 1) & 15) << 4)	// exit self-refresh delay
+#define SDRAM_TRAS(x) ((((x) - 1) & 15) << 8)	// self refresh time
+#define SDRAM_TRC(x) ((((x) - 1) & 15) << 12)	// row cycle delay
+#define SDRAM_TWR(x) ((((x) - 1) & 15) << 16)	// recovery delay
+#define SDRAM_TRP(x) ((((x) - 1) & 15) << 20)	// row precharge delay
+#define SDRAM_TRCD(x) ((((x) - 1) & 15) << 24)	// row to column delay
+
+// SDRAM mode register
+#define SDRAM_MODE_BURST_LENGTH_1 (0U << 0)
+#define SDRAM_MODE_BURST_SEQUENTIAL (0U << 3)
+#define SDRAM_MODE_CAS(x) (((x) & 7) << 4)
+#define SDRAM_MODE_WRITEBURST_SINGLE (1U << 9)
+
+#define SDRAM_BANK1_BASE 0xC0000000U
+
+// pending copies (must be a power of 2)
+#define SDRAM_QUEUE_SIZE 16U
+
+struct sdram_xfer {
+	uint32_t dst;		// destination address
+	uint32_t src;		// source address
+	uint32_t n;		// number of 32-bit words
+};
+
+struct sdram_drv {
+	struct dma_drv dma;	// memory to memory dma (must be first)
+	void *base;		// base address of the sdram
+	size_t size;		// size of the sdram in bytes
+	struct sdram_xfer queue[SDRAM_QUEUE_SIZE];	// pending copies
+	volatile size_t rd;	// queue read index
+	volatile size_t wr;	// queue write index
+	volatile int busy;	// a copy is in progress
+	uint32_t errors;	// dma errors
+};
+
+struct sdram_cfg {
+	size_t size;		// size of the sdram in bytes
+	uint32_t sdcr;		// control register
+	uint32_t sdtr;		// timing register
+	uint32_t mode;		// mode register
+	uint32_t refresh;	// refresh timer count
+	int nrfs;		// number of auto-refresh commands
+	int stream;		// DMA2 stream for copies
+};
+
+//-----------------------------------------------------------------------------
+
+int sdram_init(struct sdram_drv *sdram, struct sdram_cfg *cfg);
+int sdram_copy(struct sdram_drv *sdram, void *dst, const void *src, size_t n);
+void sdram_wait(struct sdram_drv *sdram);
+void sdram_isr(struct sdram_drv *sdram);
+
+//-----------------------------------------------------------------------------
+
+#endif				// SDRAM_H
+
+//-----------------------------------------------------------------------------
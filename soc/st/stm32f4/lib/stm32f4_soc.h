@@ -21,9 +21,11 @@ STM32F4 SoC top-level include file
 #include "adc.h"
 #include "usart.h"
 #include "rng.h"
+#include "usbd.h"
 
 #if defined(STM32F427xx)
 #include "sai.h"
+#include "sdram.h"
 #endif
 
 //-----------------------------------------------------------------------------
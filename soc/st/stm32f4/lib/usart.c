@@ -3,9 +3,19 @@
 
 USART Driver
 
+Receive is either interrupt driven (an interrupt per byte into rxbuf) or uses
+a circular DMA into rxring. In DMA mode the reader works out the ring write
+position from the DMA NDTR register, so there are no per-byte interrupts and
+the reader never masks interrupts.
+
+The DMA half/full transfer and the USART IDLE line interrupts keep a count of
+the bytes written to the ring. They are less than half a ring apart, so the
+count lets the reader detect the DMA lapping it (an rx overrun).
+
 */
 //-----------------------------------------------------------------------------
 
+#include <stddef.h>
 #include <string.h>
 
 #include "stm32f4_soc.h"
@@ -18,6 +28,10 @@ USART Driver
 
 #define INC_MOD(x, s) (((x) + 1) & ((s) - 1))
 
+#define RXDMA_MASK (RXDMA_SIZE - 1)
+
+#define USART_SR_RX_ERRORS (USART_SR_ORE | USART_SR_PE | USART_SR_FE | USART_SR_NE)
+
 //-----------------------------------------------------------------------------
 
 // enable the clock to the usart module
@@ -85,6 +99,89 @@ static void usart_set_baud(struct usart_drv *usart, int baud) {
 	reg_rmw(&usart->regs->BRR, 0xffff, usart_get_brr(clk, baud, over));
 }
 
+//-----------------------------------------------------------------------------
+// dma rx
+
+// return the ring index the dma will write next
+static inline uint32_t usart_rx_dma_pos(struct usart_drv *usart) {
+	return (RXDMA_SIZE - dma_ndtr(&usart->rx_dma)) & RXDMA_MASK;
+}
+
+// update the count of bytes written to the ring (called from the isrs)
+static void usart_rx_dma_update(struct usart_drv *usart) {
+	uint32_t saved = disable_irq();
+	// rx_total & RXDMA_MASK is the position at the last update
+	usart->rx_total += (usart_rx_dma_pos(usart) - usart->rx_total) & RXDMA_MASK;
+	restore_irq(saved);
+}
+
+// return the number of unread bytes in the ring
+static size_t usart_rx_dma_avail(struct usart_drv *usart) {
+	// read the isr count before the dma position
+	uint32_t total = usart->rx_total;
+	uint32_t pos = usart_rx_dma_pos(usart);
+	// the isr count is less than half a ring behind the dma
+	uint32_t wr = total + ((pos - total) & RXDMA_MASK);
+	uint32_t n = wr - usart->rx_count;
+	if (n > RXDMA_SIZE) {
+		// the dma has lapped us, skip to the dma position
+		usart->rx_errors++;
+		usart->rx_count = wr;
+		return 0;
+	}
+	return n;
+}
+
+static struct usart_drv *dma_to_usart(struct dma_drv *dma) {
+	return (struct usart_drv *)((uint8_t *) dma - offsetof(struct usart_drv, rx_dma));
+}
+
+// half/full transfer callback
+static void usart_rx_dma_callback(struct dma_drv *dma, int idx) {
+	usart_rx_dma_update(dma_to_usart(dma));
+}
+
+static void usart_rx_dma_err_callback(struct dma_drv *dma, uint32_t errors) {
+	dma_to_usart(dma)->rx_errors++;
+}
+
+// setup and enable the circular rx dma
+static int usart_rx_dma_init(struct usart_drv *usart, struct usart_cfg *cfg) {
+	struct dma_cfg dma_cfg = {
+		.controller = cfg->rx_dma,
+		.stream = cfg->rx_stream,
+		.chsel = DMA_CHSEL(cfg->rx_chsel),
+		.pl = DMA_PL(1),
+		.dir = DMA_DIR_P2M,
+		.msize = DMA_MSIZE(8),
+		.psize = DMA_PSIZE(8),
+		.mburst = DMA_MBURST_INCR1,
+		.pburst = DMA_PBURST_INCR1,
+		.minc = DMA_MINC_ON,
+		.pinc = DMA_PINC_OFF,
+		.circ = DMA_CIRC_ON,
+		.pfctrl = DMA_PFCTRL_DMA,
+		.fifo = DMA_FIFO_DISABLE,
+		.src = (uint32_t) & usart->regs->DR,
+		.dst = (uint32_t) usart->rxring,
+		.nitems = RXDMA_SIZE,
+		.err_callback = usart_rx_dma_err_callback,
+		.ht_callback = usart_rx_dma_callback,
+		.tc_callback = usart_rx_dma_callback,
+	};
+	int rc = dma_init(&usart->rx_dma, &dma_cfg);
+	if (rc != 0) {
+		return rc;
+	}
+	dma_enable(&usart->rx_dma);
+	return 0;
+}
+
+// Called from DMAX_StreamY_IRQHandler()
+void usart_dma_isr(struct usart_drv *usart) {
+	dma_isr(&usart->rx_dma);
+}
+
 //-----------------------------------------------------------------------------
 // stdio functions
 
@@ -107,12 +204,17 @@ void usart_flush(struct usart_drv *usart) {
 
 // return non-zero if we have rx data
 int usart_tstc(struct usart_drv *usart) {
-	return usart->rx_rd != usart->rx_wr;
+	return usart_rxavail(usart) != 0;
 }
 
 char usart_getc(struct usart_drv *usart) {
 	// wait for a character
 	while (usart_tstc(usart) == 0) ;
+	if (usart->dma_rx) {
+		char c = usart->rxring[usart->rx_count & RXDMA_MASK];
+		usart->rx_count += 1;
+		return c;
+	}
 	NVIC_DisableIRQ(usart->irq);
 	char c = usart->rxbuf[usart->rx_rd];
 	usart->rx_rd = INC_MOD(usart->rx_rd, RXBUF_SIZE);
@@ -122,9 +224,56 @@ char usart_getc(struct usart_drv *usart) {
 
 //-----------------------------------------------------------------------------
 
+// return the number of unread rx bytes
+size_t usart_rxavail(struct usart_drv *usart) {
+	if (usart->dma_rx) {
+		return usart_rx_dma_avail(usart);
+	}
+	return (usart->rx_wr - usart->rx_rd) & (RXBUF_SIZE - 1);
+}
+
+// return a pointer to the unread rx data and the number of contiguous bytes
+// Call usart_rxskip() to mark the bytes as read.
+size_t usart_rxpeek(struct usart_drv *usart, const uint8_t ** buf) {
+	if (usart->dma_rx) {
+		size_t n = usart_rx_dma_avail(usart);
+		size_t rd = usart->rx_count & RXDMA_MASK;
+		*buf = &usart->rxring[rd];
+		return (n < RXDMA_SIZE - rd) ? n : RXDMA_SIZE - rd;
+	}
+	// rx_rd is only written by the reader, so no need to mask the irq
+	int rd = usart->rx_rd;
+	int wr = usart->rx_wr;
+	*buf = &usart->rxbuf[rd];
+	return (wr >= rd) ? wr - rd : RXBUF_SIZE - rd;
+}
+
+// mark n bytes returned by usart_rxpeek() as read
+void usart_rxskip(struct usart_drv *usart, size_t n) {
+	if (usart->dma_rx) {
+		usart->rx_count += n;
+	} else {
+		usart->rx_rd = (usart->rx_rd + n) & (RXBUF_SIZE - 1);
+	}
+}
+
 // read serial data into a buffer, return the number of bytes read
 size_t usart_rxbuf(struct usart_drv * usart, uint8_t * buf, size_t n) {
 	size_t i = 0;
+	if (usart->dma_rx) {
+		while (i < n) {
+			const uint8_t *rx;
+			size_t k = usart_rxpeek(usart, &rx);
+			if (k == 0) {
+				break;
+			}
+			k = (k < n - i) ? k : n - i;
+			memcpy(&buf[i], rx, k);
+			usart_rxskip(usart, k);
+			i += k;
+		}
+		return i;
+	}
 	if ((usart->rx_rd == usart->rx_wr) || (n == 0)) {
 		return 0;
 	}
@@ -146,11 +295,18 @@ void usart_isr(struct usart_drv *usart) {
 	uint32_t status = usart->regs->SR;
 
 	// check for rx errors
-	if (status & (USART_SR_ORE | USART_SR_PE | USART_SR_FE | USART_SR_NE)) {
+	if (status & USART_SR_RX_ERRORS) {
 		usart->rx_errors++;
 	}
 	// receive
-	if (status & USART_SR_RXNE) {
+	if (usart->dma_rx) {
+		// idle line (end of an rx burst) or errors
+		if (status & (USART_SR_IDLE | USART_SR_RX_ERRORS)) {
+			// reading DR after SR clears the flags
+			(void)usart->regs->DR;
+			usart_rx_dma_update(usart);
+		}
+	} else if (status & USART_SR_RXNE) {
 		uint8_t c = usart->regs->DR;
 		int rx_wr_inc = INC_MOD(usart->rx_wr, RXBUF_SIZE);
 		if (rx_wr_inc != usart->rx_rd) {
@@ -184,14 +340,24 @@ void usart_isr(struct usart_drv *usart) {
 
 int usart_init(struct usart_drv *usart, struct usart_cfg *cfg) {
 	uint32_t val;
+	int rc;
 
 	memset(usart, 0, sizeof(struct usart_drv));
 	usart->regs = (USART_TypeDef *) cfg->base;
 	usart->irq = usart_irq(cfg->base);
+	usart->dma_rx = (cfg->rx_dma != 0);
 
 	// enable the usart module
 	usart_module_enable(cfg->base);
 
+	// enable the rx dma *before* the usart
+	if (usart->dma_rx) {
+		rc = usart_rx_dma_init(usart, cfg);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
 	// Control register 1
 	val = 0;
 	val |= (0 << 15 /*OVER8 */ );	// Oversampling mode
@@ -203,8 +369,8 @@ int usart_init(struct usart_drv *usart, struct usart_cfg *cfg) {
 	val |= (0 << 8 /*PEIE*/);	// PE interrupt enable
 	val |= (0 << 7 /*TXEIE*/);	// TXE interrupt enable
 	val |= (0 << 6 /*TCIE*/);	// Transmission complete interrupt enable
-	val |= (1 << 5 /*RXNEIE*/);	// RXNE interrupt enable
-	val |= (0 << 4 /*IDLEIE*/);	// IDLE interrupt enable
+	val |= (!usart->dma_rx << 5 /*RXNEIE*/);	// RXNE interrupt enable (interrupt driven rx)
+	val |= (usart->dma_rx << 4 /*IDLEIE*/);	// IDLE interrupt enable (dma rx)
 	val |= (1 << 3 /*TE*/);	// Transmitter enable
 	val |= (1 << 2 /*RE*/);	// Receiver enable
 	val |= (0 << 1 /*RWU*/);	// Receiver wakeup
@@ -231,13 +397,13 @@ int usart_init(struct usart_drv *usart, struct usart_cfg *cfg) {
 	val |= (0 << 9 /*CTSE*/);	// CTS enable
 	val |= (0 << 8 /*RTSE*/);	// RTS enable
 	val |= (0 << 7 /*DMAT*/);	// DMA enable transmitter
-	val |= (0 << 6 /*DMAR*/);	// DMA enable receiver
+	val |= (usart->dma_rx << 6 /*DMAR*/);	// DMA enable receiver
 	val |= (0 << 5 /*SCEN*/);	// Smartcard mode enable
 	val |= (0 << 4 /*NACK*/);	// Smartcard NACK enable
 	val |= (0 << 3 /*HDSEL*/);	// Half-duplex selection
 	val |= (0 << 2 /*IRLP*/);	// IrDA low-power
 	val |= (0 << 1 /*IREN*/);	// IrDA mode enable
-	val |= (0 << 0 /*EIE*/);	// Error interrupt enable
+	val |= (usart->dma_rx << 0 /*EIE*/);	// Error interrupt enable (dma rx)
 	reg_rmw(&usart->regs->CR3, USART_CR3_MASK, val);
 
 	// Clear Status register
@@ -19,6 +19,7 @@ USART Driver
 
 #define TXBUF_SIZE 32		// must be a power of 2
 #define RXBUF_SIZE 32		// must be a power of 2
+#define RXDMA_SIZE 256		// dma rx ring size, must be a power of 2
 
 struct usart_cfg {
 	uint32_t base;		// base address of usart peripheral
@@ -26,6 +27,9 @@ struct usart_cfg {
 	int data;		// data bits
 	int parity;		// parity bits
 	int stop;		// stop bits
+	uint32_t rx_dma;	// rx dma controller base address (0 = interrupt driven rx)
+	int rx_stream;		// rx dma stream number 0..7
+	int rx_chsel;		// rx dma channel selection 0..7
 };
 
 struct usart_drv {
@@ -36,13 +40,23 @@ struct usart_drv {
 	volatile int rx_wr, rx_rd;
 	volatile int tx_wr, tx_rd;
 	int rx_errors;
+	// dma rx
+	int dma_rx;		// non-zero if rx uses the dma ring
+	struct dma_drv rx_dma;	// circular rx dma
+	uint32_t rx_count;	// bytes read from the ring
+	volatile uint32_t rx_total;	// bytes written to the ring (as seen by the isr)
+	uint8_t rxring[RXDMA_SIZE];
 };
 
 //-----------------------------------------------------------------------------
 
 int usart_init(struct usart_drv *usart, struct usart_cfg *cfg);
 void usart_isr(struct usart_drv *usart);
+void usart_dma_isr(struct usart_drv *usart);
 size_t usart_rxbuf(struct usart_drv *usart, uint8_t * buf, size_t n);
+size_t usart_rxavail(struct usart_drv *usart);
+size_t usart_rxpeek(struct usart_drv *usart, const uint8_t ** buf);
+void usart_rxskip(struct usart_drv *usart, size_t n);
 
 // stdio functions
 void usart_putc(struct usart_drv *usart, char c);
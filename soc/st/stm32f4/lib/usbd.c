@@ -0,0 +1,699 @@
+//-----------------------------------------------------------------------------
+/*
+
+USB Device Driver (OTG FS)
+
+A small device stack for the full speed OTG core using the internal PHY.
+
+The driver handles the core, the FIFOs and the standard requests on the
+control endpoint (ep0). The class provides the descriptors and callbacks for
+configuration, class requests and the endpoint transfers.
+
+Transfers on the other endpoints are a single packet. The IN endpoint tx
+FIFOs must be sized to hold a maximum size packet, so the packet is written
+to the FIFO when the transfer is started.
+
+An isochronous IN packet is sent in the frame after it is started. If the
+host doesn't collect it in that frame it is flushed and the class gets a tx
+callback as if it had been sent.
+
+Notes:
+VBUS sensing is disabled, the device is always connected.
+The OTG FS core needs a 48 MHz clock from the PLL (PLLQ output).
+
+*/
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "stm32f4_soc.h"
+#include "utils.h"
+
+#define DEBUG
+#include "logging.h"
+
+//-----------------------------------------------------------------------------
+
+// register blocks
+#define USBD_DEV(usbd) ((USB_OTG_DeviceTypeDef *)((uint32_t)(usbd)->regs + USB_OTG_DEVICE_BASE))
+#define USBD_INEP(usbd, i) ((USB_OTG_INEndpointTypeDef *)((uint32_t)(usbd)->regs + USB_OTG_IN_ENDPOINT_BASE + ((i) * USB_OTG_EP_REG_SIZE)))
+#define USBD_OUTEP(usbd, i) ((USB_OTG_OUTEndpointTypeDef *)((uint32_t)(usbd)->regs + USB_OTG_OUT_ENDPOINT_BASE + ((i) * USB_OTG_EP_REG_SIZE)))
+#define USBD_FIFO(usbd, i) (*(volatile uint32_t *)((uint32_t)(usbd)->regs + USB_OTG_FIFO_BASE + ((i) * USB_OTG_FIFO_SIZE)))
+#define USBD_PCGCCTL(usbd) (*(volatile uint32_t *)((uint32_t)(usbd)->regs + USB_OTG_PCGCCTL_BASE))
+
+#define USBD_FIFO_WORDS 320U	// total FIFO RAM (32-bit words)
+#define USBD_TRDT 6U		// turnaround time for a 168 MHz AHB clock
+
+// GRXSTSP packet status
+#define PKTSTS_OUT_DATA 2U	// OUT data packet received
+#define PKTSTS_SETUP_DATA 6U	// SETUP data packet received
+
+// standard requests
+#define REQ_GET_STATUS 0U
+#define REQ_CLEAR_FEATURE 1U
+#define REQ_SET_FEATURE 3U
+#define REQ_SET_ADDRESS 5U
+#define REQ_GET_DESCRIPTOR 6U
+#define REQ_GET_CONFIGURATION 8U
+#define REQ_SET_CONFIGURATION 9U
+#define REQ_GET_INTERFACE 10U
+#define REQ_SET_INTERFACE 11U
+
+// descriptor types
+#define DESC_DEVICE 1U
+#define DESC_CONFIGURATION 2U
+#define DESC_STRING 3U
+
+// control transfer states
+enum {
+	CTRL_IDLE,		// waiting for a setup packet
+	CTRL_DATA_IN,		// sending data to the host
+	CTRL_DATA_OUT,		// receiving data from the host
+	CTRL_STATUS_IN,		// sending the status zero length packet
+	CTRL_STATUS_OUT,	// receiving the status zero length packet
+};
+
+//-----------------------------------------------------------------------------
+// fifo access
+
+// read n bytes from the rx fifo
+static void fifo_rd(struct usbd_drv *usbd, uint8_t * buf, size_t n) {
+	size_t i = 0;
+	for (size_t k = 0; k < (n + 3) >> 2; k++) {
+		uint32_t x = USBD_FIFO(usbd, 0);
+		for (int j = 0; j < 4 && i < n; j++) {
+			buf[i++] = x & 0xff;
+			x >>= 8;
+		}
+	}
+}
+
+// write n bytes to an endpoint tx fifo
+static void fifo_wr(struct usbd_drv *usbd, int ep, const uint8_t * buf, size_t n) {
+	size_t i = 0;
+	for (size_t k = 0; k < (n + 3) >> 2; k++) {
+		uint32_t x = 0;
+		for (int j = 0; j < 4 && i < n; j++) {
+			x |= (uint32_t) buf[i++] << (j << 3);
+		}
+		USBD_FIFO(usbd, ep) = x;
+	}
+}
+
+// wait for a GRSTCTL operation to complete
+static int usbd_wait_rst(struct usbd_drv *usbd, uint32_t bits) {
+	uint32_t timeout = SystemCoreClock / 1000U;
+	uint32_t count = 0;
+	while (usbd->regs->GRSTCTL & bits) {
+		if (count > timeout) {
+			return -1;
+		}
+		count += 1;
+	}
+	return 0;
+}
+
+// flush the tx fifos and the rx fifo
+static void usbd_flush(struct usbd_drv *usbd) {
+	usbd->regs->GRSTCTL = USB_OTG_GRSTCTL_TXFFLSH | (0x10U << USB_OTG_GRSTCTL_TXFNUM_Pos);
+	usbd_wait_rst(usbd, USB_OTG_GRSTCTL_TXFFLSH);
+	usbd->regs->GRSTCTL = USB_OTG_GRSTCTL_RXFFLSH;
+	usbd_wait_rst(usbd, USB_OTG_GRSTCTL_RXFFLSH);
+}
+
+//-----------------------------------------------------------------------------
+// endpoints
+
+// open an endpoint
+void usbd_ep_open(struct usbd_drv *usbd, uint8_t addr, uint8_t type, uint16_t mps) {
+	int ep = addr & 0x7f;
+	uint32_t ctl = (mps & USB_OTG_DIEPCTL_MPSIZ) | ((uint32_t) type << USB_OTG_DIEPCTL_EPTYP_Pos) | USB_OTG_DIEPCTL_USBAEP;
+	if (type != USBD_EP_ISOC) {
+		ctl |= USB_OTG_DIEPCTL_SD0PID_SEVNFRM;
+	}
+	if (addr & USBD_EP_IN) {
+		usbd->in[ep].mps = mps;
+		usbd->in[ep].type = type;
+		USBD_INEP(usbd, ep)->DIEPCTL = ctl | ((uint32_t) ep << USB_OTG_DIEPCTL_TXFNUM_Pos);
+		USBD_DEV(usbd)->DAINTMSK |= 1U << ep;
+	} else {
+		usbd->out[ep].mps = mps;
+		usbd->out[ep].type = type;
+		USBD_OUTEP(usbd, ep)->DOEPCTL = ctl;
+		USBD_DEV(usbd)->DAINTMSK |= 1U << (16 + ep);
+	}
+}
+
+// disable an IN endpoint and flush its tx fifo
+static void usbd_in_disable(struct usbd_drv *usbd, int ep) {
+	USB_OTG_INEndpointTypeDef *regs = USBD_INEP(usbd, ep);
+	if (regs->DIEPCTL & USB_OTG_DIEPCTL_EPENA) {
+		uint32_t timeout = SystemCoreClock / 10000U;
+		uint32_t count = 0;
+		regs->DIEPCTL |= USB_OTG_DIEPCTL_SNAK | USB_OTG_DIEPCTL_EPDIS;
+		while ((regs->DIEPINT & USB_OTG_DIEPINT_EPDISD) == 0 && count < timeout) {
+			count += 1;
+		}
+		regs->DIEPINT = USB_OTG_DIEPINT_EPDISD;
+	}
+	usbd->regs->GRSTCTL = USB_OTG_GRSTCTL_TXFFLSH | ((uint32_t) ep << USB_OTG_GRSTCTL_TXFNUM_Pos);
+	usbd_wait_rst(usbd, USB_OTG_GRSTCTL_TXFFLSH);
+}
+
+// close an endpoint
+void usbd_ep_close(struct usbd_drv *usbd, uint8_t addr) {
+	int ep = addr & 0x7f;
+	if (addr & USBD_EP_IN) {
+		usbd_in_disable(usbd, ep);
+		USBD_INEP(usbd, ep)->DIEPCTL &= ~USB_OTG_DIEPCTL_USBAEP;
+		USBD_DEV(usbd)->DAINTMSK &= ~(1U << ep);
+	} else {
+		USB_OTG_OUTEndpointTypeDef *regs = USBD_OUTEP(usbd, ep);
+		if (regs->DOEPCTL & USB_OTG_DOEPCTL_EPENA) {
+			regs->DOEPCTL |= USB_OTG_DOEPCTL_SNAK | USB_OTG_DOEPCTL_EPDIS;
+		}
+		regs->DOEPCTL &= ~USB_OTG_DOEPCTL_USBAEP;
+		USBD_DEV(usbd)->DAINTMSK &= ~(1U << (16 + ep));
+	}
+}
+
+// receive a packet on an OUT endpoint, buf holds a maximum size packet
+void usbd_rx(struct usbd_drv *usbd, int ep, uint8_t * buf) {
+	struct usbd_ep *x = &usbd->out[ep];
+	USB_OTG_OUTEndpointTypeDef *regs = USBD_OUTEP(usbd, ep);
+	x->buf = buf;
+	x->len = x->mps;
+	x->count = 0;
+	regs->DOEPTSIZ = (1U << USB_OTG_DOEPTSIZ_PKTCNT_Pos) | x->mps;
+	regs->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+}
+
+// start an n byte IN packet
+static void usbd_tx_start(struct usbd_drv *usbd, int ep, size_t n) {
+	USB_OTG_INEndpointTypeDef *regs = USBD_INEP(usbd, ep);
+	uint32_t ctl = USB_OTG_DIEPCTL_EPENA | USB_OTG_DIEPCTL_CNAK;
+	uint32_t tsiz = (1U << USB_OTG_DIEPTSIZ_PKTCNT_Pos) | n;
+	if (usbd->in[ep].type == USBD_EP_ISOC) {
+		// one packet per frame, sent in the next frame
+		tsiz |= 1U << USB_OTG_DIEPTSIZ_MULCNT_Pos;
+		if ((USBD_DEV(usbd)->DSTS & (1U << USB_OTG_DSTS_FNSOF_Pos)) == 0) {
+			ctl |= USB_OTG_DIEPCTL_SODDFRM;
+		} else {
+			ctl |= USB_OTG_DIEPCTL_SD0PID_SEVNFRM;
+		}
+	}
+	regs->DIEPTSIZ = tsiz;
+	regs->DIEPCTL |= ctl;
+}
+
+// send a packet on an IN endpoint, n <= maximum packet size
+void usbd_tx(struct usbd_drv *usbd, int ep, const uint8_t * buf, size_t n) {
+	usbd_tx_start(usbd, ep, n);
+	fifo_wr(usbd, ep, buf, n);
+}
+
+// send a packet from two buffers (E.g. the end and start of a ring buffer)
+// n0 must be a multiple of 4, n0 + n1 <= maximum packet size
+void usbd_tx2(struct usbd_drv *usbd, int ep, const uint8_t * buf0, size_t n0, const uint8_t * buf1, size_t n1) {
+	usbd_tx_start(usbd, ep, n0 + n1);
+	fifo_wr(usbd, ep, buf0, n0);
+	fifo_wr(usbd, ep, buf1, n1);
+}
+
+//-----------------------------------------------------------------------------
+// control endpoint
+
+// get ready for a setup packet
+static void ctrl_setup_start(struct usbd_drv *usbd) {
+	USBD_OUTEP(usbd, 0)->DOEPTSIZ = (3U << USB_OTG_DOEPTSIZ_STUPCNT_Pos) | (1U << USB_OTG_DOEPTSIZ_PKTCNT_Pos) | (3U * 8U);
+}
+
+// receive an OUT packet on ep0
+static void ctrl_out_start(struct usbd_drv *usbd) {
+	USB_OTG_OUTEndpointTypeDef *regs = USBD_OUTEP(usbd, 0);
+	regs->DOEPTSIZ = (3U << USB_OTG_DOEPTSIZ_STUPCNT_Pos) | (1U << USB_OTG_DOEPTSIZ_PKTCNT_Pos) | USBD_EP0_SIZE;
+	regs->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+}
+
+// send the next control data packet
+static void ctrl_tx_next(struct usbd_drv *usbd) {
+	struct usbd_ep *x = &usbd->in[0];
+	size_t n = x->len - x->count;
+	n = (n > USBD_EP0_SIZE) ? USBD_EP0_SIZE : n;
+	usbd_tx(usbd, 0, &x->buf[x->count], n);
+	x->count += n;
+}
+
+// stall the control endpoint (cleared by the next setup packet)
+static void ctrl_stall(struct usbd_drv *usbd) {
+	USBD_INEP(usbd, 0)->DIEPCTL |= USB_OTG_DIEPCTL_STALL;
+	USBD_OUTEP(usbd, 0)->DOEPCTL |= USB_OTG_DOEPCTL_STALL;
+	usbd->ctrl_state = CTRL_IDLE;
+}
+
+// send the status stage of a control transfer
+static void ctrl_status_in(struct usbd_drv *usbd) {
+	usbd->ctrl_state = CTRL_STATUS_IN;
+	usbd_tx(usbd, 0, NULL, 0);
+}
+
+// send the data stage of a control transfer (buf must stay valid)
+void usbd_ctrl_tx(struct usbd_drv *usbd, const uint8_t * buf, size_t n) {
+	struct usbd_ep *x = &usbd->in[0];
+	size_t len = usbd->req.wLength;
+	n = (n > len) ? len : n;
+	x->buf = (uint8_t *) buf;
+	x->len = n;
+	x->count = 0;
+	// a short reply that ends on a packet boundary needs a zero length packet
+	usbd->ctrl_zlp = (n < len) && ((n % USBD_EP0_SIZE) == 0);
+	usbd->ctrl_state = CTRL_DATA_IN;
+	ctrl_tx_next(usbd);
+}
+
+// receive the data stage of a control transfer into ctrl_buf
+int usbd_ctrl_rx(struct usbd_drv *usbd) {
+	struct usbd_ep *x = &usbd->out[0];
+	if (usbd->req.wLength > USBD_EP0_SIZE) {
+		return -1;
+	}
+	x->buf = usbd->ctrl_buf;
+	x->len = usbd->req.wLength;
+	x->count = 0;
+	usbd->ctrl_state = CTRL_DATA_OUT;
+	ctrl_out_start(usbd);
+	return 0;
+}
+
+// handle a GET_DESCRIPTOR request
+static int get_descriptor(struct usbd_drv *usbd, const struct usbd_setup *req) {
+	struct usbd_cfg *cfg = usbd->cfg;
+	unsigned int idx = req->wValue & 0xff;
+	const uint8_t *desc;
+	size_t n;
+	switch (req->wValue >> 8) {
+	case DESC_DEVICE:
+		desc = cfg->dev_desc;
+		n = desc[0];
+		break;
+	case DESC_CONFIGURATION:
+		desc = cfg->cfg_desc;
+		n = desc[2] | (desc[3] << 8);
+		break;
+	case DESC_STRING:
+		if (idx >= (unsigned int)cfg->num_str) {
+			return -1;
+		}
+		desc = cfg->str_desc[idx];
+		n = desc[0];
+		break;
+	default:
+		// E.g. device qualifier, we are full speed only
+		return -1;
+	}
+	usbd_ctrl_tx(usbd, desc, n);
+	return 0;
+}
+
+// handle a standard request, return !=0 to stall
+static int std_request(struct usbd_drv *usbd, const struct usbd_setup *req) {
+	switch (req->bRequest) {
+	case REQ_GET_STATUS:
+		usbd->ctrl_buf[0] = 0;
+		usbd->ctrl_buf[1] = 0;
+		usbd_ctrl_tx(usbd, usbd->ctrl_buf, 2);
+		return 0;
+	case REQ_CLEAR_FEATURE:
+	case REQ_SET_FEATURE:
+		return 0;
+	case REQ_SET_ADDRESS:
+		// the core applies the address after the status stage
+		USBD_DEV(usbd)->DCFG = (USBD_DEV(usbd)->DCFG & ~USB_OTG_DCFG_DAD) | ((req->wValue & 0x7fU) << USB_OTG_DCFG_DAD_Pos);
+		return 0;
+	case REQ_GET_DESCRIPTOR:
+		return get_descriptor(usbd, req);
+	case REQ_GET_CONFIGURATION:
+		usbd->ctrl_buf[0] = usbd->config;
+		usbd_ctrl_tx(usbd, usbd->ctrl_buf, 1);
+		return 0;
+	case REQ_SET_CONFIGURATION:
+		usbd->config = req->wValue & 0xff;
+		memset(usbd->alt, 0, sizeof(usbd->alt));
+		if (usbd->cfg->configure) {
+			usbd->cfg->configure(usbd, usbd->config);
+		}
+		return 0;
+	case REQ_GET_INTERFACE:
+		if (req->wIndex >= USBD_NUM_IF) {
+			return -1;
+		}
+		usbd->ctrl_buf[0] = usbd->alt[req->wIndex];
+		usbd_ctrl_tx(usbd, usbd->ctrl_buf, 1);
+		return 0;
+	case REQ_SET_INTERFACE:
+		if (req->wIndex >= USBD_NUM_IF) {
+			return -1;
+		}
+		if (usbd->cfg->set_interface && usbd->cfg->set_interface(usbd, req->wIndex, req->wValue) != 0) {
+			return -1;
+		}
+		usbd->alt[req->wIndex] = req->wValue;
+		return 0;
+	default:
+		break;
+	}
+	return -1;
+}
+
+// a setup packet has been received
+static void ctrl_setup(struct usbd_drv *usbd) {
+	struct usbd_setup *req = &usbd->req;
+	int rc = -1;
+	usbd->ctrl_state = CTRL_IDLE;
+	if (USBD_REQ_TYPE(req->bmRequestType) == USBD_REQ_STANDARD) {
+		rc = std_request(usbd, req);
+	} else if (usbd->cfg->setup) {
+		rc = usbd->cfg->setup(usbd, req);
+	}
+	if (rc != 0) {
+		DBG("stall request %02x %02x\r\n", req->bmRequestType, req->bRequest);
+		ctrl_stall(usbd);
+		return;
+	}
+	if (usbd->ctrl_state == CTRL_IDLE) {
+		// no data stage
+		ctrl_status_in(usbd);
+	}
+}
+
+// an ep0 IN transfer has completed
+static void ctrl_in_done(struct usbd_drv *usbd) {
+	switch (usbd->ctrl_state) {
+	case CTRL_DATA_IN:
+		if (usbd->in[0].count < usbd->in[0].len) {
+			ctrl_tx_next(usbd);
+		} else if (usbd->ctrl_zlp) {
+			usbd->ctrl_zlp = 0;
+			usbd_tx(usbd, 0, NULL, 0);
+		} else {
+			// wait for the host status packet
+			usbd->ctrl_state = CTRL_STATUS_OUT;
+			ctrl_out_start(usbd);
+		}
+		break;
+	case CTRL_STATUS_IN:
+		usbd->ctrl_state = CTRL_IDLE;
+		ctrl_setup_start(usbd);
+		break;
+	default:
+		break;
+	}
+}
+
+// an ep0 OUT transfer has completed
+static void ctrl_out_done(struct usbd_drv *usbd) {
+	switch (usbd->ctrl_state) {
+	case CTRL_DATA_OUT:
+		if (usbd->out[0].count < usbd->out[0].len) {
+			// more data to come
+			ctrl_out_start(usbd);
+			break;
+		}
+		if (usbd->cfg->ctrl_out) {
+			usbd->cfg->ctrl_out(usbd, &usbd->req, usbd->ctrl_buf, usbd->out[0].count);
+		}
+		ctrl_status_in(usbd);
+		break;
+	case CTRL_STATUS_OUT:
+		usbd->ctrl_state = CTRL_IDLE;
+		ctrl_setup_start(usbd);
+		break;
+	default:
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// interrupt handling
+
+// usb reset
+static void usbd_reset(struct usbd_drv *usbd) {
+	USB_OTG_DeviceTypeDef *dev = USBD_DEV(usbd);
+	dev->DCTL &= ~USB_OTG_DCTL_RWUSIG;
+	usbd_flush(usbd);
+	// disable the endpoints
+	for (int i = 0; i < USBD_NUM_EP; i++) {
+		USB_OTG_INEndpointTypeDef *in = USBD_INEP(usbd, i);
+		USB_OTG_OUTEndpointTypeDef *out = USBD_OUTEP(usbd, i);
+		in->DIEPCTL = (in->DIEPCTL & USB_OTG_DIEPCTL_EPENA) ? (USB_OTG_DIEPCTL_EPDIS | USB_OTG_DIEPCTL_SNAK) : 0;
+		out->DOEPCTL = (out->DOEPCTL & USB_OTG_DOEPCTL_EPENA) ? (USB_OTG_DOEPCTL_EPDIS | USB_OTG_DOEPCTL_SNAK) : 0;
+		in->DIEPINT = 0xff;
+		out->DOEPINT = 0xff;
+	}
+	// only ep0 interrupts until the class opens its endpoints
+	dev->DAINTMSK = (1U << 0) | (1U << 16);
+	dev->DOEPMSK = USB_OTG_DOEPMSK_STUPM | USB_OTG_DOEPMSK_XFRCM;
+	dev->DIEPMSK = USB_OTG_DIEPMSK_XFRCM;
+	dev->DCFG &= ~USB_OTG_DCFG_DAD;
+	ctrl_setup_start(usbd);
+	usbd->ctrl_state = CTRL_IDLE;
+	if (usbd->config && usbd->cfg->configure) {
+		usbd->cfg->configure(usbd, 0);
+	}
+	usbd->config = 0;
+	memset(usbd->alt, 0, sizeof(usbd->alt));
+}
+
+// enumeration done
+static void usbd_enum_done(struct usbd_drv *usbd) {
+	// ep0 maximum packet size is 64 bytes
+	USBD_INEP(usbd, 0)->DIEPCTL &= ~USB_OTG_DIEPCTL_MPSIZ;
+	usbd->in[0].mps = USBD_EP0_SIZE;
+	usbd->out[0].mps = USBD_EP0_SIZE;
+	USBD_DEV(usbd)->DCTL |= USB_OTG_DCTL_CGINAK;
+}
+
+// pop an entry from the rx fifo
+static void usbd_rxflvl(struct usbd_drv *usbd) {
+	USB_OTG_GlobalTypeDef *regs = usbd->regs;
+	regs->GINTMSK &= ~USB_OTG_GINTMSK_RXFLVLM;
+	uint32_t sts = regs->GRXSTSP;
+	int ep = sts & USB_OTG_GRXSTSP_EPNUM;
+	size_t n = (sts & USB_OTG_GRXSTSP_BCNT) >> USB_OTG_GRXSTSP_BCNT_Pos;
+	switch ((sts & USB_OTG_GRXSTSP_PKTSTS) >> USB_OTG_GRXSTSP_PKTSTS_Pos) {
+	case PKTSTS_OUT_DATA:{
+			struct usbd_ep *x = &usbd->out[ep];
+			if (x->buf == NULL || x->count + n > x->len) {
+				// no room, drop it
+				uint8_t tmp[USBD_EP0_SIZE];
+				while (n) {
+					size_t k = (n > sizeof(tmp)) ? sizeof(tmp) : n;
+					fifo_rd(usbd, tmp, k);
+					n -= k;
+				}
+				break;
+			}
+			fifo_rd(usbd, &x->buf[x->count], n);
+			x->count += n;
+			break;
+		}
+	case PKTSTS_SETUP_DATA:
+		fifo_rd(usbd, (uint8_t *) & usbd->req, sizeof(struct usbd_setup));
+		break;
+	default:
+		break;
+	}
+	regs->GINTMSK |= USB_OTG_GINTMSK_RXFLVLM;
+}
+
+// OUT endpoint interrupts
+static void usbd_oepint(struct usbd_drv *usbd) {
+	USB_OTG_DeviceTypeDef *dev = USBD_DEV(usbd);
+	uint32_t bits = (dev->DAINT & dev->DAINTMSK) >> 16;
+	for (int ep = 0; bits; ep++, bits >>= 1) {
+		if ((bits & 1) == 0) {
+			continue;
+		}
+		USB_OTG_OUTEndpointTypeDef *regs = USBD_OUTEP(usbd, ep);
+		uint32_t flags = regs->DOEPINT & dev->DOEPMSK;
+		regs->DOEPINT = flags;
+		if (flags & USB_OTG_DOEPINT_XFRC) {
+			if (ep == 0) {
+				ctrl_out_done(usbd);
+			} else if (usbd->cfg->rx) {
+				usbd->cfg->rx(usbd, ep, usbd->out[ep].count);
+			}
+		}
+		if (flags & USB_OTG_DOEPINT_STUP) {
+			ctrl_setup(usbd);
+		}
+	}
+}
+
+// IN endpoint interrupts
+static void usbd_iepint(struct usbd_drv *usbd) {
+	USB_OTG_DeviceTypeDef *dev = USBD_DEV(usbd);
+	uint32_t bits = dev->DAINT & dev->DAINTMSK & 0xffff;
+	for (int ep = 0; bits; ep++, bits >>= 1) {
+		if ((bits & 1) == 0) {
+			continue;
+		}
+		USB_OTG_INEndpointTypeDef *regs = USBD_INEP(usbd, ep);
+		uint32_t flags = regs->DIEPINT & dev->DIEPMSK;
+		regs->DIEPINT = flags;
+		if (flags & USB_OTG_DIEPINT_XFRC) {
+			if (ep == 0) {
+				ctrl_in_done(usbd);
+			} else if (usbd->cfg->tx) {
+				usbd->cfg->tx(usbd, ep);
+			}
+		}
+	}
+}
+
+// an isochronous IN packet wasn't collected in its frame
+static void usbd_iso_incomplete(struct usbd_drv *usbd) {
+	for (int ep = 1; ep < USBD_NUM_EP; ep++) {
+		if (usbd->in[ep].type != USBD_EP_ISOC) {
+			continue;
+		}
+		if ((USBD_INEP(usbd, ep)->DIEPCTL & USB_OTG_DIEPCTL_EPENA) == 0) {
+			continue;
+		}
+		// drop the packet, the class can start the next one
+		usbd_in_disable(usbd, ep);
+		if (usbd->cfg->tx) {
+			usbd->cfg->tx(usbd, ep);
+		}
+	}
+}
+
+void usbd_isr(struct usbd_drv *usbd) {
+	USB_OTG_GlobalTypeDef *regs = usbd->regs;
+	uint32_t status = regs->GINTSTS & regs->GINTMSK;
+	if (status & USB_OTG_GINTSTS_USBRST) {
+		regs->GINTSTS = USB_OTG_GINTSTS_USBRST;
+		usbd_reset(usbd);
+	}
+	if (status & USB_OTG_GINTSTS_ENUMDNE) {
+		regs->GINTSTS = USB_OTG_GINTSTS_ENUMDNE;
+		usbd_enum_done(usbd);
+	}
+	if (status & USB_OTG_GINTSTS_RXFLVL) {
+		usbd_rxflvl(usbd);
+	}
+	if (status & USB_OTG_GINTSTS_OEPINT) {
+		usbd_oepint(usbd);
+	}
+	if (status & USB_OTG_GINTSTS_IEPINT) {
+		usbd_iepint(usbd);
+	}
+	if (status & USB_OTG_GINTSTS_IISOIXFR) {
+		regs->GINTSTS = USB_OTG_GINTSTS_IISOIXFR;
+		usbd_iso_incomplete(usbd);
+	}
+	if (status & USB_OTG_GINTSTS_SOF) {
+		regs->GINTSTS = USB_OTG_GINTSTS_SOF;
+		usbd->cfg->sof(usbd);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int usbd_init(struct usbd_drv *usbd, struct usbd_cfg *cfg) {
+	USB_OTG_GlobalTypeDef *regs = USB_OTG_FS;
+	int rc = 0;
+
+	memset(usbd, 0, sizeof(struct usbd_drv));
+	usbd->regs = regs;
+	usbd->cfg = cfg;
+
+	// check the fifo allocation
+	uint32_t ofs = cfg->rx_fifo;
+	for (int i = 0; i < USBD_NUM_EP; i++) {
+		ofs += cfg->tx_fifo[i];
+	}
+	if (ofs > USBD_FIFO_WORDS) {
+		DBG("fifo allocation too large (%d words)\r\n", ofs);
+		return -1;
+	}
+
+	// enable the OTG FS clock
+	RCC->AHB2ENR |= RCC_AHB2ENR_OTGFSEN;
+
+	// reset the core
+	regs->GAHBCFG &= ~USB_OTG_GAHBCFG_GINT;
+	regs->GUSBCFG |= USB_OTG_GUSBCFG_PHYSEL;
+	uint32_t count = 0;
+	while ((regs->GRSTCTL & USB_OTG_GRSTCTL_AHBIDL) == 0) {
+		if (count > SystemCoreClock / 1000U) {
+			DBG("ahb not idle\r\n");
+			rc = -1;
+			goto exit;
+		}
+		count += 1;
+	}
+	regs->GRSTCTL |= USB_OTG_GRSTCTL_CSRST;
+	rc = usbd_wait_rst(usbd, USB_OTG_GRSTCTL_CSRST);
+	if (rc != 0) {
+		DBG("core reset failed\r\n");
+		goto exit;
+	}
+
+	// power up the PHY, no VBUS sensing
+	regs->GCCFG = USB_OTG_GCCFG_PWRDWN | USB_OTG_GCCFG_NOVBUSSENS;
+
+	// force device mode
+	regs->GUSBCFG = (regs->GUSBCFG & ~(USB_OTG_GUSBCFG_FHMOD | USB_OTG_GUSBCFG_TRDT)) | USB_OTG_GUSBCFG_FDMOD | (USBD_TRDT << USB_OTG_GUSBCFG_TRDT_Pos);
+	mdelay(25);
+
+	// stay disconnected until we are setup
+	USBD_DEV(usbd)->DCTL |= USB_OTG_DCTL_SDIS;
+	// restart the PHY clock
+	USBD_PCGCCTL(usbd) = 0;
+	// full speed using the internal PHY
+	USBD_DEV(usbd)->DCFG |= USB_OTG_DCFG_DSPD;
+
+	// allocate the fifos
+	ofs = cfg->rx_fifo;
+	regs->GRXFSIZ = cfg->rx_fifo;
+	regs->DIEPTXF0_HNPTXFSIZ = ((uint32_t) cfg->tx_fifo[0] << 16) | ofs;
+	ofs += cfg->tx_fifo[0];
+	for (int i = 1; i < USBD_NUM_EP; i++) {
+		regs->DIEPTXF[i - 1] = ((uint32_t) cfg->tx_fifo[i] << 16) | ofs;
+		ofs += cfg->tx_fifo[i];
+	}
+	usbd_flush(usbd);
+
+	// clear the endpoint state
+	USBD_DEV(usbd)->DIEPMSK = 0;
+	USBD_DEV(usbd)->DOEPMSK = 0;
+	USBD_DEV(usbd)->DAINTMSK = 0;
+	for (int i = 0; i < USBD_NUM_EP; i++) {
+		USBD_INEP(usbd, i)->DIEPCTL = 0;
+		USBD_INEP(usbd, i)->DIEPTSIZ = 0;
+		USBD_INEP(usbd, i)->DIEPINT = 0xff;
+		USBD_OUTEP(usbd, i)->DOEPCTL = 0;
+		USBD_OUTEP(usbd, i)->DOEPTSIZ = 0;
+		USBD_OUTEP(usbd, i)->DOEPINT = 0xff;
+	}
+
+	// enable the interrupts
+	regs->GINTSTS = 0xffffffff;
+	regs->GINTMSK = USB_OTG_GINTMSK_USBRST |	// usb reset
+	    USB_OTG_GINTMSK_ENUMDNEM |	// enumeration done
+	    USB_OTG_GINTMSK_RXFLVLM |	// rx fifo not empty
+	    USB_OTG_GINTMSK_OEPINT |	// OUT endpoints
+	    USB_OTG_GINTMSK_IEPINT |	// IN endpoints
+	    USB_OTG_GINTMSK_IISOIXFRM |	// incomplete isochronous IN
+	    ((cfg->sof) ? USB_OTG_GINTMSK_SOFM : 0);	// start of frame
+	regs->GAHBCFG |= USB_OTG_GAHBCFG_GINT;
+
+	// connect
+	USBD_DEV(usbd)->DCTL &= ~USB_OTG_DCTL_SDIS;
+
+ exit:
+	return rc;
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,110 @@
+//-----------------------------------------------------------------------------
+/*
+
+USB Device Driver (OTG FS)
+
+*/
+//-----------------------------------------------------------------------------
+
+#ifndef USBD_H
+#define USBD_H
+
+//-----------------------------------------------------------------------------
+
+#ifndef STM32F4_SOC_H
+#warning "please include this file using the toplevel stm32f4_soc.h"
+#endif
+
+//-----------------------------------------------------------------------------
+
+#define USBD_NUM_EP 4		// number of endpoints (including ep0)
+#define USBD_EP0_SIZE 64	// ep0 maximum packet size
+#define USBD_NUM_IF 4		// number of interfaces
+
+// endpoint types
+#define USBD_EP_CONTROL 0U
+#define USBD_EP_ISOC 1U
+#define USBD_EP_BULK 2U
+#define USBD_EP_INTR 3U
+
+// endpoint address direction
+#define USBD_EP_IN 0x80U
+
+// request types
+#define USBD_REQ_TYPE(x) ((x) & 0x60U)
+#define USBD_REQ_STANDARD 0x00U
+#define USBD_REQ_CLASS 0x20U
+#define USBD_REQ_VENDOR 0x40U
+
+// request recipients
+#define USBD_REQ_RECIPIENT(x) ((x) & 0x1fU)
+#define USBD_REQ_DEVICE 0U
+#define USBD_REQ_INTERFACE 1U
+#define USBD_REQ_ENDPOINT 2U
+
+// setup packet
+struct usbd_setup {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+};
+
+struct usbd_drv;
+
+struct usbd_cfg {
+	const uint8_t *dev_desc;	// device descriptor
+	const uint8_t *cfg_desc;	// configuration descriptor
+	const uint8_t *const *str_desc;	// string descriptors
+	int num_str;		// number of string descriptors
+	uint16_t rx_fifo;	// rx fifo size (32-bit words)
+	uint16_t tx_fifo[USBD_NUM_EP];	// per IN endpoint tx fifo sizes (32-bit words)
+	// class callbacks (called from the isr)
+	void (*configure) (struct usbd_drv * usbd, int config);	// set configuration (0 to deconfigure)
+	int (*set_interface) (struct usbd_drv * usbd, int iface, int alt);	// select an alternate setting, !=0 to stall
+	int (*setup) (struct usbd_drv * usbd, const struct usbd_setup * req);	// class/vendor requests, !=0 to stall
+	void (*ctrl_out) (struct usbd_drv * usbd, const struct usbd_setup * req, const uint8_t * buf, size_t n);	// control out data
+	void (*rx) (struct usbd_drv * usbd, int ep, size_t n);	// out transfer complete
+	void (*tx) (struct usbd_drv * usbd, int ep);	// in transfer complete (or an isochronous transfer missed its frame)
+	void (*sof) (struct usbd_drv * usbd);	// start of frame
+};
+
+struct usbd_ep {
+	uint8_t *buf;		// transfer buffer
+	size_t len;		// transfer length
+	size_t count;		// bytes transferred
+	uint16_t mps;		// maximum packet size
+	uint8_t type;		// endpoint type
+};
+
+struct usbd_drv {
+	USB_OTG_GlobalTypeDef *regs;
+	struct usbd_cfg *cfg;
+	struct usbd_ep in[USBD_NUM_EP];	// IN endpoints
+	struct usbd_ep out[USBD_NUM_EP];	// OUT endpoints
+	struct usbd_setup req;	// current control request
+	int ctrl_state;		// control transfer state
+	int ctrl_zlp;		// send a zero length packet to end the control data
+	int config;		// current configuration
+	uint8_t alt[USBD_NUM_IF];	// current interface alternate settings
+	uint8_t ctrl_buf[USBD_EP0_SIZE];	// control transfer data
+};
+
+//-----------------------------------------------------------------------------
+
+int usbd_init(struct usbd_drv *usbd, struct usbd_cfg *cfg);
+void usbd_isr(struct usbd_drv *usbd);
+void usbd_ep_open(struct usbd_drv *usbd, uint8_t addr, uint8_t type, uint16_t mps);
+void usbd_ep_close(struct usbd_drv *usbd, uint8_t addr);
+void usbd_rx(struct usbd_drv *usbd, int ep, uint8_t * buf);
+void usbd_tx(struct usbd_drv *usbd, int ep, const uint8_t * buf, size_t n);
+void usbd_tx2(struct usbd_drv *usbd, int ep, const uint8_t * buf0, size_t n0, const uint8_t * buf1, size_t n1);
+void usbd_ctrl_tx(struct usbd_drv *usbd, const uint8_t * buf, size_t n);
+int usbd_ctrl_rx(struct usbd_drv *usbd);
+
+//-----------------------------------------------------------------------------
+
+#endif				// USBD_H
+
+//-----------------------------------------------------------------------------
@@ -52,6 +52,7 @@ struct audio_drv {
 	struct i2c_drv i2c;
 	struct adau1361_drv codec;
 	struct audio_stats stats;
+	volatile uint32_t blocks;	// number of blocks played (sample clock)
 	int16_t buffer[AUDIO_BUFFER_SIZE] ALIGN(4);	// dma->i2s buffer
 };
 
@@ -63,6 +64,8 @@ int audio_init(struct audio_drv *audio);
 int audio_start(struct audio_drv *audio);
 void audio_wr(int16_t * dst, size_t n, float *ch_l, float *ch_r);
 void audio_stats(struct audio_drv *audio, int16_t * buf);
+uint32_t audio_time(struct audio_drv *audio);
+uint32_t audio_buffer_time(struct audio_drv *audio, int16_t * buf);
 void audio_master_volume(struct audio_drv *audio, uint8_t vol);
 
 //-----------------------------------------------------------------------------
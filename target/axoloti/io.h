@@ -28,6 +28,8 @@ IO Pin Assignments
 #define IO_AUDIO_LRCLK    GPIO_NUM(PORTE, 4)	// AF6: SAI1_FS_A
 #define IO_AUDIO_BCLK     GPIO_NUM(PORTE, 5)	// AF6: SAI1_SCK_A
 #define IO_AUDIO_DAC      GPIO_NUM(PORTE, 6)	// AF6: SAI1_SD_A
+#define IO_USB_DM         GPIO_NUM(PORTA, 11)	// AF10: usb otg fs D-
+#define IO_USB_DP         GPIO_NUM(PORTA, 12)	// AF10: usb otg fs D+
 
 //-----------------------------------------------------------------------------
 
@@ -41,6 +41,9 @@ static const struct gpio_info gpios[] = {
 	// serial port
 	{IO_UART_TX, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF8, 0},
 	{IO_UART_RX, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF8, 0},
+	// usb (otg fs function)
+	{IO_USB_DM, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF10, 0},
+	{IO_USB_DP, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF10, 0},
 	// audio
 	{IO_AUDIO_I2C_SCL, GPIO_MODER_IN, GPIO_OTYPER_PP, GPIO_OSPEEDR_LO, GPIO_PUPD_NONE, GPIO_AF0, 0},
 	{IO_AUDIO_I2C_SDA, GPIO_MODER_IN, GPIO_OTYPER_PP, GPIO_OSPEEDR_LO, GPIO_PUPD_NONE, GPIO_AF0, 0},
@@ -51,6 +54,50 @@ static const struct gpio_info gpios[] = {
 	{IO_AUDIO_DAC, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_FAST, GPIO_PUPD_NONE, GPIO_AF6, 0},
 };
 
+// sdram (FMC) pins
+#define FMC_PIN(port, pin) {GPIO_NUM(port, pin), GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF12, -1}
+
+static const struct gpio_info sdram_gpios[] = {
+	FMC_PIN(PORTC, 0),	// SDNWE
+	FMC_PIN(PORTC, 2),	// SDNE0
+	FMC_PIN(PORTC, 3),	// SDCKE0
+	FMC_PIN(PORTD, 0),	// D2
+	FMC_PIN(PORTD, 1),	// D3
+	FMC_PIN(PORTD, 8),	// D13
+	FMC_PIN(PORTD, 9),	// D14
+	FMC_PIN(PORTD, 10),	// D15
+	FMC_PIN(PORTD, 14),	// D0
+	FMC_PIN(PORTD, 15),	// D1
+	FMC_PIN(PORTE, 0),	// NBL0
+	FMC_PIN(PORTE, 1),	// NBL1
+	FMC_PIN(PORTE, 7),	// D4
+	FMC_PIN(PORTE, 8),	// D5
+	FMC_PIN(PORTE, 9),	// D6
+	FMC_PIN(PORTE, 10),	// D7
+	FMC_PIN(PORTE, 11),	// D8
+	FMC_PIN(PORTE, 12),	// D9
+	FMC_PIN(PORTE, 13),	// D10
+	FMC_PIN(PORTE, 14),	// D11
+	FMC_PIN(PORTE, 15),	// D12
+	FMC_PIN(PORTF, 0),	// A0
+	FMC_PIN(PORTF, 1),	// A1
+	FMC_PIN(PORTF, 2),	// A2
+	FMC_PIN(PORTF, 3),	// A3
+	FMC_PIN(PORTF, 4),	// A4
+	FMC_PIN(PORTF, 5),	// A5
+	FMC_PIN(PORTF, 11),	// SDNRAS
+	FMC_PIN(PORTF, 12),	// A6
+	FMC_PIN(PORTF, 13),	// A7
+	FMC_PIN(PORTF, 14),	// A8
+	FMC_PIN(PORTF, 15),	// A9
+	FMC_PIN(PORTG, 0),	// A10
+	FMC_PIN(PORTG, 1),	// A11
+	FMC_PIN(PORTG, 4),	// BA0
+	FMC_PIN(PORTG, 5),	// BA1
+	FMC_PIN(PORTG, 8),	// SDCLK
+	FMC_PIN(PORTG, 15),	// SDNCAS
+};
+
 //-----------------------------------------------------------------------------
 
 static struct ggm synth;
@@ -186,28 +233,51 @@ static struct adc_drv test_adc;
 //-----------------------------------------------------------------------------
 // random number generator
 
-#if 0
-// errors callback
-static void rng_err_callback(struct rng_drv *rng, uint32_t errors) {
-	DBG("rng error 0x%08x\r\n", errors);
+static struct rng_cfg ggm_rng_cfg = {
+	.mode = RNG_MODE_POLLED,
+};
+
+static struct rng_drv ggm_rng;
+
+// entropy pool producer: read a word if the rng has one ready
+static int rng_poll(uint32_t * x) {
+	return rng_rd(&ggm_rng, 0, x);
 }
 
-// data callback
-static void rng_data_callback(struct rng_drv *rng, uint32_t data) {
-	// do something with the data
+//-----------------------------------------------------------------------------
+// sdram (AS4C4M16SA, 4M x 16 bits)
+
+// SDCLK = HCLK/2 = 84 MHz
+// refresh = (64 ms / 4096 rows) * 84 MHz - 20
+static struct sdram_cfg ggm_sdram_cfg = {
+	.size = 8U << 20,
+	.sdcr = SDRAM_NC(8) | SDRAM_NR(12) | SDRAM_MWID(16) | SDRAM_NB(4) | SDRAM_CAS(3) | SDRAM_SDCLK(2) | SDRAM_RPIPE(1),
+	.sdtr = SDRAM_TMRD(2) | SDRAM_TXSR(7) | SDRAM_TRAS(4) | SDRAM_TRC(7) | SDRAM_TWR(2) | SDRAM_TRP(2) | SDRAM_TRCD(2),
+	.mode = SDRAM_MODE_BURST_LENGTH_1 | SDRAM_MODE_BURST_SEQUENTIAL | SDRAM_MODE_CAS(3) | SDRAM_MODE_WRITEBURST_SINGLE,
+	.refresh = 1292,
+	.nrfs = 8,
+	.stream = 0,
+};
+
+static struct sdram_drv ggm_sdram;
+
+void DMA2_Stream0_IRQHandler(void) {
+	sdram_isr(&ggm_sdram);
 }
-void HASH_RNG_IRQHandler(void) {
-	rng_isr(&ggm_rng);
+
+// external memory for the delay/chorus
+static void xmem_copy(void *dst, const void *src, size_t n) {
+	sdram_copy(&ggm_sdram, dst, src, n);
 }
-#endif
 
-static struct rng_cfg ggm_rng_cfg = {
-	.mode = RNG_MODE_POLLED,
-	//.err_callback = rng_err_callback,
-	//.data_callback = rng_data_callback,
-};
+static void xmem_wait(void) {
+	sdram_wait(&ggm_sdram);
+}
 
-static struct rng_drv ggm_rng;
+static struct xmem ggm_xmem = {
+	.copy = xmem_copy,
+	.wait = xmem_wait,
+};
 
 //-----------------------------------------------------------------------------
 // midi port (on USART2)
@@ -218,6 +288,9 @@ struct usart_cfg midi_serial_cfg = {
 	.data = 8,
 	.parity = 0,
 	.stop = 1,
+	.rx_dma = DMA2_BASE,
+	.rx_stream = 1,
+	.rx_chsel = 5,
 };
 
 struct usart_drv midi_serial;
@@ -226,6 +299,19 @@ void USART6_IRQHandler(void) {
 	usart_isr(&midi_serial);
 }
 
+void DMA2_Stream1_IRQHandler(void) {
+	usart_dma_isr(&midi_serial);
+}
+
+//-----------------------------------------------------------------------------
+// usb midi/audio device (on OTG FS)
+
+static struct usbd_drv ggm_usb;
+
+void OTG_FS_IRQHandler(void) {
+	usbd_isr(&ggm_usb);
+}
+
 //-----------------------------------------------------------------------------
 
 static void dump_clocks() {
@@ -261,6 +347,23 @@ int main(void) {
 		goto exit;
 	}
 
+	rc = gpio_init(sdram_gpios, sizeof(sdram_gpios) / sizeof(struct gpio_info));
+	if (rc != 0) {
+		DBG("gpio_init failed %d\r\n", rc);
+		goto exit;
+	}
+
+	rc = sdram_init(&ggm_sdram, &ggm_sdram_cfg);
+	if (rc != 0) {
+		DBG("sdram_init failed %d\r\n", rc);
+		goto exit;
+	}
+	ggm_xmem.base = (float *)ggm_sdram.base;
+	ggm_xmem.size = ggm_sdram.size / sizeof(float);
+	// setup the interrupts for the sdram dma
+	HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 8, 0);
+	NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+
 	rc = usart_init(&midi_serial, &midi_serial_cfg);
 	if (rc != 0) {
 		DBG("usart_init failed %d\r\n", rc);
@@ -269,17 +372,14 @@ int main(void) {
 	// setup the interrupts for the serial port
 	HAL_NVIC_SetPriority(USART6_IRQn, 10, 0);
 	NVIC_EnableIRQ(USART6_IRQn);
+	HAL_NVIC_SetPriority(DMA2_Stream1_IRQn, 10, 0);
+	NVIC_EnableIRQ(DMA2_Stream1_IRQn);
 
 	rc = rng_init(&ggm_rng, &ggm_rng_cfg);
 	if (rc != 0) {
 		DBG("rng_init failed %d\r\n", rc);
 		goto exit;
 	}
-#if 0
-	// Setup HASH_RNG interrupt
-	HAL_NVIC_SetPriority(HASH_RNG_IRQn, 10, 0);
-	HAL_NVIC_EnableIRQ(HASH_RNG_IRQn);
-#endif
 	rng_enable(&ggm_rng);
 
 	rc = adc_init(&test_adc, &test_adc_cfg);
@@ -294,12 +394,20 @@ int main(void) {
 		goto exit;
 	}
 
-	rc = ggm_init(&synth, &ggm_audio, &midi_serial);
+	rc = ggm_init(&synth, &ggm_audio, &midi_serial, &ggm_xmem);
 	if (rc != 0) {
 		DBG("ggm_init failed %d\r\n", rc);
 		goto exit;
 	}
 
+	rc = usb_init(&ggm_usb, &ggm_audio);
+	if (rc != 0) {
+		DBG("usb_init failed %d\r\n", rc);
+		goto exit;
+	}
+	HAL_NVIC_SetPriority(OTG_FS_IRQn, 10, 0);
+	NVIC_EnableIRQ(OTG_FS_IRQn);
+
 	rc = audio_start(&ggm_audio);
 	if (rc != 0) {
 		DBG("audio_start failed %d\r\n", rc);
@@ -314,6 +422,13 @@ int main(void) {
 		goto exit;
 	}
 
+	// the event loop fills the entropy pool from the rng when it is idle
+	rc = entropy_init(rng_poll, val);
+	if (rc != 0) {
+		DBG("entropy_init failed %d\r\n", rc);
+		goto exit;
+	}
+
 	dump_clocks();
 
 	DBG("init good\r\n");
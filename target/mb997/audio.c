@@ -30,6 +30,7 @@ static void audio_err_callback(struct dma_drv *dma, uint32_t errors) {
 // half transfer callback
 static void audio_ht_callback(struct dma_drv *dma, int idx) {
 	// dma is reading from the top half, so fill the bottom half
+	ggm_audio.blocks += 1;
 	int rc = event_wr(EVENT_TYPE_AUDIO | AUDIO_BLOCK_SIZE, &ggm_audio.buffer[0]);
 	if (rc != 0) {
 		DBG("event_wr error for ht callback\r\n");
@@ -39,6 +40,7 @@ static void audio_ht_callback(struct dma_drv *dma, int idx) {
 // transfer complete callback
 static void audio_tc_callback(struct dma_drv *dma, int idx) {
 	// dma is reading from the bottom half, so fill the top half
+	ggm_audio.blocks += 1;
 	int rc = event_wr(EVENT_TYPE_AUDIO | AUDIO_BLOCK_SIZE, &ggm_audio.buffer[HALF_AUDIO_BUFFER_SIZE]);
 	if (rc != 0) {
 		DBG("event_wr error for tc callback\r\n");
@@ -150,6 +152,7 @@ int audio_init(struct audio_drv *audio) {
 	// setup the stats
 	memset(&audio->stats, 0, sizeof(struct audio_stats));
 	audio->stats.min = AUDIO_BUFFER_SIZE;
+	audio->blocks = 0;
 
 	// setup the buffer
 	memset(audio->buffer, 0, sizeof(int16_t) * AUDIO_BUFFER_SIZE);
@@ -202,6 +205,33 @@ void audio_wr(int16_t * dst, size_t n, float *ch_l, float *ch_r) {
 
 //-----------------------------------------------------------------------------
 
+// return the sample clock (samples played since the dma started)
+uint32_t audio_time(struct audio_drv *audio) {
+	uint32_t saved = disable_irq();
+	uint32_t blocks = audio->blocks;
+	// samples into the dma buffer
+	uint32_t ofs = ((AUDIO_BUFFER_SIZE - dma_ndtr(&audio->dma)) >> 1) & ((AUDIO_BUFFER_SIZE >> 1) - 1);
+	restore_irq(saved);
+	// an even block count has the dma in the bottom half
+	if ((ofs >= AUDIO_BLOCK_SIZE) != (blocks & 1)) {
+		// the dma has moved to the next half, the interrupt is pending
+		blocks += 1;
+	}
+	return (blocks * AUDIO_BLOCK_SIZE) + (ofs & (AUDIO_BLOCK_SIZE - 1));
+}
+
+// return the sample clock time when a buffer half will start playing
+uint32_t audio_buffer_time(struct audio_drv *audio, int16_t * buf) {
+	uint32_t half = (buf == audio->buffer) ? 0 : 1;
+	uint32_t block = (audio_time(audio) / AUDIO_BLOCK_SIZE) + 1;
+	if ((block & 1) != half) {
+		block += 1;
+	}
+	return block * AUDIO_BLOCK_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+
 // report some metrics for realtime audio performance
 void audio_stats(struct audio_drv *audio, int16_t * buf) {
 	struct audio_stats *stats = &audio->stats;
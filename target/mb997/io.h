@@ -19,6 +19,8 @@ IO Pin Assignments
 #define IO_UART_TX        GPIO_NUM(PORTA, 2)	// AF7: serial port tx
 #define IO_UART_RX        GPIO_NUM(PORTA, 3)	// AF7: serial port rx
 #define IO_AUDIO_I2S_WS   GPIO_NUM(PORTA, 4)	// AF6: I2S3 channel clock
+#define IO_USB_DM         GPIO_NUM(PORTA, 11)	// AF10: usb otg fs D-
+#define IO_USB_DP         GPIO_NUM(PORTA, 12)	// AF10: usb otg fs D+
 
 #define IO_AUDIO_I2C_SCL  GPIO_NUM(PORTB, 6)	// GPIO: I2C clock (bitbanged)
 #define IO_AUDIO_I2C_SDA  GPIO_NUM(PORTB, 9)	// GPIO: I2C data (bitbanged)
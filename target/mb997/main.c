@@ -31,6 +31,9 @@ static const struct gpio_info gpios[] = {
 	// serial port (usart2 function)
 	{IO_UART_TX, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF7, 0},
 	{IO_UART_RX, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF7, 0},
+	// usb (otg fs function)
+	{IO_USB_DM, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF10, 0},
+	{IO_USB_DP, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_HI, GPIO_PUPD_NONE, GPIO_AF10, 0},
 	// display
 #if defined(SPI_DRIVER_HW)
 	{IO_LCD_SDO, GPIO_MODER_AF, GPIO_OTYPER_PP, GPIO_OSPEEDR_LO, GPIO_PUPD_NONE, GPIO_AF5, 0},
@@ -181,29 +184,17 @@ static struct adc_drv test_adc;
 //-----------------------------------------------------------------------------
 // random number generator
 
-#if 0
-// errors callback
-static void rng_err_callback(struct rng_drv *rng, uint32_t errors) {
-	DBG("rng error 0x%08x\r\n", errors);
-}
-
-// data callback
-static void rng_data_callback(struct rng_drv *rng, uint32_t data) {
-	// do something with the data
-}
-void HASH_RNG_IRQHandler(void) {
-	rng_isr(&ggm_rng);
-}
-#endif
-
 static struct rng_cfg ggm_rng_cfg = {
 	.mode = RNG_MODE_POLLED,
-	//.err_callback = rng_err_callback,
-	//.data_callback = rng_data_callback,
 };
 
 static struct rng_drv ggm_rng;
 
+// entropy pool producer: read a word if the rng has one ready
+static int rng_poll(uint32_t * x) {
+	return rng_rd(&ggm_rng, 0, x);
+}
+
 //-----------------------------------------------------------------------------
 // midi port (on USART2)
 
@@ -213,6 +204,9 @@ struct usart_cfg midi_serial_cfg = {
 	.data = 8,
 	.parity = 0,
 	.stop = 1,
+	.rx_dma = DMA1_BASE,
+	.rx_stream = 5,
+	.rx_chsel = 4,
 };
 
 struct usart_drv midi_serial;
@@ -221,6 +215,19 @@ void USART2_IRQHandler(void) {
 	usart_isr(&midi_serial);
 }
 
+void DMA1_Stream5_IRQHandler(void) {
+	usart_dma_isr(&midi_serial);
+}
+
+//-----------------------------------------------------------------------------
+// usb midi/audio device (on OTG FS)
+
+static struct usbd_drv ggm_usb;
+
+void OTG_FS_IRQHandler(void) {
+	usbd_isr(&ggm_usb);
+}
+
 //-----------------------------------------------------------------------------
 
 int main(void) {
@@ -255,17 +262,14 @@ int main(void) {
 	// setup the interrupts for the serial port
 	HAL_NVIC_SetPriority(USART2_IRQn, 10, 0);
 	NVIC_EnableIRQ(USART2_IRQn);
+	HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, 10, 0);
+	NVIC_EnableIRQ(DMA1_Stream5_IRQn);
 
 	rc = rng_init(&ggm_rng, &ggm_rng_cfg);
 	if (rc != 0) {
 		DBG("rng_init failed %d\r\n", rc);
 		goto exit;
 	}
-#if 0
-	// Setup HASH_RNG interrupt
-	HAL_NVIC_SetPriority(HASH_RNG_IRQn, 10, 0);
-	HAL_NVIC_EnableIRQ(HASH_RNG_IRQn);
-#endif
 	rng_enable(&ggm_rng);
 
 	rc = adc_init(&test_adc, &test_adc_cfg);
@@ -286,12 +290,20 @@ int main(void) {
 		goto exit;
 	}
 
-	rc = ggm_init(&synth, &ggm_audio, &midi_serial);
+	rc = ggm_init(&synth, &ggm_audio, &midi_serial, NULL);
 	if (rc != 0) {
 		DBG("ggm_init failed %d\r\n", rc);
 		goto exit;
 	}
 
+	rc = usb_init(&ggm_usb, &ggm_audio);
+	if (rc != 0) {
+		DBG("usb_init failed %d\r\n", rc);
+		goto exit;
+	}
+	HAL_NVIC_SetPriority(OTG_FS_IRQn, 10, 0);
+	NVIC_EnableIRQ(OTG_FS_IRQn);
+
 	rc = audio_start(&ggm_audio);
 	if (rc != 0) {
 		DBG("audio_start failed %d\r\n", rc);
@@ -306,6 +318,13 @@ int main(void) {
 		goto exit;
 	}
 
+	// the event loop fills the entropy pool from the rng when it is idle
+	rc = entropy_init(rng_poll, val);
+	if (rc != 0) {
+		DBG("entropy_init failed %d\r\n", rc);
+		goto exit;
+	}
+
 	DBG("init good\r\n");
 
 	rc = ggm_run(&synth);